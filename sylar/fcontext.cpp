@@ -0,0 +1,181 @@
+/**
+  ******************************************************************************
+  * @file           : fcontext.cpp
+  * @author         : 18483
+  * @brief          : None
+  * @attention      : 汇编以文件级 asm 写在这里，不需要构建系统支持 .S 文件
+  * @date           : 2025/4/16
+  ******************************************************************************
+  */
+
+#include "fcontext.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__)
+
+/*
+ * 栈布局 (低地址 -> 高地址)，rsp 指向第一项
+ *   0x00  mxcsr (4 字节) + x87 控制字 (2 字节)
+ *   0x08  r15
+ *   0x10  r14
+ *   0x18  r13
+ *   0x20  r12   新上下文中存放入口函数
+ *   0x28  rbx
+ *   0x30  rbp
+ *   0x38  返回地址  新上下文中为 sylar_fcontext_entry
+ */
+asm(R"(
+.text
+.globl sylar_jump_fcontext
+.type sylar_jump_fcontext,@function
+.align 16
+sylar_jump_fcontext:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    leaq -0x8(%rsp), %rsp
+    stmxcsr (%rsp)
+    fnstcw 0x4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 0x4(%rsp)
+    leaq 0x8(%rsp), %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+.size sylar_jump_fcontext,.-sylar_jump_fcontext
+
+.globl sylar_fcontext_entry
+.hidden sylar_fcontext_entry
+.type sylar_fcontext_entry,@function
+.align 16
+sylar_fcontext_entry:
+    .cfi_startproc
+    .cfi_undefined rip
+    xorl %ebp, %ebp
+    callq *%r12
+    callq abort@PLT
+    .cfi_endproc
+.size sylar_fcontext_entry,.-sylar_fcontext_entry
+.section .note.GNU-stack,"",%progbits
+.text
+)");
+
+#elif defined(__aarch64__)
+
+/*
+ * 注意: 以下实现还没有在 aarch64 上编译运行过 (test_fiber_switch / test_scheduler)，
+ *       CMake 在 aarch64 上默认 FIBER_ASM=OFF
+ *
+ * 栈布局 (低地址 -> 高地址)，sp 指向第一项
+ *   0x00  d8  d9
+ *   0x10  d10 d11
+ *   0x20  d12 d13
+ *   0x30  d14 d15
+ *   0x40  x19 x20   新上下文中 x19 存放入口函数
+ *   0x50  x21 x22
+ *   0x60  x23 x24
+ *   0x70  x25 x26
+ *   0x80  x27 x28
+ *   0x90  x29 x30   新上下文中 x30 为 sylar_fcontext_entry
+ *   0xa0  fpcr
+ */
+asm(R"(
+.text
+.globl sylar_jump_fcontext
+.type sylar_jump_fcontext,%function
+.align 4
+sylar_jump_fcontext:
+    sub sp, sp, #0xb0
+    stp d8, d9, [sp, #0x00]
+    stp d10, d11, [sp, #0x10]
+    stp d12, d13, [sp, #0x20]
+    stp d14, d15, [sp, #0x30]
+    stp x19, x20, [sp, #0x40]
+    stp x21, x22, [sp, #0x50]
+    stp x23, x24, [sp, #0x60]
+    stp x25, x26, [sp, #0x70]
+    stp x27, x28, [sp, #0x80]
+    stp x29, x30, [sp, #0x90]
+    mrs x9, fpcr
+    str x9, [sp, #0xa0]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldr x9, [sp, #0xa0]
+    msr fpcr, x9
+    ldp d8, d9, [sp, #0x00]
+    ldp d10, d11, [sp, #0x10]
+    ldp d12, d13, [sp, #0x20]
+    ldp d14, d15, [sp, #0x30]
+    ldp x19, x20, [sp, #0x40]
+    ldp x21, x22, [sp, #0x50]
+    ldp x23, x24, [sp, #0x60]
+    ldp x25, x26, [sp, #0x70]
+    ldp x27, x28, [sp, #0x80]
+    ldp x29, x30, [sp, #0x90]
+    add sp, sp, #0xb0
+    ret
+.size sylar_jump_fcontext,.-sylar_jump_fcontext
+
+.globl sylar_fcontext_entry
+.hidden sylar_fcontext_entry
+.type sylar_fcontext_entry,%function
+.align 4
+sylar_fcontext_entry:
+    .cfi_startproc
+    .cfi_undefined x30
+    mov x29, #0
+    blr x19
+    bl abort
+    .cfi_endproc
+.size sylar_fcontext_entry,.-sylar_fcontext_entry
+.section .note.GNU-stack,"",%progbits
+.text
+)");
+
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+extern "C" void sylar_fcontext_entry();
+
+namespace sylar {
+
+fcontext_t MakeFContext(void* stack, size_t size, void (*func)()) {
+    // 栈顶按 16 字节对齐
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    // 进入 sylar_fcontext_entry 时 rsp = top - 0x10，call 之前 16 字节对齐
+    uint64_t* sp = (uint64_t*)(top - 0x50);
+    for(int i = 0; i < 10; ++i) {
+        sp[i] = 0;
+    }
+    // 默认的 mxcsr (屏蔽所有浮点异常，就近舍入) 和 x87 控制字
+    sp[0] = 0x1f80 | ((uint64_t)0x037f << 32);
+    sp[4] = (uint64_t)func;
+    sp[7] = (uint64_t)&sylar_fcontext_entry;
+#else
+    uint64_t* sp = (uint64_t*)(top - 0xb0);
+    for(int i = 0; i < 22; ++i) {
+        sp[i] = 0;
+    }
+    sp[8] = (uint64_t)func;
+    sp[19] = (uint64_t)&sylar_fcontext_entry;
+#endif
+    return sp;
+}
+
+}
+
+#endif
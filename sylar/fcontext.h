@@ -0,0 +1,49 @@
+/**
+  ******************************************************************************
+  * @file           : fcontext.h
+  * @author         : 18483
+  * @brief          : 汇编实现的协程上下文切换
+  * @attention      : 支持 x86-64 和 aarch64，定义 SYLAR_FIBER_ASM 时 Fiber 使用
+  *                    (aarch64 未经实测，构建时默认不开启)
+  * @date           : 2025/4/16
+  ******************************************************************************
+  */
+
+
+#ifndef SYLAR_FCONTEXT_H
+#define SYLAR_FCONTEXT_H
+
+#include <cstddef>
+
+#if defined(SYLAR_FIBER_ASM) && !defined(__x86_64__) && !defined(__aarch64__)
+#error "SYLAR_FIBER_ASM only supports x86-64 and aarch64, build with -DFIBER_ASM=OFF"
+#endif
+
+namespace sylar {
+
+/**
+ * @brief 协程上下文，即切出时的栈顶指针
+ * @details 切换时只在栈上保存被调用者保存的寄存器 (以及浮点控制字)，
+ *          不保存信号屏蔽字，因此没有 rt_sigprocmask 系统调用
+ */
+typedef void* fcontext_t;
+
+/**
+ * @brief 在新栈上创建上下文，第一次切换到该上下文时执行 func
+ * @param stack 栈的低地址
+ * @param size 栈大小
+ * @param func 入口函数，不能返回 (返回时程序终止)
+ */
+fcontext_t MakeFContext(void* stack, size_t size, void (*func)());
+
+}
+
+extern "C" {
+/**
+ * @brief 保存当前上下文到 *from，切换到 to
+ * @details 之后有别的上下文切换回 *from 时，本函数返回
+ */
+void sylar_jump_fcontext(sylar::fcontext_t* from, sylar::fcontext_t to);
+}
+
+#endif //SYLAR_FCONTEXT_H
@@ -11,12 +11,16 @@
 
 #include "fd_manager.h"
 #include "hook.h"
+#include "iomanager.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 namespace sylar {
 
+/// FdCtx 代数计数
+static std::atomic<uint64_t> s_fdGeneration = {0};
+
 FdCtx::FdCtx(int fd)
     :m_isInit(false)
     ,m_isSocket(false)
@@ -25,11 +29,17 @@ FdCtx::FdCtx(int fd)
     ,m_isClosed(false)
     ,m_fd(fd)
     ,m_recvTimeout(-1)
-    ,m_sendTimeout(-1) {
+    ,m_sendTimeout(-1)
+    ,m_generation(++s_fdGeneration) {
     init();
 }
 
 FdCtx::~FdCtx(){
+    for(auto& i : m_timeouts) {
+        if(i.timer) {
+            i.timer->cancle();
+        }
+    }
 }
 
 /// 初始化文件描述符上下文
@@ -59,8 +69,9 @@ bool FdCtx::init() {
     if(m_isSocket) {
         int flags = fcntl_f(m_fd, F_GETFL, 0);
         // 如果用户没有设置非阻塞 设置为非阻塞
+        // (直接调用系统函数: hook 的 fcntl 会在 FdManager 持有写锁时再加读锁)
         if(!(flags & O_NONBLOCK)) {
-            fcntl(m_fd, F_SETFL, flags | O_NONBLOCK);
+            fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK);
         }
         m_sysNonblock = true;
     } else {
@@ -97,6 +108,66 @@ uint64_t FdCtx::getTimeout(int type){
     }
 }
 
+void FdCtx::OnTimeout(std::weak_ptr<FdCtx> weak, int idx, IOManager* iom, int event
+                      , uint64_t gen) {
+    FdCtx::ptr ctx = weak.lock();
+    if(!ctx) {
+        return;
+    }
+    IoTimeout& t = ctx->m_timeouts[idx];
+    uint64_t state = IoTimeout::Pack(gen, IoTimeout::WAITING);
+    if(t.state.compare_exchange_strong(state, IoTimeout::Pack(gen, IoTimeout::TIMEDOUT))) {
+        iom->cancleEvent(ctx->m_fd, (IOManager::Event)event);
+        return;
+    }
+    // 等待已经结束，这次超时作废; 旧定时器 (代数不同) 的回调什么也不做
+    state = IoTimeout::Pack(gen, IoTimeout::STALE);
+    t.state.compare_exchange_strong(state, IoTimeout::Pack(gen, IoTimeout::IDLE));
+}
+
+void FdCtx::armTimeout(int type, IOManager* iom, int event, uint64_t ms, uint64_t slack) {
+    int idx = type == SO_RCVTIMEO ? 0 : 1;
+    IoTimeout& t = m_timeouts[idx];
+    if(t.timer && t.iomId != iom->getId()) {
+        // 换了 IO 调度器: 旧调度器可能已经析构，不能再操作它的定时器，直接丢弃
+        // 旧调度器还在时定时器到期后回调发现代数不同，什么也不做
+        t.timer.reset();
+    }
+    if(!t.timer || (t.state & IoTimeout::STATUS_MASK) == IoTimeout::STALE) {
+        // 第一次等待，换了 IO 调度器，或者上一次的超时回调还没执行
+        // 换一个新代数的定时器，旧回调执行时发现代数不同直接忽略
+        if(t.timer) {
+            t.timer->cancle();
+        }
+        ++t.gen;
+        t.timer = iom->addReusableTimer(std::bind(&FdCtx::OnTimeout
+                    , std::weak_ptr<FdCtx>(shared_from_this()), idx, iom, event, t.gen)
+                    , slack);
+        t.iomId = iom->getId();
+    }
+    t.state = IoTimeout::Pack(t.gen, IoTimeout::WAITING);
+    t.timer->arm(ms);
+}
+
+bool FdCtx::disarmTimeout(int type) {
+    IoTimeout& t = m_timeouts[type == SO_RCVTIMEO ? 0 : 1];
+    if(!t.timer) {
+        return false;
+    }
+    if(t.timer->cancle()) {
+        t.state = IoTimeout::Pack(t.gen, IoTimeout::IDLE);
+        return false;
+    }
+    // 定时器已经到期: 回调还未执行则标记作废，本次等待不算超时
+    uint64_t state = IoTimeout::Pack(t.gen, IoTimeout::WAITING);
+    if(t.state.compare_exchange_strong(state, IoTimeout::Pack(t.gen, IoTimeout::STALE))) {
+        return false;
+    }
+    // 回调已执行，事件是被它取消的
+    t.state = IoTimeout::Pack(t.gen, IoTimeout::IDLE);
+    return true;
+}
+
 FdManager::FdManager() {
     m_datas.resize(64);
 }
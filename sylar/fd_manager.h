@@ -14,11 +14,15 @@
 
 #include <memory>
 #include <vector>
+#include <atomic>
 #include "thread.h"
 #include "singleton.h"
+#include "timer.h"
 
 namespace sylar {
 
+class IOManager;
+
 /*
  * FdCtx 存储每一个 fd 相关的信息
  * FdManager(单例类) 管理每一个 FdCtx
@@ -93,12 +97,72 @@ public:
      */
     uint64_t getTimeout(int type);
 
+    /**
+     * @brief 开始等待 IO，ms 毫秒后仍未就绪则取消 iom 上的 event 事件，唤醒等待的协程
+     * @param type 类型 SO_RCVTIMEO(读超时)，SO_SNDTIMEO(写超时)
+     * @param iom 等待事件的 IO 调度器
+     * @param event 等待的事件 (IOManager::Event)
+     * @param ms 超时时间毫秒
+     * @param slack 定时器允许推迟的毫秒数
+     * @details 每个方向一个可复用定时器，第一次等待时创建，
+     *          之后设置和取消都不分配内存 (仅限时间轮后端，见 TimerManager::addReusableTimer)
+     */
+    void armTimeout(int type, IOManager* iom, int event, uint64_t ms, uint64_t slack);
+
+    /**
+     * @brief 结束等待，取消超时定时器
+     * @param type 类型 SO_RCVTIMEO(读超时)，SO_SNDTIMEO(写超时)
+     * @return 本次等待是否已超时 (超时回调已执行并取消了事件)
+     */
+    bool disarmTimeout(int type);
+
+    /**
+     * @brief 返回代数，每个 FdCtx 不同 (从 1 开始递增)
+     * @details 句柄号被复用时用来区分新旧 FdCtx，IOManager 据此判断持久注册是否属于当前的 fd
+     */
+    uint64_t getGeneration() const { return m_generation; }
+
 private:
     /**
      * @brief 初始化
      */
     bool init();
 
+    /**
+     * @brief 超时定时器回调，取消事件唤醒等待的协程
+     * @param idx m_timeouts 的下标
+     * @param gen 定时器的代数，和当前代数不同说明是已替换的旧定时器
+     */
+    static void OnTimeout(std::weak_ptr<FdCtx> weak, int idx, IOManager* iom, int event
+                          , uint64_t gen);
+
+    /**
+     * @brief 一个方向的 IO 超时
+     */
+    struct IoTimeout {
+        /// 可复用定时器
+        Timer::ptr timer;
+        /// 定时器所属的 IO 调度器的编号 (IOManager::getId)
+        /// 调度器析构后定时器和它所在的分片随之失效，地址可能被新的调度器复用，不能按指针比较
+        uint64_t iomId = 0;
+        /// 定时器的代数，每次新建定时器加 1 (只由等待的协程读写)
+        uint64_t gen = 0;
+        /// 代数 << 2 | 状态，回调和等待的协程用一次 CAS 交接
+        std::atomic<uint64_t> state = {0};
+
+        /// 空闲
+        static constexpr uint64_t IDLE = 0;
+        /// 等待中
+        static constexpr uint64_t WAITING = 1;
+        /// 回调已执行，事件已取消
+        static constexpr uint64_t TIMEDOUT = 2;
+        /// 等待已结束但回调还未执行 (回调执行时忽略，下次等待换新定时器)
+        static constexpr uint64_t STALE = 3;
+        static constexpr uint64_t STATUS_MASK = 3;
+
+        static uint64_t Pack(uint64_t gen, uint64_t status) { return gen << 2 | status; }
+    };
+
 private:
     /// 是否初始化
     bool m_isInit : 1;
@@ -116,6 +180,10 @@ private:
     uint64_t m_recvTimeout;
     /// 写超时时间毫秒
     uint64_t m_sendTimeout;
+    /// 读/写超时定时器
+    IoTimeout m_timeouts[2];
+    /// 代数
+    uint64_t m_generation;
 };
 
 
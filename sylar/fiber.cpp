@@ -14,7 +14,12 @@
 #include "macro.h"
 #include "log.h"
 #include "scheduler.h"
+#include "util.h"
+#include "stack_profiler.h"
 #include <atomic>
+#include <string.h>
+#include <algorithm>
+#include <stdlib.h>
 
 namespace sylar{
 
@@ -36,31 +41,73 @@ static thread_local Fiber::ptr t_threadFiber = nullptr;
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
         Config::Lookup<uint32_t>("fiber.stack_size", 128 * 1024, "fiber stack size");
 
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+        Config::Lookup<uint32_t>("fiber.shared_stack_size", 1024 * 1024
+                , "per-thread shared stack size for shared-stack fibers");
+
+/// 创建协程时读取，避免每次都加配置锁
+static uint32_t s_fiber_stack_size = 128 * 1024;
+
+struct _FiberIniter {
+    _FiberIniter() {
+        s_fiber_stack_size = g_fiber_stack_size->getValue();
+        g_fiber_stack_size->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "fiber stack size changed from "
+                                     << old_value << " to " << new_value;
+            s_fiber_stack_size = new_value;
+        });
+    }
+};
+static _FiberIniter s_fiber_initer;
 
 /**
- * @brief 协程 内存分配器
+ * @brief 协程局部存储槽的登记表，槽只分配不回收
  */
-class MallocStackAllocator{
-public:
-    /**
-     * @brief 分配指定大小的内存
-     * @return 返回指向分配内存的指针
-     */
-    static void* Alloc(size_t size) {
-        return malloc(size);
-    }
+struct LocalSlotTable {
+    std::atomic<size_t> count = {0};
+    Fiber::LocalDestroy destroy[Fiber::LOCAL_SLOTS] = {};
+};
 
-    /**
-     * @brief 释放内存
-     * @param vp 指向需要释放的内存指针
-     * @param size
-     */
-    static void Dealloc(void* vp, size_t size) {
-        return free(vp);
+static LocalSlotTable s_local_slots;
+
+// 共享栈协程拷贝出来的栈内容总字节数
+static std::atomic<uint64_t> s_saved_stack_bytes{0};
+
+/**
+ * @brief 线程共享栈
+ */
+struct Fiber::SharedStack {
+    /// 分配共享栈的分配器
+    StackAllocator::ptr allocator;
+    /// 栈的低地址
+    char* stack = nullptr;
+    /// 栈大小
+    size_t size = 0;
+    /// 栈内容属于哪个协程
+    Fiber* occupant = nullptr;
+    /// 绑定在本栈上尚未结束的协程数
+    size_t fibers = 0;
+
+    /// 栈顶 (高地址)
+    char* top() const { return stack + size; }
+};
+
+/**
+ * @brief 线程退出时释放共享栈
+ */
+struct SharedStackHolder {
+    Fiber::SharedStack* stack = nullptr;
+    ~SharedStackHolder() {
+        if(stack) {
+            stack->allocator->dealloc(stack->stack, stack->size);
+            delete stack;
+        }
     }
 };
 
-using StackAllocator = MallocStackAllocator;
+static thread_local SharedStackHolder t_shared_stack;
+
+
 
 
 uint64_t Fiber::GetFiberId() {
@@ -83,11 +130,14 @@ Fiber::Fiber() {
     // 设置当前协程为当前线程的主协程
     SetThis(this);  // this指针指向当前协程对象
 
+#ifndef SYLAR_FIBER_ASM
     //获取当前协程上下文信息保存到 m_ctx 中
     if(getcontext(&m_ctx)) {
         //成功返回0，失败返回-1 触发断言失败
         SYLAR_ASSERT2(false, "getcontext");
     }
+#endif
+    // 汇编实现时主协程的上下文在第一次切出时保存
 
     ++s_fiber_count; //增加协程计数
 
@@ -95,33 +145,39 @@ Fiber::Fiber() {
 }
 
 ///有参构造 构造子协程对象
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+Fiber::Fiber(Task cb, size_t stacksize, bool use_caller, bool shared_stack)
     :m_id(++s_fiber_id)
-    ,m_cb(cb){
+    ,m_cb(std::move(cb))
+    ,m_shared(shared_stack) {
 
     ++s_fiber_count;
+    if(m_shared) {
+        // 栈在第一次执行时绑定，上下文也在那时创建
+        SYLAR_ASSERT2(!use_caller, "shared stack fiber does not support use_caller");
+        SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id << " shared stack";
+        return;
+    }
     //若给定初始化值用给定值，若没有用约定值 128KB
-    m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
-
-    // 分配指定大小的协程栈空间
-    m_stack = StackAllocator::Alloc(m_stacksize);
-    //获取当前协程上下文信息保存到 m_ctx 中
-    if(getcontext(&m_ctx)){
-        SYLAR_ASSERT2(false, "getcontext");
+    m_stacksize = stacksize ? stacksize : s_fiber_stack_size;
+
+    // 分配指定大小的协程栈空间，协程持有分配器直到归还栈
+    m_allocator = StackAllocator::GetDefault();
+    m_stack = m_allocator->alloc(m_stacksize);
+    SYLAR_ASSERT2(m_stack, "alloc fiber stack");
+
+    if(StackProfiler::IsEnabled()) {
+        // 先填充再创建上下文，入口栈帧也算作用量
+        m_profile = true;
+        StackProfiler::Paint(m_stack, m_stacksize);
+        m_entryTarget = m_cb.target();
+        m_entryType = m_cb.type();
     }
 
-    //uc_link 置空，执行完当前context之后退出
-    m_ctx.uc_link = nullptr;
-    // 初始化栈指针
-    m_ctx.uc_stack.ss_sp = m_stack;
-    // 初始化栈大小
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
     // 指明 context 入口函数 创建上下文
     if(!use_caller) {
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);   // swapout
+        makeContext(&Fiber::MainFunc);   // swapout
     } else {
-        makecontext(&m_ctx, &Fiber::CallMainFunc, 0);  // back
+        makeContext(&Fiber::CallMainFunc);  // back
     }
     // 输出调试信息，协程构造完成
     SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
@@ -131,14 +187,23 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
 ///释放协程 栈空间
 Fiber::~Fiber(){
     --s_fiber_count;
+    clearLocals();
     // 根据内存是否为空，进行不同的释放操作
-    if(m_stack){
+    if(m_shared) {
+        SYLAR_ASSERT(m_state == TERM
+                || m_state == EXCEPT
+                || m_state == INIT);
+        // 结束时已经解绑，只剩拷贝缓冲区
+        SYLAR_ASSERT(!m_sharedStack);
+        s_saved_stack_bytes -= m_savedCap;
+        free(m_savedStack);
+    } else if(m_stack){
         // 有栈，子协程，确保子协程未执行
         SYLAR_ASSERT(m_state == TERM
                 || m_state == EXCEPT
                 || m_state == INIT)
         // 释放运行栈
-        StackAllocator::Dealloc(m_stack, m_stacksize);
+        m_allocator->dealloc(m_stack, m_stacksize);
     } else {
         // 没有栈 （主协程）
         SYLAR_ASSERT(!m_cb); //确保没有执行函数
@@ -156,31 +221,201 @@ Fiber::~Fiber(){
 }
 
 ///重置协程函数， 并重置状态
-void Fiber::reset(std::function<void()> cb) {
+void Fiber::reset(Task cb) {
     /*
      * 协程处于 初始化INIT, 终止TERM, 异常EXCEPT 才允许重置
      * 重复利用已结束的协程，复用其栈空间，创建新协程
      */
     //确保栈存在
-    SYLAR_ASSERT(m_stack);
+    SYLAR_ASSERT(m_stack || m_shared);
     SYLAR_ASSERT(m_state == TERM
                  || m_state == EXCEPT
                  || m_state == INIT)
     // 设置新的回调函数
-    m_cb = cb;
-    // 获取当前上下文
-    if(getcontext(&m_ctx)) {
+    m_cb = std::move(cb);
+    clearLocals();
+    if(m_shared) {
+        // 共享栈协程在第一次执行时创建上下文
+        SYLAR_ASSERT(!m_sharedStack);
+        m_savedSize = 0;
+    } else {
+        if(m_profile) {
+            // 上次执行之外的部分仍是填充值，只需重新填充用过的部分
+            StackProfiler::Paint(static_cast<char*>(m_stack) + m_stacksize - m_stackUsed, m_stackUsed);
+            m_stackUsed = 0;
+            m_entryTarget = m_cb.target();
+            m_entryType = m_cb.type();
+        }
+        // 指定协程的入口函数
+        makeContext(&Fiber::MainFunc);
+    }
+    //设置为 INIT状态，表示协程已完成初始化，可以执行
+    m_state = INIT;
+}
+
+void Fiber::makeContext(void (*func)()) {
+#ifdef SYLAR_FIBER_ASM
+    m_ctx = MakeFContext(m_stack, m_stacksize, func);
+#else
+    //获取当前协程上下文信息保存到 m_ctx 中
+    if(getcontext(&m_ctx)){
         SYLAR_ASSERT2(false, "getcontext");
     }
-    //初始化
+    //uc_link 置空，执行完当前context之后退出
     m_ctx.uc_link = nullptr;
+    // 初始化栈指针
     m_ctx.uc_stack.ss_sp = m_stack;
+    // 初始化栈大小
     m_ctx.uc_stack.ss_size = m_stacksize;
+    makecontext(&m_ctx, func, 0);
+#endif
+}
 
-    // 通过makecontext 指定协程的入口函数
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    //设置为 INIT状态，表示协程已完成初始化，可以执行
-    m_state = INIT;
+void Fiber::SwitchContext(Fiber* from, Fiber* to) {
+#ifdef SYLAR_FIBER_ASM
+    sylar_jump_fcontext(&from->m_ctx, to->m_ctx);
+    // 切出时的栈顶就是 m_ctx，拷贝时直接使用
+#else
+    if(from->m_shared) {
+        // swapcontext 的栈帧在当前栈帧之下，多留一些余量
+        uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+        from->m_stackSp = (char*)(sp - 256);
+    }
+    if(swapcontext(&from->m_ctx, &to->m_ctx)) {
+        SYLAR_ASSERT2(false, "swapcontext");
+    }
+#endif
+}
+
+void Fiber::enterSharedStack() {
+    SharedStack* ss = t_shared_stack.stack;
+    if(!ss) {
+        ss = new SharedStack;
+        ss->allocator = StackAllocator::GetDefault();
+        ss->size = g_fiber_shared_stack_size->getValue();
+        ss->stack = static_cast<char*>(ss->allocator->alloc(ss->size));
+        SYLAR_ASSERT2(ss->stack, "alloc shared stack");
+        t_shared_stack.stack = ss;
+    }
+    bool first = !m_sharedStack;
+    if(first) {
+        // 第一次执行，绑定本线程的共享栈
+        SYLAR_ASSERT(m_state == INIT);
+        m_sharedStack = ss;
+        m_ownerThread = GetThreadId();
+        ++ss->fibers;
+    }
+    SYLAR_ASSERT2(m_sharedStack == ss, "shared stack fiber id=" + std::to_string(m_id)
+                  + " resumed on thread " + std::to_string(GetThreadId())
+                  + ", owner thread " + std::to_string(m_ownerThread));
+    if(ss->occupant == this) {
+        return;
+    }
+    // 新协程的初始上下文和恢复的栈内容都会覆盖栈顶，占用者需要先拷贝出去
+    if(ss->occupant) {
+        ss->occupant->saveStack();
+    }
+    if(first) {
+        m_stack = ss->stack;
+        m_stacksize = ss->size;
+        makeContext(&Fiber::MainFunc);
+        m_stack = nullptr;
+        m_savedSize = 0;
+    } else if(m_savedSize) {
+        memcpy(ss->top() - m_savedSize, m_savedStack, m_savedSize);
+    }
+    ss->occupant = this;
+}
+
+void Fiber::leaveSharedStack() {
+    if(m_state != TERM && m_state != EXCEPT) {
+        return;
+    }
+    SharedStack* ss = m_sharedStack;
+    if(!ss) {
+        return;
+    }
+    if(ss->occupant == this) {
+        ss->occupant = nullptr;
+    }
+    --ss->fibers;
+    m_sharedStack = nullptr;
+    m_ownerThread = -1;
+    m_savedSize = 0;
+    s_saved_stack_bytes -= m_savedCap;
+    free(m_savedStack);
+    m_savedStack = nullptr;
+    m_savedCap = 0;
+}
+
+void Fiber::saveStack() {
+    SharedStack* ss = m_sharedStack;
+#ifdef SYLAR_FIBER_ASM
+    char* sp = static_cast<char*>(m_ctx);
+#else
+    char* sp = std::max(m_stackSp, ss->stack);
+#endif
+    size_t used = ss->top() - sp;
+    // 缓冲区过小或者明显过大时重新分配，保持与实际栈深度相当
+    if(m_savedCap < used || m_savedCap > used * 2) {
+        s_saved_stack_bytes -= m_savedCap;
+        free(m_savedStack);
+        m_savedStack = static_cast<char*>(malloc(used));
+        SYLAR_ASSERT2(m_savedStack, "malloc saved stack");
+        m_savedCap = used;
+        s_saved_stack_bytes += m_savedCap;
+    }
+    memcpy(m_savedStack, sp, used);
+    m_savedSize = used;
+}
+
+void Fiber::recordStackUsage() {
+    m_stackUsed = StackProfiler::Measure(m_stack, m_stacksize);
+    StackProfiler::Record(m_entryTarget, m_entryType, m_stackUsed, m_stacksize);
+}
+
+uint32_t Fiber::StackSizeFor(const Task& cb) {
+    uint32_t size = s_fiber_stack_size;
+    if(StackProfiler::IsAdaptive()) {
+        size_t suggested = StackProfiler::SuggestStackSize(cb, size);
+        if(suggested) {
+            size = suggested;
+        }
+    }
+    return size;
+}
+
+void Fiber::clearLocals() {
+    while(m_localMask) {
+        size_t slot = __builtin_ctz(m_localMask);
+        // 先清除标记，析构值时再访问这个槽会得到空值
+        m_localMask &= ~(1u << slot);
+        void* value = m_locals[slot];
+        m_locals[slot] = nullptr;
+        s_local_slots.destroy[slot](value);
+    }
+}
+
+size_t Fiber::RegisterLocal(LocalDestroy destroy) {
+    size_t slot = s_local_slots.count++;
+    SYLAR_ASSERT2(slot < LOCAL_SLOTS, "too many FiberLocal, LOCAL_SLOTS=" + std::to_string(LOCAL_SLOTS));
+    s_local_slots.destroy[slot] = destroy;
+    return slot;
+}
+
+Fiber* Fiber::Current() {
+    if(t_fiber) {
+        return t_fiber;
+    }
+    return GetThis().get();
+}
+
+uint64_t Fiber::TotalSavedStackBytes() {
+    return s_saved_stack_bytes;
+}
+
+size_t Fiber::SharedStackFibers() {
+    return t_shared_stack.stack ? t_shared_stack.stack->fibers : 0;
 }
 
 void Fiber::call(){
@@ -188,8 +423,9 @@ void Fiber::call(){
     SetThis(this);
     m_state = EXEC;
     //切换上下文到目标协程上下文，执行协程
-    if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
+    SwitchContext(t_threadFiber.get(), this);
+    if(m_profile && (m_state == TERM || m_state == EXCEPT)) {
+        recordStackUsage();
     }
 }
 
@@ -197,27 +433,29 @@ void Fiber::back() {
     // 从当前协程返回到主协程或者线程协程
     SetThis(t_threadFiber.get());
     // 切换回主协程的上下文
-    if(swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
-    }
+    SwitchContext(this, t_threadFiber.get());
 }
 
 ///切换到当前 子协程执行
 void Fiber::swapIn() {
     SetThis(this);
     SYLAR_ASSERT(m_state != EXEC);
+    if(m_shared) {
+        enterSharedStack();
+    }
     m_state = EXEC;
-    if(swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
+    SwitchContext(Scheduler::GetMainFiber(), this);
+    if(m_shared) {
+        leaveSharedStack();
+    } else if(m_profile && (m_state == TERM || m_state == EXCEPT)) {
+        recordStackUsage();
     }
 }
 
 ///切换到主协程 （子协程切换到后台）
 void Fiber::swapOut() {
     SetThis(Scheduler::GetMainFiber());
-    if(swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
-    }
+    SwitchContext(this, Scheduler::GetMainFiber());
 }
 
 /// 设置当前协程
@@ -250,7 +488,12 @@ void Fiber::YiledToReady() {
 void Fiber::YiledToHold() {
     Fiber::ptr cur = GetThis();
     SYLAR_ASSERT(cur->m_state ==EXEC);
-    cur->m_state = HOLD;
+    // 调度器中的协程保持 EXEC，切换完成后由 Scheduler::run 设置为 HOLD
+    // 提前设置时，协程在切出之前就可能被其他线程的 IO 事件唤醒并执行，
+    // 之后 run 再把正在执行的协程改成 HOLD
+    if(!Scheduler::GetThis()) {
+        cur->m_state = HOLD;
+    }
     cur->swapOut();
 }
 
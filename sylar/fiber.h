@@ -12,22 +12,35 @@
 #ifndef SYLAR_FIBER_H
 #define SYLAR_FIBER_H
 
+#include <atomic>
 #include <memory>
 #include <functional>
 #include <ucontext.h>
 
+#include "task.h"
+#include "stack_allocator.h"
+#include "fcontext.h"
+
 namespace sylar{
 
 class Scheduler;
+template<class T> class FiberLocal;
 
 /**
  * @brief 协程类
  */
 class Fiber : public std::enable_shared_from_this<Fiber> {
     friend class Scheduler;
+    template<class T> friend class FiberLocal;
 public:
     typedef std::shared_ptr<Fiber> ptr;
 
+    /// 协程局部存储的槽数，每个 FiberLocal 占一个
+    static const size_t LOCAL_SLOTS = 8;
+
+    /// 释放协程局部存储的值
+    typedef void (*LocalDestroy)(void* value);
+
     /**
      * @brief 协程状态
      */
@@ -47,6 +60,62 @@ public:
     };
 
 private:
+    /**
+     * @brief 在协程栈上创建上下文
+     * @param func 入口函数 MainFunc 或 CallMainFunc
+     */
+    void makeContext(void (*func)());
+
+    /**
+     * @brief 保存当前上下文到 from，切换到 to 的上下文
+     */
+    static void SwitchContext(Fiber* from, Fiber* to);
+
+    /**
+     * @brief 切换到共享栈协程之前，把占用共享栈的其他协程拷贝出去，再恢复本协程的栈
+     */
+    void enterSharedStack();
+
+    /**
+     * @brief 共享栈协程切回后，如已结束则与共享栈解绑
+     */
+    void leaveSharedStack();
+
+    /**
+     * @brief 把共享栈上已用的部分拷贝到 m_savedStack
+     */
+    void saveStack();
+
+    /**
+     * @brief 协程结束后测量并记录本次执行的栈用量
+     */
+    void recordStackUsage();
+
+    /**
+     * @brief 释放所有协程局部存储的值
+     */
+    void clearLocals();
+
+    /**
+     * @brief 登记一个协程局部存储槽
+     * @param destroy 协程复用或析构时释放槽中的值
+     * @return 槽的下标，槽用完时断言失败
+     */
+    static size_t RegisterLocal(LocalDestroy destroy);
+
+    /**
+     * @brief 返回当前协程，线程还没有协程时创建主协程 (不增加引用计数)
+     */
+    static Fiber* Current();
+
+public:
+    /**
+     * @brief 线程共享栈
+     */
+    struct SharedStack;
+
+private:
+
     /**
      * @brief 无参构造函数
      * @attention 每个线程第一个主协程的构造
@@ -58,11 +127,20 @@ public:
     /**
      * @brief 有参构造函数
      * @attention 用于子协程的构造
-     * @param cb 协程执行的函数
-     * @param stacksize 协程栈的大小
+     * @param cb 协程执行的函数 (移动到协程内，小对象不分配堆内存)
+     * @param stacksize 协程栈的大小 (共享栈模式下忽略)
      * @param use_caller 是否在 MainFiber 上调度
+     * @param shared_stack 是否使用线程共享栈
+     * @details 共享栈模式下协程没有独立的栈，运行在所在线程的共享栈 (fiber.shared_stack_size) 上，
+     *          其他协程要使用共享栈时，把本协程已用的部分拷贝到恰好大小的缓冲区，恢复执行时再拷贝回去，
+     *          空闲协程占用的内存取决于实际栈深度而不是栈大小
+     *          拷贝回的栈必须在原地址，因此协程第一次执行后就只能在该线程恢复 (见 getOwnerThread)，
+     *          只支持 swapIn/swapOut (不支持 use_caller)
+     * @attention 共享栈协程挂起期间，栈上对象的地址被其他协程的栈内容占用，
+     *            不能把指向栈上对象的指针交给其他协程在此期间访问
+     *            开启 fiber.stack_profile 时，独立栈协程结束后记录栈用量 (见 StackProfiler)
      */
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    Fiber(Task cb, size_t stacksize = 0, bool use_caller = false, bool shared_stack = false);
 
     /**
      * @brief 析构函数
@@ -73,8 +151,9 @@ public:
      * @brief 重置协程执行函数，并设置状态
      * @param cb
      * @details 重复利用已结束的协程，复用其栈空间，创建新协程
+     *          协程局部存储 (FiberLocal) 的值在这里清空
      */
-    void reset(std::function<void()> cb);
+    void reset(Task cb);
 
     /**
      * @brief 将当前协程切换到运行状态
@@ -106,9 +185,27 @@ public:
 
     /**
      * @brief 返回协程状态
+     * @details acquire 读取，与切出后 Scheduler::run 的 release 写 HOLD 配对，
+     *          读到非 EXEC 时协程保存的上下文和栈对本线程可见
      * @return
      */
-    State getState() const {return m_state;}
+    State getState() const {return m_state.load(std::memory_order_acquire);}
+
+    /**
+     * @brief 是否使用线程共享栈
+     */
+    bool isSharedStack() const { return m_shared; }
+
+    /**
+     * @brief 返回协程必须在哪个线程恢复执行
+     * @return 共享栈协程已开始执行且未结束时返回所在线程 id，否则返回 -1
+     */
+    int getOwnerThread() const { return m_ownerThread; }
+
+    /**
+     * @brief 返回协程栈大小 (共享栈协程未执行时为 0)
+     */
+    uint32_t getStackSize() const { return m_stacksize; }
 
 public:
     /**
@@ -129,6 +226,7 @@ public:
 
     /**
      * @brief 当前协程切换到后台 并设置为 HOLD 状态
+     * @details 在调度器中时，切换完成后才设置为 HOLD (见 Scheduler::run)
      */
     static void YiledToHold();
 
@@ -137,6 +235,24 @@ public:
      */
     static uint64_t TotalFibers();
 
+    /**
+     * @brief 返回共享栈协程切出时拷贝出来的栈内容总字节数
+     */
+    static uint64_t TotalSavedStackBytes();
+
+    /**
+     * @brief 返回绑定在当前线程共享栈上、尚未结束的协程数
+     * @details 大于 0 时当前线程不能退出
+     */
+    static size_t SharedStackFibers();
+
+    /**
+     * @brief 返回执行 cb 的协程应使用的栈大小
+     * @details 开启 fiber.stack_adaptive 且 cb 的入口样本足够时返回按用量选择的大小，
+     *          否则返回 fiber.stack_size
+     */
+    static uint32_t StackSizeFor(const Task& cb);
+
     /**
      * @brief 协程执行函数
      * @post 执行完成返回到线程主协程
@@ -159,14 +275,46 @@ private:
     uint64_t m_id = 0;
     ///协程运行栈大小
     uint32_t m_stacksize = 0;
-    ///协程状态
-    State m_state = INIT;
+    ///协程状态，调度器中挂起的协程由其他线程读取后恢复执行
+    std::atomic<State> m_state = {INIT};
     ///协程上下文
+#ifdef SYLAR_FIBER_ASM
+    fcontext_t m_ctx = nullptr;
+#else
     ucontext_t m_ctx;
+#endif
     ///协程运行栈指针
     void* m_stack = nullptr;
+    ///协程运行栈的分配器
+    StackAllocator::ptr m_allocator;
     /// 协程运行函数
-    std::function<void()> m_cb;
+    Task m_cb;
+    ///是否使用线程共享栈
+    bool m_shared = false;
+    ///共享栈协程绑定的线程 id
+    int m_ownerThread = -1;
+    ///共享栈协程绑定的共享栈，第一次执行时绑定，结束时解绑
+    SharedStack* m_sharedStack = nullptr;
+    ///共享栈协程切出时的栈顶 (ucontext 实现时为保守估计)
+    char* m_stackSp = nullptr;
+    ///共享栈协程切出后拷贝出来的栈内容
+    char* m_savedStack = nullptr;
+    ///拷贝出来的字节数
+    size_t m_savedSize = 0;
+    ///m_savedStack 的容量
+    size_t m_savedCap = 0;
+    ///是否填充栈并统计用量
+    bool m_profile = false;
+    ///上次执行用过的栈深度，复用时只重新填充这部分
+    size_t m_stackUsed = 0;
+    ///入口函数地址，见 Task::target()
+    const void* m_entryTarget = nullptr;
+    ///入口类型，见 Task::type()
+    const std::type_info* m_entryType = nullptr;
+    ///协程局部存储，见 FiberLocal
+    void* m_locals[LOCAL_SLOTS] = {};
+    ///已设置值的槽
+    uint32_t m_localMask = 0;
 
 };
 
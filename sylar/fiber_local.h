@@ -0,0 +1,134 @@
+/**
+  ******************************************************************************
+  * @file           : fiber_local.h
+  * @author         : 18483
+  * @brief          : 协程局部存储
+  * @attention      : None
+  * @date           : 2025/4/18
+  ******************************************************************************
+  */
+
+
+#ifndef SYLAR_FIBER_LOCAL_H
+#define SYLAR_FIBER_LOCAL_H
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "fiber.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief 协程局部变量
+ * @details 值保存在协程对象内，协程在调度线程之间迁移时跟着协程走 (thread_local 做不到)
+ *          构造时登记一个槽 (最多 Fiber::LOCAL_SLOTS 个)，之后按下标直接访问，不查表
+ *          不超过一个指针大小且可平凡复制的类型 (请求 id、arena 指针) 直接存放在槽内，
+ *          其他类型第一次设置时在堆上分配
+ *          协程 reset() 复用或析构时清空，调度器执行完一个回调就会 reset，值不会带到下一个任务
+ *          不在协程中访问时使用线程主协程的槽
+ * @attention 槽只分配不回收，FiberLocal 应定义为静态或全局对象
+ * @code
+ *  static sylar::FiberLocal<uint64_t> s_request_id;
+ *  s_request_id.set(id);
+ *  uint64_t* id = s_request_id.get();
+ * @endcode
+ */
+template<class T>
+class FiberLocal : Noncopyable {
+public:
+    /// 是否直接存放在槽内
+    static const bool INLINE = sizeof(T) <= sizeof(void*)
+                            && alignof(T) <= alignof(void*)
+                            && std::is_trivially_copyable<T>::value;
+
+    /**
+     * @brief 构造函数，登记一个槽
+     */
+    FiberLocal()
+        :m_slot(Fiber::RegisterLocal(&Destroy)) {
+    }
+
+    /**
+     * @brief 返回当前协程的值，未设置时返回 nullptr
+     */
+    T* get() const {
+        Fiber* fiber = Fiber::Current();
+        if(!(fiber->m_localMask & (1u << m_slot))) {
+            return nullptr;
+        }
+        return Value(fiber->m_locals[m_slot]);
+    }
+
+    /**
+     * @brief 设置当前协程的值
+     */
+    void set(T v) {
+        Fiber* fiber = Fiber::Current();
+        void*& slot = fiber->m_locals[m_slot];
+        if(fiber->m_localMask & (1u << m_slot)) {
+            *Value(slot) = std::move(v);
+            return;
+        }
+        if(INLINE) {
+            new(&slot) T(std::move(v));
+        } else {
+            slot = new T(std::move(v));
+        }
+        fiber->m_localMask |= 1u << m_slot;
+    }
+
+    /**
+     * @brief 返回当前协程的值，未设置时先设置为 T()
+     */
+    T& operator*() {
+        T* v = get();
+        if(!v) {
+            set(T());
+            v = get();
+        }
+        return *v;
+    }
+
+    T* operator->() {
+        return &**this;
+    }
+
+    /**
+     * @brief 清除当前协程的值
+     */
+    void reset() {
+        Fiber* fiber = Fiber::Current();
+        if(!(fiber->m_localMask & (1u << m_slot))) {
+            return;
+        }
+        fiber->m_localMask &= ~(1u << m_slot);
+        void* value = fiber->m_locals[m_slot];
+        fiber->m_locals[m_slot] = nullptr;
+        Destroy(value);
+    }
+
+private:
+    static T* Value(void*& slot) {
+        if(INLINE) {
+            return reinterpret_cast<T*>(&slot);
+        }
+        return static_cast<T*>(slot);
+    }
+
+    static void Destroy(void* value) {
+        if(!INLINE) {
+            delete static_cast<T*>(value);
+        }
+    }
+
+private:
+    /// 槽的下标
+    size_t m_slot;
+};
+
+}
+
+#endif //SYLAR_FIBER_LOCAL_H
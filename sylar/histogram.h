@@ -0,0 +1,159 @@
+/**
+  ******************************************************************************
+  * @file           : histogram.h
+  * @author         : 18483
+  * @brief          : 按 2 的幂分桶的无锁直方图
+  * @attention      : 单线程写入，任意线程读取
+  * @date           : 2025/4/14
+  ******************************************************************************
+  */
+
+
+#ifndef SYLAR_HISTOGRAM_H
+#define SYLAR_HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+namespace sylar {
+
+/**
+ * @brief 对数分桶直方图
+ * @details 第 0 个桶记录 0，第 i 个桶记录 [2^(i-1), 2^i)，最后一个桶记录所有更大的值
+ *          只允许一个线程调用 record，写入只用 relaxed 的读和写，不带锁前缀
+ *          其他线程随时可以 snapshot，读到的各字段之间可能相差正在写入的一次记录
+ */
+class Histogram {
+public:
+    /// 桶的数量
+    static const int BUCKETS = 40;
+
+    /**
+     * @brief 直方图快照
+     */
+    struct Snapshot {
+        /// 记录次数
+        uint64_t count = 0;
+        /// 记录值之和
+        uint64_t sum = 0;
+        /// 最大记录值
+        uint64_t max = 0;
+        /// 各桶的记录次数
+        uint64_t buckets[BUCKETS] = {0};
+
+        /**
+         * @brief 累加另一个快照
+         */
+        void merge(const Snapshot& other) {
+            count += other.count;
+            sum += other.sum;
+            if(other.max > max) {
+                max = other.max;
+            }
+            for(int i = 0; i < BUCKETS; ++i) {
+                buckets[i] += other.buckets[i];
+            }
+        }
+
+        /**
+         * @brief 平均值
+         */
+        double mean() const {
+            return count ? (double)sum / count : 0;
+        }
+
+        /**
+         * @brief 分位数的上界
+         * @param p 分位 (0, 1]
+         * @return 分位数所在桶的上界，不超过最大记录值
+         */
+        uint64_t percentile(double p) const {
+            if(!count) {
+                return 0;
+            }
+            uint64_t target = p * count;
+            if(target == 0) {
+                target = 1;
+            }
+            uint64_t seen = 0;
+            for(int i = 0; i < BUCKETS; ++i) {
+                seen += buckets[i];
+                if(seen >= target) {
+                    uint64_t upper = i == 0 ? 0 : (1ull << i) - 1;
+                    return upper < max ? upper : max;
+                }
+            }
+            return max;
+        }
+
+        /**
+         * @brief 输出 count/mean/p50/p90/p99/max
+         */
+        std::ostream& dump(std::ostream& os) const {
+            os << "count=" << count
+               << " mean=" << (uint64_t)mean()
+               << " p50=" << percentile(0.5)
+               << " p90=" << percentile(0.9)
+               << " p99=" << percentile(0.99)
+               << " max=" << max;
+            return os;
+        }
+    };
+
+    /**
+     * @brief 记录一个值 (只能由所属线程调用)
+     */
+    void record(uint64_t v) {
+        int i = v == 0 ? 0 : 64 - __builtin_clzll(v);
+        if(i >= BUCKETS) {
+            i = BUCKETS - 1;
+        }
+        Add(m_buckets[i], 1);
+        Add(m_count, 1);
+        Add(m_sum, v);
+        if(v > m_max.load(std::memory_order_relaxed)) {
+            m_max.store(v, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief 读取当前数据
+     */
+    void snapshot(Snapshot& s) const {
+        s.count = m_count.load(std::memory_order_relaxed);
+        s.sum = m_sum.load(std::memory_order_relaxed);
+        s.max = m_max.load(std::memory_order_relaxed);
+        for(int i = 0; i < BUCKETS; ++i) {
+            s.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief 清零 (只能由所属线程调用，或者在没有写入时调用)
+     */
+    void reset() {
+        m_count.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+        for(auto& i : m_buckets) {
+            i.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    /// 单写者的自增，避免 fetch_add 的锁总线开销
+    static void Add(std::atomic<uint64_t>& v, uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_count = {0};
+    std::atomic<uint64_t> m_sum = {0};
+    std::atomic<uint64_t> m_max = {0};
+    std::atomic<uint64_t> m_buckets[BUCKETS] = {};
+};
+
+}
+
+#endif //SYLAR_HISTOGRAM_H
@@ -15,6 +15,7 @@
 #include "log.h"
 #include "fiber.h"
 #include "iomanager.h"
+#include "io_uring.h"
 #include "fd_manager.h"
 #include "macro.h"
 
@@ -25,6 +26,10 @@ namespace sylar {
 static sylar::ConfigVar<int>::ptr g_tcp_connect_timeout =
         sylar::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
 
+static sylar::ConfigVar<int>::ptr g_tcp_timeout_slack =
+        sylar::Config::Lookup("tcp.timeout.slack", 0
+                , "slack in ms of socket send/recv/connect timeout timers, see TimerManager::addTimer");
+
 static thread_local bool t_hook_enable = false;
 
 #define HOOK_FUN(XX) \
@@ -69,10 +74,19 @@ void hook_init() {
  *   并创建静态对象，能够在main函数运行之前就能将地址保存到函数指针变量当中。
  */
 static uint64_t s_connect_timeout = -1;
+/// socket 超时定时器的 slack，大量连接的超时合并到同一时刻触发 (默认 0，保持精确的超时)
+static uint64_t s_timeout_slack = 0;
 struct _HookIniter {
     _HookIniter() {
         hook_init();
         s_connect_timeout = g_tcp_connect_timeout->getValue();
+        s_timeout_slack = g_tcp_timeout_slack->getValue();
+
+        g_tcp_timeout_slack->addListener([](const int& old_value, const int& new_value) -> void {
+            SYLAR_LOG_INFO(g_logger) << "tcp timeout slack changed from "
+                                     << old_value << " to " << new_value;
+            s_timeout_slack = new_value;
+        });
 
         g_tcp_connect_timeout->addListener([](const int& old_value, const int& new_value) -> void {
             SYLAR_LOG_INFO(g_logger) << "tcp connect timeout changed from "
@@ -102,22 +116,83 @@ struct timer_info {
     int cancelled = 0;
 };
 
+/**
+ * @brief 读写当前线程的 errno
+ * @details __errno_location 声明为 const，编译器会复用协程让出前取得的 errno 地址，
+ *          协程在其他线程恢复后读写的是原线程的 errno；不内联，每次重新取地址
+ */
+static __attribute__((noinline)) int get_errno() {
+    return errno;
+}
+
+static __attribute__((noinline)) void set_errno(int e) {
+    errno = e;
+}
+
+/**
+ * @brief 当前协程的 IO 能否提交到 io_uring
+ * @details 共享栈协程挂起期间栈被其他协程覆盖，而提交的操作会让内核和 reapUring 访问栈上的
+ *          等待状态、msghdr 和缓冲区，这类协程使用 epoll 路径
+ */
+static bool use_uring(sylar::IOManager* iom) {
+    return iom && iom->hasUring() && !sylar::Fiber::GetThis()->isSharedStack();
+}
+
+/**
+ * @brief 填写 io_uring 的 SQE
+ */
+static void prep_sqe(io_uring_sqe& sqe, int opcode, int fd, const void* addr, uint32_t len, uint64_t off) {
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)(uintptr_t)addr;
+    sqe.len = len;
+    sqe.off = off;
+}
+
+/**
+ * @brief 把操作提交给 io_uring，等待完成
+ * @details 操作被取消 (io_uring 在提交线程退出时会取消它提交的操作，或者 cancleUringIo) 而 fd 未关闭时重新提交，
+ *          与 epoll 后端被 cancleEvent 唤醒后重试一致；close 先从 FdManager 中删除 fd 再取消，被取消的协程返回 EBADF
+ * @return 同系统调用，失败返回 -1 并设置 errno
+ */
+static ssize_t do_uring_io(sylar::IOManager* iom, const sylar::FdCtx::ptr& ctx,
+                           int fd, const io_uring_sqe& sqe, uint64_t to) {
+    while(true) {
+        int rt = iom->submitIo(sqe, to);
+        if(rt >= 0) {
+            return rt;
+        }
+        if(rt == -ECANCELED) {
+            if(sylar::FdMgr::GetInstance()->get(fd) == ctx) {
+                continue;
+            }
+            rt = -EBADF;
+        }
+        set_errno(-rt);
+        return -1;
+    }
+}
+
 
 /// hook的核心函数  I/O操作
 /// 以写同步的方式实现异步的效果
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
-                     uint32_t event, int timeout_so, Args&&... args){
+                     uint32_t event, int timeout_so, const io_uring_sqe* sqe, Args&&... args){
     /**
      * 1.先进行一系列判断 是否按原函数执行
      * 2.执行原函数 若errno = EINTR，则为系统中断，应该不断重新尝试操作
      * 3.若errno = EAGIN，系统已经隐式的将socket设置为非阻塞模式，此时资源咱不可用
-     * 4.若设置超时时间 则设置一个条件定时器，若超时时间前来数据，则tinfo已销毁，不会执行回调
-     * 5.在条件定时器的回调函数中设置错误为ETIMEDOUT超时，使用cancelEvent强制执行该任务，继续回到该协程执行
-     * 6.addEvent添加事件，成功则让出协程执行权
+     * 4.addEvent添加事件 (持久注册模式下 EAGAIN 之后已经收到就绪通知时直接 retry)
+     * 5.若设置超时时间 则设置 fd 该方向的可复用超时定时器 (FdCtx::armTimeout)，不分配内存
+     *   定时器回调记录超时，使用cancelEvent强制执行该任务，继续回到该协程执行
+     * 6.让出协程执行权
      * 7.只有两种情况协程会被拉起： - 超时了，通过定时器回调函数 cancelEvent唤醒回来 - addEvent数据回来了会唤醒回来
      * 8.取消定时器 超时则返回-1
      * 9.若数据来了 则 retry 重新操作
+     * io_uring 后端 (sqe 不为空时) 不再注册事件，把操作本身交给 io_uring，完成时唤醒协程：
+     *   读操作直接提交；写操作通常不会阻塞，先直接写，写不进去再提交
      */
     // 如果不需要hook 直接返回原始接口
 //    if(!sylar::t_hook_enable){
@@ -225,44 +300,40 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
     }
 
     uint64_t to = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
+    bool has_timeout = to != (uint64_t)-1;
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    bool uring = sqe && use_uring(iom);
+    if(uring && event == sylar::IOManager::READ) {
+        return do_uring_io(iom, ctx, fd, *sqe, to);
+    }
 
     retry:
     ssize_t n = fun(fd, std::forward<Args>(args)...);
-    while(n == -1 && errno == EINTR) {
+    while(n == -1 && get_errno() == EINTR) {
         n = fun(fd, std::forward<Args>(args)...);
     }
-    if(n == -1 && errno == EAGAIN) {
-        sylar::IOManager* iom = sylar::IOManager::GetThis();
-        sylar::Timer::ptr timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
-
-        if(to != (uint64_t)-1) {
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
-                auto t = winfo.lock();
-                if(!t || t->cancelled) {
-                    return;
-                }
-                t->cancelled = ETIMEDOUT;
-                iom->cancleEvent(fd, (sylar::IOManager::Event)(event));
-            }, winfo);
+    if(n == -1 && get_errno() == EAGAIN) {
+        if(uring) {
+            return do_uring_io(iom, ctx, fd, *sqe, to);
         }
 
         int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));
-        if(SYLAR_UNLIKELY(rt)) {
+        if(SYLAR_UNLIKELY(rt < 0)) {
             SYLAR_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
                                       << fd << ", " << event << ")";
-            if(timer) {
-                timer->cancle();
-            }
             return -1;
+        } else if(rt > 0) {
+            // 持久注册模式下 EAGAIN 之后已经收到就绪通知，不挂起直接重试
+            goto retry;
         } else {
-            sylar::Fiber::YiledToHold();
-            if(timer) {
-                timer->cancle();
+            // 超时定时器属于 fd，反复设置，不分配内存
+            // 事件已注册，定时器先于协程挂起到期也只是取消事件提前唤醒
+            if(has_timeout) {
+                ctx->armTimeout(timeout_so, iom, event, to, sylar::s_timeout_slack);
             }
-            if(tinfo->cancelled) {
-                errno = tinfo->cancelled;
+            sylar::Fiber::YiledToHold();
+            if(has_timeout && ctx->disarmTimeout(timeout_so)) {
+                set_errno(ETIMEDOUT);
                 return -1;
             }
             goto retry;
@@ -293,8 +364,8 @@ unsigned int sleep(unsigned int seconds){
     sylar::IOManager* iom = sylar::IOManager::GetThis();
     // bind() 需要先确定 schedule 函数的类型
     iom->addTimer(seconds * 1000, std::bind((void(sylar::Scheduler::*)
-                        (sylar::Fiber::ptr, int thread))&sylar::IOManager::schedule,
-                  iom, fiber, -1));
+                        (sylar::Fiber::ptr, int thread, sylar::Scheduler::Priority))&sylar::IOManager::schedule,
+                  iom, fiber, -1, sylar::Scheduler::NORMAL));
     sylar::Fiber::YiledToHold();
     return 0;
 }
@@ -308,8 +379,8 @@ int usleep(useconds_t usec){
     sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
     sylar::IOManager* iom = sylar::IOManager::GetThis();
     iom->addTimer(usec / 1000, std::bind((void(sylar::Scheduler::*)
-                        (sylar::Fiber::ptr, int thread))&sylar::IOManager::schedule,
-                                            iom, fiber, -1));
+                        (sylar::Fiber::ptr, int thread, sylar::Scheduler::Priority))&sylar::IOManager::schedule,
+                                            iom, fiber, -1, sylar::Scheduler::NORMAL));
     sylar::Fiber::YiledToHold();
     return 0;
 }
@@ -323,8 +394,8 @@ int nanosleep(const struct timespec *req, struct timespec *rem){
     sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
     sylar::IOManager* iom = sylar::IOManager::GetThis();
     iom->addTimer(timeout_ms, std::bind((void(sylar::Scheduler::*)
-                                                 (sylar::Fiber::ptr, int thread))&sylar::IOManager::schedule,
-                                         iom, fiber, -1));
+                                                 (sylar::Fiber::ptr, int thread, sylar::Scheduler::Priority))&sylar::IOManager::schedule,
+                                         iom, fiber, -1, sylar::Scheduler::NORMAL));
     sylar::Fiber::YiledToHold();
     return 0;
 }
@@ -341,6 +412,8 @@ int socket(int domain, int type, int protocol) {
         return fd;
     }
     // 将 fd 放入到文件管理中
+    // 新 fd 的句柄号上残留的 FdCtx 来自没有经过 hook 的 close，先删除
+    sylar::FdMgr::GetInstance()->del(fd);
     sylar::FdMgr::GetInstance()->get(fd, true);
     return fd;
 }
@@ -376,6 +449,29 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
+    // io_uring 后端: 连接由 io_uring 完成，不需要再检查 SO_ERROR
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(use_uring(iom)) {
+        io_uring_sqe sqe;
+        prep_sqe(sqe, IORING_OP_CONNECT, fd, addr, 0, addrlen);
+        int rt = iom->submitIo(sqe, timeout_ms);
+        // 提交线程退出取消了操作，连接可能仍在进行，继续等待
+        while(rt == -ECANCELED && sylar::FdMgr::GetInstance()->get(fd) == ctx) {
+            rt = iom->submitIo(sqe, timeout_ms);
+            if(rt == -EISCONN) {
+                rt = 0;
+            }
+        }
+        if(rt == -ECANCELED) {
+            rt = -EBADF;
+        }
+        if(rt < 0) {
+            set_errno(-rt);
+            return -1;
+        }
+        return 0;
+    }
+
     // 调用原始 connect_f 尝试连接
     int n = connect_f(fd, addr, addrlen);
     if(n == 0) {  // 连接成功 直接返回
@@ -385,7 +481,6 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     }
 
     // 定义定时器和超市信息
-    sylar::IOManager* iom = sylar::IOManager::GetThis();
     sylar::Timer::ptr timer;
     std::shared_ptr<timer_info> tinfo(new timer_info);
     std::weak_ptr<timer_info> winfo(tinfo);
@@ -402,12 +497,15 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
             t->cancelled = ETIMEDOUT; // 没错误的话设置为超时而失败
             // 取消事件进行强制唤醒
             iom->cancleEvent(fd, sylar::IOManager::WRITE);
-        }, winfo);
+        }, winfo, false, sylar::s_timeout_slack);
     }
-    // 添加写事件， 等待连接完成
+    // 添加写事件， 等待连接完成 (持久注册模式下已经可写时返回 1，直接检查结果)
     int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
-    // 添加成功 让出执行权 等待事件触发
-    if(rt == 0){
+    if(rt > 0) {
+        if(timer) {
+            timer->cancle();
+        }
+    } else if(rt == 0){  // 添加成功 让出执行权 等待事件触发
         sylar::Fiber::YiledToHold();
         if(timer) {
             timer->cancle();  // 取消定时器
@@ -443,57 +541,127 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_ACCEPT, s, addr, 0, (uint64_t)(uintptr_t)addrlen);
+    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, addr, addrlen);
     if(fd >= 0) {
+        sylar::FdMgr::GetInstance()->del(fd);
         sylar::FdMgr::GetInstance()->get(fd, true);
+        // 多 reactor 模式下新连接在 accept 时轮流分配给各个 reactor
+        sylar::IOManager* iom = sylar::IOManager::GetThis();
+        if(iom) {
+            iom->assignReactor(fd);
+        }
     }
     return fd;
 }
 
+/// io_uring 后端只处理 socket (do_io 中检查)，read/write 对 socket 等同于 flags 为 0 的 recv/send
 ssize_t read(int fd, void *buf, size_t count) {
-    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_RECV, fd, buf, count, 0);
+    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_RECVMSG, fd, &msg, 1, 0);
+    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_RECV, sockfd, buf, len, 0);
+    sqe.msg_flags = flags;
+    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
-    return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!use_uring(iom)) {
+        return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, nullptr, buf, len, flags, src_addr, addrlen);
+    }
+    // io_uring 没有 recvfrom，用 recvmsg 实现，地址长度从 msghdr 中取回
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = src_addr;
+    msg.msg_namelen = src_addr && addrlen ? *addrlen : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_RECVMSG, sockfd, &msg, 1, 0);
+    sqe.msg_flags = flags;
+    ssize_t n = do_io(sockfd, recvmsg_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, &msg, flags);
+    if(n >= 0 && src_addr && addrlen) {
+        *addrlen = msg.msg_namelen;
+    }
+    return n;
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
-    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_RECVMSG, sockfd, msg, 1, 0);
+    sqe.msg_flags = flags;
+    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, msg, flags);
 }
 
 
 /// write
 ssize_t write(int fd, const void *buf, size_t count){
-    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_SEND, fd, buf, count, 0);
+    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, &sqe, buf, count);
 }
 
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt){
-    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_SENDMSG, fd, &msg, 1, 0);
+    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, &sqe, iov, iovcnt);
 }
 
 
 ssize_t send(int s, const void *msg, size_t len, int flags){
-    return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_SEND, s, msg, len, 0);
+    sqe.msg_flags = flags;
+    return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, &sqe, msg, len, flags);
 }
 
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen){
-    return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+    struct iovec iov;
+    iov.iov_base = (void*)msg;
+    iov.iov_len = len;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = (void*)to;
+    mh.msg_namelen = tolen;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_SENDMSG, s, &mh, 1, 0);
+    sqe.msg_flags = flags;
+    return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, &sqe, msg, len, flags, to, tolen);
 }
 
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags){
-    return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+    io_uring_sqe sqe;
+    prep_sqe(sqe, IORING_OP_SENDMSG, s, msg, 1, 0);
+    sqe.msg_flags = flags;
+    return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, &sqe, msg, flags);
 }
 
 
@@ -510,6 +678,11 @@ int close(int fd) {
         }
         // 在文件管理中删除fd
         sylar::FdMgr::GetInstance()->del(fd);
+        // 删除之后再取消 io_uring 中的操作，被取消的协程看到 fd 已关闭，不会重新提交
+        // 必须在 close_f 之前: 关闭 fd 不会结束 io_uring 中进行的操作
+        if(iom) {
+            iom->cancleUringIo(fd);
+        }
     }
     return close_f(fd);
 }
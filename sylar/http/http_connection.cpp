@@ -335,7 +335,8 @@ HttpConnectionPool::HttpConnectionPool(const std::string& host
 }
 
 HttpConnection::ptr HttpConnectionPool::getConnection() {
-    uint64_t now_ms = sylar::GetCurrentMS();
+    // 可能在非调度线程调用，缓存的时间不会刷新，读单调时钟 (连接池本身要加锁，省下的一次读时钟无关紧要)
+    uint64_t now_ms = sylar::GetMonotonicMS();
     std::vector<HttpConnection*> invalid_conns;
     HttpConnection* ptr = nullptr;
     MutexType::Lock lock(m_mutex);
@@ -346,7 +347,7 @@ HttpConnection::ptr HttpConnectionPool::getConnection() {
             invalid_conns.push_back(conn);
             continue;
         }
-        if((conn->m_createTime + m_maxAliveTime) > now_ms) {
+        if((conn->m_createTime + m_maxAliveTime) <= now_ms) {
             invalid_conns.push_back(conn);
             continue;
         }
@@ -377,6 +378,7 @@ HttpConnection::ptr HttpConnectionPool::getConnection() {
         }
 
         ptr = new HttpConnection(sock);
+        ptr->m_createTime = now_ms;
         ++m_total;
     }
     return HttpConnection::ptr(ptr, std::bind(&HttpConnectionPool::ReleasePtr
@@ -386,7 +388,7 @@ HttpConnection::ptr HttpConnectionPool::getConnection() {
 void HttpConnectionPool::ReleasePtr(HttpConnection* ptr, HttpConnectionPool* pool) {
     ++ptr->m_request;
     if(!ptr->isConnected()
-       || ((ptr->m_createTime + pool->m_maxAliveTime) >= sylar::GetCurrentMS())
+       || ((ptr->m_createTime + pool->m_maxAliveTime) <= sylar::GetMonotonicMS())
        || (ptr->m_request >= pool->m_maxRequest)) {
         delete ptr;
         --pool->m_total;
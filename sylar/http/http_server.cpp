@@ -13,6 +13,7 @@
 #include "sylar/log.h"
 #include "sylar/http/servlets/config_servlet.h"
 #include "sylar/http/servlets/status_servlet.h"
+#include "sylar/http/servlets/scheduler_servlet.h"
 
 namespace sylar {
 namespace http {
@@ -30,6 +31,7 @@ HttpServer::HttpServer(bool keepalive
     m_type = "http";
     m_dispatch->addServlet("/_/status", Servlet::ptr(new StatusServlet));
     m_dispatch->addServlet("/_/config", Servlet::ptr(new ConfigServlet));
+    m_dispatch->addServlet("/_/scheduler", Servlet::ptr(new SchedulerServlet));
 }
 
 void HttpServer::setName(const std::string& v) {
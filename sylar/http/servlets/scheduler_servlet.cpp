@@ -0,0 +1,110 @@
+/**
+  ******************************************************************************
+  * @file           : scheduler_servlet.cpp
+  * @author         : 18483
+  * @brief          : None
+  * @attention      : None
+  * @date           : 2025/4/14
+  ******************************************************************************
+  */
+
+#include "scheduler_servlet.h"
+#include "sylar/scheduler.h"
+#include "sylar/fiber.h"
+#include "sylar/stack_allocator.h"
+#include "sylar/stack_profiler.h"
+#include <iomanip>
+
+namespace sylar {
+namespace http {
+
+SchedulerServlet::SchedulerServlet()
+        :Servlet("SchedulerServlet") {
+}
+
+/// 输出一个直方图，buckets 为 true 时输出非空桶
+static void dump_histogram(std::ostream& os, const char* name
+        , const Histogram::Snapshot& s, bool buckets) {
+    os << std::setw(14) << std::right << name << ": ";
+    s.dump(os) << std::endl;
+    if(!buckets) {
+        return;
+    }
+    for(int i = 0; i < Histogram::BUCKETS; ++i) {
+        if(!s.buckets[i]) {
+            continue;
+        }
+        uint64_t upper = i == 0 ? 0 : (1ull << i) - 1;
+        os << std::setw(24) << std::right << "<=" << upper << "us: " << s.buckets[i] << std::endl;
+    }
+}
+
+int32_t SchedulerServlet::handle(sylar::http::HttpRequest::ptr request
+        ,sylar::http::HttpResponse::ptr response
+        ,sylar::http::HttpSession::ptr session) {
+    response->setHeader("Content-Type", "text/text; charset=utf-8");
+    Scheduler* sc = Scheduler::GetThis();
+    if(!sc) {
+        response->setBody("no scheduler");
+        return 0;
+    }
+    bool buckets = request->getParam("buckets") == "1";
+
+    std::vector<Scheduler::WorkerStats> stats;
+    sc->getStats(stats);
+    Scheduler::WorkerStats total;
+    for(auto& i : stats) {
+        total.switches += i.switches;
+        total.queueWait.merge(i.queueWait);
+        total.runTime.merge(i.runTime);
+        total.idleTime.merge(i.idleTime);
+    }
+
+    std::stringstream ss;
+    ss << "===================================================" << std::endl;
+    ss << "<Scheduler>" << std::endl;
+    // 各优先级排队数、各工作线程的 CPU 和 NUMA 节点，IOManager 还会输出 idle 自旋计数和定时器队列
+    sc->dump(ss);
+    ss << "===================================================" << std::endl;
+    ss << "<Latency> (us)" << std::endl;
+    ss << std::setw(14) << std::right << "switches" << ": " << total.switches << std::endl;
+    dump_histogram(ss, "queue_wait", total.queueWait, buckets);
+    dump_histogram(ss, "run_time", total.runTime, buckets);
+    dump_histogram(ss, "idle_time", total.idleTime, buckets);
+    for(auto& i : stats) {
+        uint64_t busy = i.runTime.sum;
+        uint64_t all = busy + i.idleTime.sum;
+        ss << "---------------------------------------------------" << std::endl;
+        ss << "worker[" << i.worker << "] thread=" << i.thread
+           << " switches=" << i.switches
+           << " utilization=" << (all ? busy * 100 / all : 0) << "%" << std::endl;
+        dump_histogram(ss, "queue_wait", i.queueWait, buckets);
+        dump_histogram(ss, "run_time", i.runTime, buckets);
+        dump_histogram(ss, "idle_time", i.idleTime, buckets);
+    }
+    std::map<std::string, uint64_t> hits;
+    sc->getWatchdogHits(hits);
+    if(!hits.empty()) {
+        ss << "===================================================" << std::endl;
+        ss << "<Watchdog>" << std::endl;
+        for(auto& i : hits) {
+            ss << std::setw(10) << std::right << i.second << "  " << i.first << std::endl;
+        }
+    }
+    ss << "===================================================" << std::endl;
+    ss << "<FiberStacks>" << std::endl;
+    ss << std::setw(14) << std::right << "fibers" << ": " << Fiber::TotalFibers() << std::endl;
+    ss << std::setw(14) << std::right << "allocator" << ": ";
+    StackAllocator::GetDefault()->dump(ss) << std::endl;
+    ss << std::setw(14) << std::right << "saved_stacks" << ": " << Fiber::TotalSavedStackBytes() << std::endl;
+    if(StackProfiler::IsEnabled()) {
+        ss << "===================================================" << std::endl;
+        ss << "<FiberStackUsage>" << std::endl;
+        StackProfiler::Dump(ss);
+    }
+    response->setBody(ss.str());
+    return 0;
+}
+
+}
+}
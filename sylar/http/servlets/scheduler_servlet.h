@@ -0,0 +1,40 @@
+/**
+  ******************************************************************************
+  * @file           : scheduler_servlet.h
+  * @author         : 18483
+  * @brief          : 调度器统计数据
+  * @attention      : None
+  * @date           : 2025/4/14
+  ******************************************************************************
+  */
+
+
+#ifndef SYLAR_SCHEDULER_SERVLET_H
+#define SYLAR_SCHEDULER_SERVLET_H
+
+#include "sylar/http/servlet.h"
+
+namespace sylar {
+namespace http {
+
+/**
+ * @brief 输出当前调度器的状态 (Scheduler::dump)，各工作线程的排队时间、执行时间、idle 时间直方图和协程切换次数
+ * @details 状态包括各优先级排队中的任务数、各工作线程所在的 CPU 和 NUMA 节点，
+ *          IOManager 还包括 idle 自旋的命中次数和定时器队列
+ *          参数 buckets=1 时额外输出直方图每个非空桶的计数
+ *          看门狗发现过超时任务时输出各调用点的超时次数
+ *          最后输出协程数、协程栈分配器的状态 (缓存命中、映射和使用中的栈内存) 和共享栈协程保存的栈字节数，
+ *          开启 fiber.stack_profile 时输出各入口函数的栈使用高水位
+ */
+class SchedulerServlet : public Servlet {
+public:
+    SchedulerServlet();
+    virtual int32_t handle(sylar::http::HttpRequest::ptr request
+            , sylar::http::HttpResponse::ptr response
+            , sylar::http::HttpSession::ptr session) override;
+};
+
+}
+}
+
+#endif //SYLAR_SCHEDULER_SERVLET_H
@@ -0,0 +1,250 @@
+/**
+  ******************************************************************************
+  * @file           : io_uring.cpp
+  * @author         : 18483
+  * @brief          : io_uring 的封装 (直接使用系统调用，不依赖 liburing)
+  * @attention      : None
+  * @date           : 2025/5/10
+  ******************************************************************************
+  */
+
+
+#include "io_uring.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "macro.h"
+
+namespace sylar {
+
+/// 链接的 SQE 提交了一部分后，剩余部分最多重试的次数
+static const uint32_t s_submit_retries = 64;
+
+IoUring::IoUring() {
+}
+
+IoUring* IoUring::Create(uint32_t entries, uint32_t cq_entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0) {
+        return nullptr;
+    }
+
+    IoUring* ring = new IoUring;
+    ring->m_fd = fd;
+    ring->m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->m_sqRingSize = ring->m_cqRingSize = std::max(ring->m_sqRingSize, ring->m_cqRingSize);
+    }
+    ring->m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    void* sq = mmap(nullptr, ring->m_sqRingSize, PROT_READ | PROT_WRITE
+                    , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) {
+        int err = errno;
+        delete ring;
+        errno = err;
+        return nullptr;
+    }
+    ring->m_sqRing = sq;
+
+    void* cq = sq;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(nullptr, ring->m_cqRingSize, PROT_READ | PROT_WRITE
+                  , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED) {
+            int err = errno;
+            delete ring;
+            errno = err;
+            return nullptr;
+        }
+    }
+    ring->m_cqRing = cq;
+
+    void* sqes = mmap(nullptr, ring->m_sqesSize, PROT_READ | PROT_WRITE
+                      , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        int err = errno;
+        delete ring;
+        errno = err;
+        return nullptr;
+    }
+    ring->m_sqes = (io_uring_sqe*)sqes;
+
+    char* sp = (char*)sq;
+    ring->m_sqHead = (uint32_t*)(sp + params.sq_off.head);
+    ring->m_sqTail = (uint32_t*)(sp + params.sq_off.tail);
+    ring->m_sqMask = *(uint32_t*)(sp + params.sq_off.ring_mask);
+    ring->m_sqEntries = *(uint32_t*)(sp + params.sq_off.ring_entries);
+    ring->m_sqFlags = (uint32_t*)(sp + params.sq_off.flags);
+    ring->m_sqArray = (uint32_t*)(sp + params.sq_off.array);
+
+    char* cp = (char*)cq;
+    ring->m_cqHead = (uint32_t*)(cp + params.cq_off.head);
+    ring->m_cqTail = (uint32_t*)(cp + params.cq_off.tail);
+    ring->m_cqMask = *(uint32_t*)(cp + params.cq_off.ring_mask);
+    ring->m_cqes = (io_uring_cqe*)(cp + params.cq_off.cqes);
+    return ring;
+}
+
+IoUring::~IoUring() {
+    if(m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if(m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if(m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+int IoUring::enter(uint32_t to_submit, uint32_t flags, uint32_t min_complete) {
+    return syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int IoUring::submit(const io_uring_sqe* sqes, uint32_t count) {
+    SYLAR_ASSERT(count <= m_sqEntries);
+    MutexType::Lock lock(m_sqMutex);
+    // 每次提交都立即进入内核，内核取走之前提交队列不会有残留
+    uint32_t tail = *m_sqTail;
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t idx = (tail + i) & m_sqMask;
+        m_sqes[idx] = sqes[i];
+        m_sqArray[idx] = idx;
+    }
+    __atomic_store_n(m_sqTail, tail + count, __ATOMIC_RELEASE);
+
+    uint32_t submitted = 0;
+    uint32_t retries = 0;
+    while(submitted < count) {
+        int rt = enter(count - submitted, 0);
+        if(rt > 0) {
+            submitted += rt;
+            retries = 0;
+            continue;
+        }
+        if(rt < 0 && errno == EINTR) {
+            continue;
+        }
+        int err = rt < 0 ? errno : EAGAIN;
+        if(submitted == 0) {
+            // 一个都没取走，撤回
+            __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+            return -err;
+        }
+        // 链接的 SQE 已经取走一部分，剩下的不能直接撤回
+        // 内核拒绝多半是完成队列满了 (EBUSY)，而唯一能取完成事件的线程可能就是当前线程，
+        // 先把完成事件转存起来腾出完成队列
+        MutexType::Lock cq_lock(m_cqMutex);
+        if(++retries > s_submit_retries) {
+            // 持有提交锁，剩余 SQE 还在提交队列中没被内核取走，可以撤回
+            __atomic_store_n(m_sqTail, tail + submitted, __ATOMIC_RELEASE);
+            for(uint32_t i = submitted; i < count; ++i) {
+                io_uring_cqe cqe;
+                memset(&cqe, 0, sizeof(cqe));
+                cqe.user_data = sqes[i].user_data;
+                cqe.res = -err;
+                m_backlog.push_back(cqe);
+            }
+            m_hasBacklog.store(true, std::memory_order_release);
+            break;
+        }
+        if(reapRing(m_backlog)) {
+            m_hasBacklog.store(true, std::memory_order_release);
+        }
+        cq_lock.unlock();
+        if(retries > s_submit_retries / 2) {
+            // 不用 usleep，调度线程中 usleep 被 hook 会切走协程而本函数持有锁
+            sched_yield();
+        }
+    }
+    return 0;
+}
+
+size_t IoUring::reap(std::vector<io_uring_cqe>& cqes) {
+    MutexType::Lock lock(m_cqMutex);
+    size_t count = m_backlog.size();
+    if(count) {
+        cqes.insert(cqes.end(), m_backlog.begin(), m_backlog.end());
+        m_backlog.clear();
+        m_hasBacklog.store(false, std::memory_order_relaxed);
+    }
+    return count + reapRing(cqes);
+}
+
+size_t IoUring::reapRing(std::vector<io_uring_cqe>& cqes) {
+    size_t count = 0;
+    while(true) {
+        uint32_t head = *m_cqHead;
+        uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head) {
+            cqes.push_back(m_cqes[head & m_cqMask]);
+            ++count;
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+        // 完成队列满时内核把完成事件暂存起来，需要进入内核取回
+        if(!(__atomic_load_n(m_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)) {
+            break;
+        }
+        enter(0, IORING_ENTER_GETEVENTS);
+    }
+    return count;
+}
+
+bool IoUring::supportsOps(const uint8_t* ops, size_t count) {
+    size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::vector<char> buf(size, 0);
+    io_uring_probe* probe = (io_uring_probe*)&buf[0];
+    if(syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, 256)) {
+        return false;
+    }
+    for(size_t i = 0; i < count; ++i) {
+        if(ops[i] > probe->last_op
+                || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IoUring::supportsCancelFd() {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    // 取消本 io_uring 的 fd 上的操作，一个都不会找到；不认识这些标志的内核返回 -EINVAL
+    sqe.fd = m_fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    if(submit(&sqe, 1)) {
+        return false;
+    }
+    std::vector<io_uring_cqe> cqes;
+    MutexType::Lock lock(m_cqMutex);
+    while(reapRing(cqes) == 0) {
+        int rt = enter(0, IORING_ENTER_GETEVENTS, 1);
+        if(rt < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return cqes[0].res != -EINVAL;
+}
+
+int IoUring::registerEventFd(int fd) {
+    return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_EVENTFD, &fd, 1);
+}
+
+}
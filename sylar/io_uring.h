@@ -0,0 +1,142 @@
+/**
+  ******************************************************************************
+  * @file           : io_uring.h
+  * @author         : 18483
+  * @brief          : io_uring 的封装 (直接使用系统调用，不依赖 liburing)
+  * @attention      : None
+  * @date           : 2025/5/10
+  ******************************************************************************
+  */
+
+
+#ifndef SYLAR_IO_URING_H
+#define SYLAR_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "mutex.h"
+
+namespace sylar {
+
+/**
+ * @brief io_uring 实例
+ * @details 提交队列和完成队列映射到用户态，多线程共用：提交加锁并立即进入内核提交，
+ *          取完成事件加另一把锁；检查完成队列是否为空不加锁也不进入内核
+ */
+class IoUring : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 创建 io_uring
+     * @param entries 提交队列大小
+     * @param cq_entries 完成队列大小 (溢出的完成事件由内核暂存，不会丢失)
+     * @return 内核不支持或被禁用时返回 nullptr，errno 为原因
+     */
+    static IoUring* Create(uint32_t entries, uint32_t cq_entries);
+
+    ~IoUring();
+
+    /**
+     * @brief 提交 SQE，返回时内核已经取走
+     * @details 链接的 SQE 已被取走一部分后内核持续拒绝剩余部分时 (如完成队列溢出时的 EBUSY)，
+     *          先把完成事件转存到用户态腾出完成队列再重试，重试次数有限；
+     *          最终仍失败则撤回剩余 SQE，并以该错误为结果生成它们的完成事件，由 reap 取出
+     * @param sqes SQE 数组，带 IOSQE_IO_LINK 的 SQE 与下一个链接
+     * @param count 数量，不超过提交队列大小
+     * @return 成功返回 0，失败返回 -errno (SQE 没有被提交)
+     */
+    int submit(const io_uring_sqe* sqes, uint32_t count);
+
+    /**
+     * @brief 完成队列中是否有未取出的完成事件
+     */
+    bool hasCompletions() const {
+        return m_hasBacklog.load(std::memory_order_acquire)
+                || __atomic_load_n(m_cqHead, __ATOMIC_RELAXED)
+                != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * @brief 取出所有完成事件，追加到 cqes
+     * @return 取出的数量
+     */
+    size_t reap(std::vector<io_uring_cqe>& cqes);
+
+    /**
+     * @brief 内核是否支持这些操作 (IORING_REGISTER_PROBE，内核 5.6 起可用)
+     * @param ops IORING_OP_* 数组
+     * @param count 数量
+     */
+    bool supportsOps(const uint8_t* ops, size_t count);
+
+    /**
+     * @brief 内核是否支持按 fd 取消 (IORING_ASYNC_CANCEL_FD，内核 5.19 起可用)
+     * @details 同步提交一个按本 io_uring 的 fd 取消的请求并等待结果，只能在注册 eventfd 之前、
+     *          还没有其他提交时调用
+     */
+    bool supportsCancelFd();
+
+    /**
+     * @brief 注册 eventfd，有完成事件时内核写 eventfd
+     */
+    int registerEventFd(int fd);
+
+    /**
+     * @brief io_uring 句柄
+     */
+    int getFd() const { return m_fd; }
+private:
+    IoUring();
+
+    /**
+     * @brief io_uring_enter 系统调用
+     */
+    int enter(uint32_t to_submit, uint32_t flags, uint32_t min_complete = 0);
+
+    /**
+     * @brief 取出完成队列中的完成事件，追加到 cqes，需持有 m_cqMutex
+     */
+    size_t reapRing(std::vector<io_uring_cqe>& cqes);
+
+private:
+    /// io_uring 句柄
+    int m_fd = -1;
+    /// 提交队列映射的内存
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    /// 完成队列映射的内存 (内核支持 IORING_FEAT_SINGLE_MMAP 时与提交队列相同)
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    /// SQE 数组
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    uint32_t* m_sqHead = nullptr;
+    uint32_t* m_sqTail = nullptr;
+    uint32_t m_sqMask = 0;
+    uint32_t m_sqEntries = 0;
+    uint32_t* m_sqFlags = nullptr;
+    uint32_t* m_sqArray = nullptr;
+
+    uint32_t* m_cqHead = nullptr;
+    uint32_t* m_cqTail = nullptr;
+    uint32_t m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+
+    /// 提交锁
+    MutexType m_sqMutex;
+    /// 取完成事件的锁
+    MutexType m_cqMutex;
+    /// 提交受阻时从完成队列转存的完成事件，以及撤回的 SQE 生成的完成事件，受 m_cqMutex 保护
+    std::vector<io_uring_cqe> m_backlog;
+    /// m_backlog 非空
+    std::atomic<bool> m_hasBacklog = {false};
+};
+
+}
+
+#endif //SYLAR_IO_URING_H
@@ -10,12 +10,21 @@
   */
 
 #include "iomanager.h"
+#include "io_uring.h"
+#include "fd_manager.h"
 #include "macro.h"
 #include "log.h"
+#include "config.h"
+#include "util.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -24,9 +33,146 @@ namespace sylar{
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+static sylar::ConfigVar<uint32_t>::ptr g_iomanager_spin_us =
+        sylar::Config::Lookup<uint32_t>("iomanager.spin_us", 50
+                , "max microseconds an idle worker polls before blocking in epoll, 0 disables");
+
+static sylar::ConfigVar<bool>::ptr g_iomanager_timerfd =
+        sylar::Config::Lookup<bool>("iomanager.timerfd", true
+                , "wake idle workers with a per-thread timerfd instead of epoll_wait timeouts");
+
+static sylar::ConfigVar<std::string>::ptr g_iomanager_backend =
+        sylar::Config::Lookup<std::string>("iomanager.backend", "epoll"
+                , "io backend of IOManagers created afterwards: epoll or io_uring"
+                  " (hooked socket IO is submitted to io_uring, needs linux 5.19 for cancel by fd,"
+                  " falls back to epoll if unsupported)");
+
+static sylar::ConfigVar<bool>::ptr g_iomanager_persistent_events =
+        sylar::Config::Lookup<bool>("iomanager.persistent_events", false
+                , "keep each fd registered edge-triggered for read and write until cancleAll"
+                  " and latch readiness, instead of epoll_ctl on every wait (IOManagers created afterwards)");
+
+static sylar::ConfigVar<bool>::ptr g_iomanager_multi_reactor =
+        sylar::Config::Lookup<bool>("iomanager.multi_reactor", false
+                , "give each worker thread its own epoll, fds belong to one worker and their waiters"
+                  " resume on it (IOManagers created afterwards, thread count is fixed)");
+
+/// idle 每轮都要读取，缓存配置值避免加配置锁
+static uint32_t s_spin_us = 50;
+/// 单核上自旋只会占住生产者需要的 CPU，不自旋
+static bool s_spin_enabled = true;
+/// 新进入 idle 的线程是否使用 timerfd
+static bool s_timerfd = true;
+struct _IOManagerIniter {
+    _IOManagerIniter() {
+        s_spin_us = g_iomanager_spin_us->getValue();
+        s_spin_enabled = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+        s_timerfd = g_iomanager_timerfd->getValue();
+
+        g_iomanager_timerfd->addListener([](const bool& old_value, const bool& new_value) {
+            s_timerfd = new_value;
+        });
+
+        g_iomanager_spin_us->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "iomanager spin_us changed from "
+                                     << old_value << " to " << new_value;
+            s_spin_us = new_value;
+        });
+    }
+};
+static _IOManagerIniter s_iomanager_initer;
+
+/**
+ * @brief 定向唤醒信号
+ * @details 所有工作线程阻塞在同一个 epoll 上，pipe 无法指定唤醒哪个线程
+ *          指定线程的任务通过向目标线程发送该信号打断 epoll_pwait
+ *          工作线程开始调度时屏蔽该信号，只在 epoll_pwait 期间放开，不会打断其他系统调用
+ *          使用实时信号 (看门狗使用 SIGRTMIN+3)，不占用有实际含义的标准信号
+ */
+static int GetWakeupSignal() {
+    return SIGRTMIN + 4;
+}
+
+static void OnWakeupSignal(int) {
+}
+
+/**
+ * @brief 第一个 IOManager 构造时安装唤醒信号的空处理函数 (忽略的信号不会打断 epoll_pwait)
+ * @details SA_RESTART: 屏蔽之前到达的信号打断的系统调用自动重启
+ */
+struct _WakeupSignalIniter {
+    _WakeupSignalIniter() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &OnWakeupSignal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(GetWakeupSignal(), &sa, nullptr);
+    }
+};
+
 enum EpollCtlOp{
 };
 
+/**
+ * @brief 线程 timerfd 在 epoll 中的 data
+ * @details FdContext 指针按 8 字节对齐，最低位为 1 的 data 表示 timerfd，高 32 位是所属线程 id
+ *          只用线程 id 而不用指针，其他线程取到已退出线程的事件时不会访问已释放的内存
+ */
+static uint64_t TimerFdData(int thread) {
+    return ((uint64_t)(uint32_t)thread << 32) | 1;
+}
+
+/// io_uring 的 eventfd 在 epoll 中的 data (最低位为 1，高 32 位不是有效的线程 id)
+static const uint64_t s_uring_data = ~0ull;
+/// io_uring 提交队列大小，每次提交后立即进入内核，最多同时占用 2 个
+static const uint32_t s_uring_entries = 64;
+/// io_uring 完成队列大小，溢出时内核暂存，不会丢失
+static const uint32_t s_uring_cq_entries = 4096;
+/// 使用的 io_uring 操作
+static const uint8_t s_uring_ops[] = {
+    IORING_OP_RECV, IORING_OP_RECVMSG, IORING_OP_SEND, IORING_OP_SENDMSG
+    , IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL
+};
+/// 取消请求的 user_data 低 3 位 (UringWait 按 8 字节对齐，不会与之相同)，高 32 位为 fd
+static const uint64_t s_uring_cancel_tag = 2;
+/// 下一个 IOManager 的编号
+static std::atomic<uint64_t> s_iomanager_id = {0};
+
+/**
+ * @brief 提交到 io_uring 的操作的等待状态，位于等待协程的栈上
+ * @details 操作的 user_data 为其地址，链接的超时的 user_data 为地址 | 1，两个完成事件都取到后才唤醒协程
+ */
+struct UringWait {
+    /// 等待的协程
+    Fiber::ptr fiber;
+    /// 操作的结果
+    int res = 0;
+    /// 链接的超时是否到期
+    bool timed_out = false;
+    /// 尚未取到的完成事件数
+    std::atomic<int> pending = {0};
+    /// 多 reactor 模式下协程回到提交操作的 reactor 线程恢复，-1 表示任意线程
+    int thread = -1;
+};
+
+/**
+ * @brief 把 timerfd 设置到 deadline (毫秒时间戳)，~0ull 时停止
+ */
+static void ArmTimerFd(int fd, uint64_t deadline) {
+    struct itimerspec ts;
+    memset(&ts, 0, sizeof(ts));
+    if(deadline != ~0ull) {
+        ts.it_value.tv_sec = deadline / 1000;
+        ts.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    }
+    int rt = timerfd_settime(fd, TFD_TIMER_ABSTIME, &ts, nullptr);
+    if(rt) {
+        SYLAR_LOG_ERROR(g_logger) << "timerfd_settime(" << fd << ", " << deadline << ") errno="
+                                  << errno << " (" << strerror(errno) << ")";
+    }
+}
+
 /// 根据事件类型返回对应事件的上下文
 IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event) {
     switch(event) {
@@ -48,7 +194,7 @@ void IOManager::FdContext::resetContext(EventContext &ctx) {
 }
 
 /// 触发事件，执行该事件关联的回调函数或协程
-void IOManager::FdContext::triggerEvent(sylar::IOManager::Event event) {
+void IOManager::FdContext::triggerEvent(sylar::IOManager::Event event, int thread) {
     // 确保当前事件已在 events 中注册
     SYLAR_ASSERT(events & event);  // 逻辑与
     // 从当前事件集合中移除该事件 使其不再被监听
@@ -59,10 +205,10 @@ void IOManager::FdContext::triggerEvent(sylar::IOManager::Event event) {
     // 执行事件回调函数 或 协程
     if(ctx.cb){
         // 将回调函数添加到调度器中，等待调度执行
-        ctx.scheduler->schedule(&ctx.cb);
+        ctx.scheduler->schedule(&ctx.cb, thread);
     } else {
         // 将协程添加到调度器中，等待调度执行
-        ctx.scheduler->schedule(&ctx.fiber);
+        ctx.scheduler->schedule(&ctx.fiber, thread);
     }
     // 事件触发后清空调度器字段，避免重复调度
     ctx.scheduler = nullptr;
@@ -71,7 +217,9 @@ void IOManager::FdContext::triggerEvent(sylar::IOManager::Event event) {
 
 /// 构造函数
 IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
-    : Scheduler(threads, use_caller, name) {
+    : Scheduler(threads, use_caller, name)
+    , m_id(++s_iomanager_id) {
+    static _WakeupSignalIniter s_wakeup_signal_initer;
     // 创建epoll句柄, 参数为epoll监听的fd的数量
     m_epfd = epoll_create(5000);
     SYLAR_ASSERT(m_epfd > 0); // 检查epoll_creat是否成功
@@ -89,8 +237,9 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
     epoll_event event;
     // 初始化epoll事件，清空event结构内存
     memset(&event, 0, sizeof(epoll_event));
-    // 设置事件类型为：读事件，边缘触发
-    event.events = EPOLLIN | EPOLLET;
+    // 设置事件类型为：读事件，水平触发
+    // 每个被唤醒的线程只读走一个字节，剩余字节会继续唤醒其他空闲线程
+    event.events = EPOLLIN;
     event.data.fd = m_tickleFds[0]; //设置为管道pipe 的读端描述符
 
     // 设置管道读端为 非阻塞模式
@@ -101,6 +250,61 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
     rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
     SYLAR_ASSERT(!rt);
 
+    m_persistentEvents = g_iomanager_persistent_events->getValue();
+
+    // 多 reactor: 每个工作线程 (不含 caller 线程) 一个 epoll，reactor 按线程编号对应，线程数固定
+    size_t callers = use_caller ? 1 : 0;
+    if(g_iomanager_multi_reactor->getValue() && threads > callers) {
+        setThreadRange(threads, threads);
+        for(size_t i = callers; i < threads; ++i) {
+            Reactor* reactor = new Reactor;
+            reactor->epfd = epoll_create(5000);
+            SYLAR_ASSERT(reactor->epfd > 0);
+            m_reactors.push_back(reactor);
+        }
+    }
+
+    // io_uring 后端: 完成事件通过 eventfd 唤醒 epoll 中的空闲线程
+    if(g_iomanager_backend->getValue() == "io_uring") {
+        m_uring = IoUring::Create(s_uring_entries, s_uring_cq_entries);
+        // 操作和按 fd 取消都要支持，否则 close 唤醒不了等待中的协程
+        if(m_uring && (!m_uring->supportsOps(s_uring_ops, sizeof(s_uring_ops))
+                       || !m_uring->supportsCancelFd())) {
+            delete m_uring;
+            m_uring = nullptr;
+            errno = EOPNOTSUPP;
+        }
+        if(m_uring) {
+            m_uringEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN | EPOLLET;
+            event.data.u64 = s_uring_data;
+            bool ok = m_uringEventFd >= 0 && !m_uring->registerEventFd(m_uringEventFd)
+                    && !epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_uringEventFd, &event);
+            // 每个 reactor 都要监听，EPOLLEXCLUSIVE 使一次完成通知只唤醒其中一个
+            event.events |= EPOLLEXCLUSIVE;
+            for(size_t i = 0; ok && i < m_reactors.size(); ++i) {
+                ok = !epoll_ctl(m_reactors[i]->epfd, EPOLL_CTL_ADD, m_uringEventFd, &event);
+            }
+            if(!ok) {
+                SYLAR_LOG_ERROR(g_logger) << "io_uring eventfd setup errno=" << errno
+                                          << " (" << strerror(errno) << "), use epoll";
+                if(m_uringEventFd >= 0) {
+                    close(m_uringEventFd);
+                    m_uringEventFd = -1;
+                }
+                delete m_uring;
+                m_uring = nullptr;
+            }
+        } else {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring setup errno=" << errno
+                                      << " (" << strerror(errno) << "), use epoll";
+        }
+    } else if(g_iomanager_backend->getValue() != "epoll") {
+        SYLAR_LOG_ERROR(g_logger) << "unknown iomanager.backend="
+                                  << g_iomanager_backend->getValue() << ", use epoll";
+    }
+
     // 初始化 fd 上下文数组大小为32
     contextResize(32);
 
@@ -115,6 +319,14 @@ IOManager::~IOManager(){
     close(m_epfd);         // 关闭epoll句柄
     close(m_tickleFds[0]); // 关闭 pipe 读端
     close(m_tickleFds[1]); // 关闭 pipe 写端
+    if(m_uring) {
+        delete m_uring;
+        close(m_uringEventFd);
+    }
+    for(auto reactor : m_reactors) {
+        close(reactor->epfd);
+        delete reactor;
+    }
 
     // 释放 fd 上下文数组中分配的内存
     for(size_t i = 0; i < m_fdContexts.size(); ++i) {
@@ -157,6 +369,15 @@ int IOManager::addEvent(int fd, sylar::IOManager::Event event, std::function<voi
         fd_ctx = m_fdContexts[fd];
     }
 
+    // 持久注册模式: 当前 FdCtx 的代数，没有 FdCtx 时为 0
+    uint64_t generation = 0;
+    if(m_persistentEvents) {
+        FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+        if(ctx) {
+            generation = ctx->getGeneration();
+        }
+    }
+
     /// 2.防止重复添加事件，注册事件
     // 一个句柄一般不会重复添加同一个事件，可能是两个不同线程在操控同一个句柄
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
@@ -167,22 +388,56 @@ int IOManager::addEvent(int fd, sylar::IOManager::Event event, std::function<voi
         SYLAR_ASSERT(!(fd_ctx->events & event));
     }
 
-    // 若已经有注册的事件则为修改操作 若没有则添加操作
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    // 设置 epoll 事件，使用边缘触发 并保留保留原始事件
-    epevent.events = EPOLLIN | fd_ctx->events | event;
-    // 将fd_ctx 保存到data指针中
-    epevent.data.ptr = fd_ctx;
-
-    // 注册事件
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt){
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
-                << (EPOLL_EVENTS)fd_ctx->events;
-        return -1;
+    // 多 reactor 模式: fd 第一次等待时归属当前线程的 reactor，其他线程等待时轮流分配
+    if(!m_reactors.empty() && fd_ctx->owner < 0) {
+        int index = currentReactor();
+        fd_ctx->owner = index >= 0 ? index : m_nextReactor++ % m_reactors.size();
+    }
+    int epfd = epollFd(fd_ctx);
+
+    if(m_persistentEvents) {
+        // 持久注册: 只在第一次等待时注册，之后不再调用 epoll_ctl
+        // 代数不同: fd 关闭时没有经过 cancleAll (未 hook 的 close 或在其他 IOManager 中关闭)，
+        // 内核已经把旧 fd 从 epoll 中删除，重新注册
+        if(!fd_ctx->registered || fd_ctx->generation != generation) {
+            epoll_event epevent;
+            epevent.events = EPOLLET | EPOLLIN | EPOLLOUT;
+            epevent.data.ptr = fd_ctx;
+            int rt = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epevent);
+            // EEXIST: FdCtx 换过但 fd 并没有关闭，原来的注册还在，可以继续使用
+            if(rt && errno != EEXIST) {
+                SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
+                        << (EpollCtlOp)EPOLL_CTL_ADD << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                        << rt << " (" << errno << ") (" << strerror(errno) << ")";
+                return -1;
+            }
+            fd_ctx->registered = true;
+            fd_ctx->generation = generation;
+            fd_ctx->ready = NONE;
+        }
+        // 已经有就绪通知，协程不用挂起
+        if(!cb && (fd_ctx->ready & event)) {
+            fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+            return 1;
+        }
+    } else {
+        // 若已经有注册的事件则为修改操作 若没有则添加操作
+        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        // 设置 epoll 事件，使用边缘触发 并保留保留原始事件
+        epevent.events = EPOLLET | fd_ctx->events | event;
+        // 将fd_ctx 保存到data指针中
+        epevent.data.ptr = fd_ctx;
+
+        // 注册事件
+        int rt = epoll_ctl(epfd, op, fd, &epevent);
+        if(rt){
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
+                    << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                    << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
+                    << (EPOLL_EVENTS)fd_ctx->events;
+            return -1;
+        }
     }
 
     /// 3.更新事件上下文
@@ -208,6 +463,12 @@ int IOManager::addEvent(int fd, sylar::IOManager::Event event, std::function<voi
         SYLAR_ASSERT2(event_ctx.fiber->getState() == Fiber::EXEC
                         , "state=" << event_ctx.fiber->getState());
     }
+    // 持久注册模式下回调等待的事件已经就绪，立即触发
+    if(fd_ctx->ready & event) {
+        fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+        fd_ctx->triggerEvent(event, ownerThread(fd_ctx, event));
+        --m_pendingEventCount;
+    }
     return 0;
 }
 
@@ -239,30 +500,33 @@ bool IOManager::delEvent(int fd, sylar::IOManager::Event event) {
 
     // 删除指定事件，创建新的不包含删除事件的事件集
     Event new_events = (Event)(fd_ctx->events & ~event);  // 逻辑与一个 非event
-    // 如果还有其他事件，那么就是修改已注册事件，否则就是删除事件
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    // 创建 epoll_event 结构体
-    epoll_event epevent;
-    // 设置epoll事件，使用边缘触发模式 新的注册事件(只有在事件从无到有变化时，epoll返回该事件)
-    epevent.events = EPOLLET | new_events;
-    // 将 fd_ctx 保存到data指针中
-    epevent.data.ptr = fd_ctx;
-
-    // 注册事件
-    // 调用epoll_ctl删除事件 将更新的事件集 epevent 注册到 m_epfd 中
-    /**
-     * @brief 从用户空间将epoll_event结构copy到内核空间
-     * @parm m_epfd   epoll文件描述符
-     * @parm op       决定是修改还是删除事件
-     * @parm fd       要操作的文件描述符
-     * @parm epevent  告诉内核需要监听的事件
-     */
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt){
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                  << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    // 持久注册模式下 fd 保持注册，之后的就绪通知记录在 ready 中
+    if(!m_persistentEvents) {
+        // 如果还有其他事件，那么就是修改已注册事件，否则就是删除事件
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        // 创建 epoll_event 结构体
+        epoll_event epevent;
+        // 设置epoll事件，使用边缘触发模式 新的注册事件(只有在事件从无到有变化时，epoll返回该事件)
+        epevent.events = EPOLLET | new_events;
+        // 将 fd_ctx 保存到data指针中
+        epevent.data.ptr = fd_ctx;
+
+        // 注册事件
+        // 调用epoll_ctl删除事件 将更新的事件集 epevent 注册到 fd 所在的 epoll 中
+        /**
+         * @brief 从用户空间将epoll_event结构copy到内核空间
+         * @parm epfd     epoll文件描述符
+         * @parm op       决定是修改还是删除事件
+         * @parm fd       要操作的文件描述符
+         * @parm epevent  告诉内核需要监听的事件
+         */
+        int rt = epoll_ctl(epollFd(fd_ctx), op, fd, &epevent);
+        if(rt){
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epollFd(fd_ctx) << ", "
+                                      << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
     }
     /// 3.重置事件上下文
 
@@ -300,27 +564,29 @@ bool IOManager::cancleEvent(int fd, sylar::IOManager::Event event) {
         return false;
     }
 
-    /// 2. 清除指定事件 表示不关心这个事件了
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    // 将fd_ctx 保存到data指针中
-    epevent.data.ptr = fd_ctx;
-
-    // 注册事件
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt){
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                  << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    /// 2. 清除指定事件 表示不关心这个事件了 (持久注册模式下 fd 保持注册)
+    if(!m_persistentEvents) {
+        Event new_events = (Event)(fd_ctx->events & ~event);
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | new_events;
+        // 将fd_ctx 保存到data指针中
+        epevent.data.ptr = fd_ctx;
+
+        // 注册事件
+        int rt = epoll_ctl(epollFd(fd_ctx), op, fd, &epevent);
+        if(rt){
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epollFd(fd_ctx) << ", "
+                                      << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
     }
 
     /// 3.触发事件
 
     // 取消事件需要触发事件
-    fd_ctx->triggerEvent(event);
+    fd_ctx->triggerEvent(event, ownerThread(fd_ctx, event));
     // 减少待处理事件数量
     --m_pendingEventCount;
     return true;
@@ -342,45 +608,219 @@ bool IOManager::cancleAll(int fd) {
     lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    // 持久注册模式下即使没有等待的事件也要从 epoll 中删除，fd 关闭后句柄号可能被复用
+    bool unregistered = false;
+    if(fd_ctx->registered) {
+        int rt = epoll_ctl(epollFd(fd_ctx), EPOLL_CTL_DEL, fd, nullptr);
+        if(rt) {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epollFd(fd_ctx) << ", "
+                                      << (EpollCtlOp)EPOLL_CTL_DEL << ", " << fd << "):"
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        }
+        fd_ctx->registered = false;
+        fd_ctx->ready = NONE;
+        unregistered = true;
+    }
     if((!(fd_ctx->events))){
-        return false;
+        // fd 关闭后句柄号可能被复用，重新分配 reactor
+        fd_ctx->owner = -1;
+        return unregistered;
     }
 
     /// 2.删除所有事件
 
-    // 删除操作
-    int op = EPOLL_CTL_DEL;
-    epoll_event epevent;
-    // 删除所有事件
-    epevent.events = 0;
-    // 将fd_ctx 保存到data指针中
-    epevent.data.ptr = fd_ctx;
-
-    // 注册事件
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt){
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                  << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    if(!m_persistentEvents) {
+        // 删除操作
+        int op = EPOLL_CTL_DEL;
+        epoll_event epevent;
+        // 删除所有事件
+        epevent.events = 0;
+        // 将fd_ctx 保存到data指针中
+        epevent.data.ptr = fd_ctx;
+
+        // 注册事件
+        int rt = epoll_ctl(epollFd(fd_ctx), op, fd, &epevent);
+        if(rt){
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epollFd(fd_ctx) << ", "
+                                      << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
     }
 
     /// 3.触发所有事件
     // 触发所有读事件
     if(fd_ctx->events & READ){
-        fd_ctx->triggerEvent(READ);
+        fd_ctx->triggerEvent(READ, ownerThread(fd_ctx, READ));
         --m_pendingEventCount;
     }
     // 触发所有写事件
     if(fd_ctx->events & WRITE){
-        fd_ctx->triggerEvent(WRITE);
+        fd_ctx->triggerEvent(WRITE, ownerThread(fd_ctx, WRITE));
         --m_pendingEventCount;
     }
     // 断言没有剩余事件
     SYLAR_ASSERT(fd_ctx->events == 0);
+    fd_ctx->owner = -1;
     return true;
 }
 
+int IOManager::assignReactor(int fd) {
+    if(m_reactors.empty()) {
+        return -1;
+    }
+    FdContext* fd_ctx = nullptr;
+    RWMutexType::ReadLock lock(m_mutex);
+    if((int)m_fdContexts.size() > fd) {
+        fd_ctx = m_fdContexts[fd];
+        lock.unlock();
+    } else {
+        lock.unlock();
+        RWMutexType::WriteLock lock2(m_mutex);
+        contextResize(fd * 1.5);
+        fd_ctx = m_fdContexts[fd];
+    }
+
+    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    if(fd_ctx->owner < 0) {
+        fd_ctx->owner = m_nextReactor++ % m_reactors.size();
+    }
+    return m_reactors[fd_ctx->owner]->thread;
+}
+
+int IOManager::currentReactor() const {
+    if(m_reactors.empty() || Scheduler::GetThis() != this) {
+        return -1;
+    }
+    int index = GetWorkerId() - (m_rootThread == -1 ? 0 : 1);
+    return index >= 0 && index < (int)m_reactors.size() ? index : -1;
+}
+
+int IOManager::ownerThread(FdContext* fd_ctx, Event event) {
+    if(fd_ctx->owner < 0) {
+        return -1;
+    }
+    FdContext::EventContext& ctx = fd_ctx->getContext(event);
+    // 其他调度器的任务不能指定到本调度器的线程，共享栈协程只能回到原线程
+    if(ctx.scheduler != this || (ctx.fiber && ctx.fiber->getOwnerThread() != -1)) {
+        return -1;
+    }
+    return m_reactors[fd_ctx->owner]->thread;
+}
+
+int IOManager::submitIo(const io_uring_sqe& sqe, uint64_t timeout_ms) {
+    SYLAR_ASSERT(m_uring);
+    UringWait wait;
+    wait.fiber = Fiber::GetThis();
+    if(currentReactor() >= 0) {
+        wait.thread = GetThreadId();
+    }
+
+    io_uring_sqe sqes[2];
+    sqes[0] = sqe;
+    sqes[0].user_data = (uint64_t)(uintptr_t)&wait;
+    uint32_t count = 1;
+    // 超时用链接的 IORING_OP_LINK_TIMEOUT，到期时内核取消操作，不需要定时器
+    __kernel_timespec ts;
+    if(timeout_ms != ~0ull) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        sqes[0].flags |= IOSQE_IO_LINK;
+        io_uring_sqe& link = sqes[1];
+        memset(&link, 0, sizeof(link));
+        link.opcode = IORING_OP_LINK_TIMEOUT;
+        link.fd = -1;
+        link.addr = (uint64_t)(uintptr_t)&ts;
+        link.len = 1;
+        link.user_data = sqes[0].user_data | 1;
+        count = 2;
+    }
+    wait.pending = count;
+
+    ++m_pendingEventCount;
+    int rt = m_uring->submit(sqes, count);
+    if(SYLAR_UNLIKELY(rt)) {
+        --m_pendingEventCount;
+        SYLAR_LOG_ERROR(g_logger) << "io_uring submit opcode=" << (int)sqe.opcode
+                                  << " fd=" << sqe.fd << " error=" << -rt
+                                  << " (" << strerror(-rt) << ")";
+        return rt;
+    }
+    // 数据已就绪的操作在提交时就已完成，直接取走，免去一次 eventfd 唤醒
+    if(m_uring->hasCompletions()) {
+        reapUring();
+    }
+    Fiber::YiledToHold();
+    if(wait.timed_out && wait.res == -ECANCELED) {
+        return -ETIMEDOUT;
+    }
+    return wait.res;
+}
+
+void IOManager::cancleUringIo(int fd) {
+    if(!m_uring) {
+        return;
+    }
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe.user_data = ((uint64_t)(uint32_t)fd << 32) | s_uring_cancel_tag;
+    int rt = m_uring->submit(&sqe, 1);
+    if(rt) {
+        SYLAR_LOG_ERROR(g_logger) << "io_uring cancel fd=" << fd << " error=" << -rt
+                                  << " (" << strerror(-rt) << ")";
+    }
+    // 提交受阻时转存的完成事件不会再写 eventfd，在这里取走
+    if(m_uring->hasCompletions()) {
+        reapUring();
+    }
+}
+
+void IOManager::reapUring() {
+    static thread_local std::vector<io_uring_cqe> t_cqes;
+    static thread_local std::vector<Fiber::ptr> t_fibers;
+    m_uring->reap(t_cqes);
+    for(auto& cqe : t_cqes) {
+        if(!cqe.user_data) {
+            continue;
+        }
+        if((cqe.user_data & 7) == s_uring_cancel_tag) {
+            // 取消请求本身的完成事件；没有可取消的操作时为 -ENOENT
+            if(cqe.res < 0 && cqe.res != -ENOENT) {
+                SYLAR_LOG_ERROR(g_logger) << "io_uring cancel fd=" << (int)(cqe.user_data >> 32)
+                                          << " error=" << -cqe.res << " (" << strerror(-cqe.res) << ")";
+            }
+            continue;
+        }
+        UringWait* wait = (UringWait*)(uintptr_t)(cqe.user_data & ~1ull);
+        if(cqe.user_data & 1) {
+            wait->timed_out = cqe.res == -ETIME;
+        } else {
+            wait->res = cqe.res;
+        }
+        // 之后 wait 随时可能随协程返回而失效，不能再访问
+        int thread = wait->thread;
+        if(--wait->pending == 0) {
+            if(thread == -1) {
+                t_fibers.push_back(std::move(wait->fiber));
+            } else {
+                Fiber::ptr fiber = std::move(wait->fiber);
+                schedule(&fiber, thread);
+                --m_pendingEventCount;
+            }
+        }
+    }
+    t_cqes.clear();
+    if(!t_fibers.empty()) {
+        size_t n = t_fibers.size();
+        schedule(t_fibers.begin(), t_fibers.end());
+        t_fibers.clear();
+        m_pendingEventCount -= n;
+    }
+}
+
 /// 获取当前 IO调度器
 IOManager* IOManager::GetThis() {
     return dynamic_cast<IOManager*>(Scheduler::GetThis());
@@ -388,6 +828,10 @@ IOManager* IOManager::GetThis() {
 
 /// 通知调度协程从 idle 中退出
 void IOManager::tickle(){
+    wakeIdle(true);
+}
+
+void IOManager::wakeIdle(bool skip_spinning) {
     /**
      * 1.判断是否有空闲线程 (如果没有则直接返回)
      * 2.向队列中的第一个文件描述符做一个写操作来唤醒它
@@ -395,13 +839,96 @@ void IOManager::tickle(){
     if(!hasIdleThreads()) {
      return;
     }
+    // 有线程在自旋，它会自己看到新任务 (自旋结束时会再检查一次队列)
+    // 正在停止时不能省略: 自旋的线程不会转告已经阻塞在 epoll_pwait 中的线程
+    if(skip_spinning && m_spinningCount > 0 && !m_stopping.load(std::memory_order_acquire)) {
+        return;
+    }
+    if(!m_reactors.empty()) {
+        // 多 reactor 模式下工作线程等待各自的 epoll，pipe 只能唤醒 caller 线程
+        // 直接向一个正在休眠的 reactor 线程发送唤醒信号
+        // 与 idle 中先标记 sleeping 再检查任务配合，避免丢失唤醒
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        size_t n = m_reactors.size();
+        size_t start = m_nextWake++;
+        for(size_t i = 0; i < n; ++i) {
+            Reactor* reactor = m_reactors[(start + i) % n];
+            if(reactor->sleeping && reactor->sleeping.exchange(false)) {
+                tickleThread(reactor->thread);
+                return;
+            }
+        }
+        if(m_rootThread == -1) {
+            return;
+        }
+    }
+    // 合并唤醒: 管道中未被读走的字节数不超过空闲线程数
+    // 突发大量 schedule 时每个空闲线程最多被唤醒一次
+    size_t pending = m_pendingTickles.load();
+    do {
+        if(pending >= m_idleThreadCount) {
+            return;
+        }
+    } while(!m_pendingTickles.compare_exchange_weak(pending, pending + 1));
     int rt = write(m_tickleFds[1], "T", 1);
     SYLAR_ASSERT(rt == 1);
 }
 
-bool IOManager::stopping(uint64_t& timeout) {
-    timeout = getNextTimer();
-    return timeout == ~0ull
+/// 唤醒指定的空闲线程
+void IOManager::tickleThread(int thread) {
+    // 本线程在 idle 中投递给自己的任务，回到调度协程时就会看到
+    if(thread == GetThreadId()) {
+        return;
+    }
+    syscall(SYS_tgkill, getpid(), thread, GetWakeupSignal());
+}
+
+/// 停止时唤醒所有线程
+void IOManager::tickleAll() {
+    // 不经过 wakeIdle: 不合并、不跳过自旋的线程、不依赖 sleeping 标记
+    // 阻塞在 epoll_pwait 中的线程可能没有超时 (timerfd)，必须每个都唤醒
+    for(auto reactor : m_reactors) {
+        int thread = reactor->thread;
+        if(thread != -1) {
+            // 线程不在 epoll_pwait 中时信号保持挂起，下次进入时立即返回
+            reactor->sleeping = false;
+            tickleThread(thread);
+        }
+    }
+    // 共享 epoll 上的线程 (多 reactor 模式下只有 caller 线程) 每个读走一个字节
+    size_t n = getThreadCount() + (m_rootThread == -1 ? 0 : 1);
+    for(size_t i = 0; i < n; ++i) {
+        ++m_pendingTickles;
+        int rt = write(m_tickleFds[1], "T", 1);
+        SYLAR_ASSERT(rt == 1);
+    }
+}
+
+/// 调度线程平时屏蔽定向唤醒信号
+void IOManager::onThreadStart() {
+    sigset_t wakeup_set;
+    sigemptyset(&wakeup_set);
+    sigaddset(&wakeup_set, GetWakeupSignal());
+    pthread_sigmask(SIG_BLOCK, &wakeup_set, nullptr);
+}
+
+std::ostream& IOManager::dump(std::ostream& os) {
+    Scheduler::dump(os);
+    os << "    backend=" << (m_uring ? "io_uring" : "epoll")
+       << " persistent_events=" << m_persistentEvents
+       << " reactors=" << m_reactors.size()
+       << " pending_events=" << m_pendingEventCount
+       << " spinning=" << m_spinningCount
+       << " spin_hits=" << m_spinHits
+       << " spin_misses=" << m_spinMisses << std::endl;
+    os << "    timers=";
+    dumpTimers(os) << std::endl;
+    return os;
+}
+
+bool IOManager::stopping(uint64_t& deadline) {
+    deadline = getNextDeadline();
+    return deadline == ~0ull
         && m_pendingEventCount == 0
         && Scheduler::stopping();
 }
@@ -436,45 +963,163 @@ void IOManager::idle(){
         delete[] ptr;
     });
 
+    // 定向唤醒信号已在 onThreadStart 中屏蔽，只在 epoll_pwait 期间放开
+    // 信号在 epoll_pwait 之前到达时保持挂起，进入 epoll_pwait 后立即返回，不会丢失唤醒
+    sigset_t wait_mask;
+    pthread_sigmask(SIG_SETMASK, nullptr, &wait_mask);
+    sigdelset(&wait_mask, GetWakeupSignal());
+
+    // 本线程的自旋时长，自旋有收获时加倍，落空时减半，上限为 iomanager.spin_us
+    uint32_t spin_us = s_spin_us;
+
+    // 本线程添加的定时器放在本线程的分片，由本线程处理
+    attachTimerThread();
+
+    // 多 reactor 模式下只等待本线程的 epoll (caller 线程没有 reactor，等待共享的 epoll)
+    int reactor_index = currentReactor();
+    Reactor* reactor = reactor_index >= 0 ? m_reactors[reactor_index] : nullptr;
+    int epfd = m_epfd;
+    if(reactor) {
+        reactor->thread = GetThreadId();
+        epfd = reactor->epfd;
+    }
+
+    // 本线程的 timerfd，设置为本线程最近的定时器到期时间，epoll_pwait 不再需要超时
+    // 边缘触发: 其他线程取到该事件时只需转告本线程，不用读 timerfd
+    int timer_fd = -1;
+    // timerfd 当前设置的到期时间
+    uint64_t armed = ~0ull;
+    if(s_timerfd) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = TimerFdData(GetThreadId());
+        if(timer_fd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &event)) {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", add timerfd " << timer_fd
+                                      << ") errno=" << errno << " (" << strerror(errno) << ")";
+            close(timer_fd);
+            timer_fd = -1;
+        }
+    }
+
     /// 1.循环等待事件
     while(true) {
-        uint64_t next_timeout = 0;
+        uint64_t deadline = ~0ull;
         // 判断调度器是否停止
-        if(stopping(next_timeout)){
+        if(stopping(deadline)){
             SYLAR_LOG_INFO(g_logger) << "name=" << getName()
                                      << " idle stopping exit";
             break;
         }
+        // 弹性线程池收缩，本线程退出
+        if(isRetiring()) {
+            SYLAR_LOG_INFO(g_logger) << "name=" << getName()
+                                     << " idle retiring exit";
+            break;
+        }
 
-        // 阻塞在epoll_wait上，等待事件发生
         int rt = 0;
+        bool spin_hit = false;
+        // 同时自旋的线程不超过工作线程数的一半，避免空转占满 CPU
+        size_t max_spinning = std::max<size_t>(1, (getThreadCount() + (m_rootThread == -1 ? 0 : 1)) / 2);
+        spin_us = std::min(spin_us, s_spin_us);
+        // 正在停止时不自旋，已经在自旋的线程看到停止后立即结束自旋
+        // (多 reactor 模式下停止的唤醒是信号，自旋中的线程收不到)
+        if(s_spin_enabled && spin_us > 0 && !m_stopping.load(std::memory_order_acquire)
+                && m_spinningCount < max_spinning) {
+            ++m_spinningCount;
+            uint64_t spin_deadline = GetMonotonicUS() + spin_us;
+            do {
+                if(hasPendingWork() || (m_uring && m_uring->hasCompletions())) {
+                    spin_hit = true;
+                    break;
+                }
+                rt = epoll_wait(epfd, events, MAX_EVENTS, 0);
+                if(rt > 0) {
+                    spin_hit = true;
+                    break;
+                }
+                rt = 0;
+            } while(!m_stopping.load(std::memory_order_acquire) && GetMonotonicUS() < spin_deadline);
+            --m_spinningCount;
+            // 退出自旋后再查一次，与 tickle 中对 m_spinningCount 的检查配合，避免丢失唤醒
+            if(!spin_hit && hasPendingWork()) {
+                spin_hit = true;
+            }
+            if(spin_hit) {
+                ++m_spinHits;
+                spin_us = std::min(std::max(spin_us * 2, 1u), s_spin_us);
+            } else {
+                ++m_spinMisses;
+                spin_us = std::max(spin_us / 2, std::max(s_spin_us / 16, 1u));
+            }
+            // 自旋期间调度器开始停止，回到循环开头退出，不再休眠
+            if(!spin_hit && stopping(deadline)) {
+                continue;
+            }
+        }
+
+        // 阻塞在epoll_wait上，等待事件发生
         do {
-            // 默认超时时间为5秒
+            if(spin_hit) {
+                break;
+            }
+            // 最长等待时间，正在停止或本线程可能空闲退出时需要定期醒来检查
             static const int MAX_TIMEOUT = 3000;
 
-            if(next_timeout != ~0ull) {
-                next_timeout = (int) next_timeout > MAX_TIMEOUT
-                        ? MAX_TIMEOUT : next_timeout;
-            } else {
-                next_timeout = MAX_TIMEOUT;
+            if(reactor) {
+                // 先标记休眠再检查任务、定时器和停止，与 wakeIdle 配合，避免丢失唤醒
+                reactor->sleeping = true;
+                if(hasPendingWork() || stopping(deadline)) {
+                    reactor->sleeping = false;
+                    break;
+                }
+            }
+
+            int timeout = MAX_TIMEOUT;
+            uint64_t now = GetCachedMS();
+            if(deadline <= now) {
+                timeout = 0;
+            } else if(timer_fd >= 0) {
+                if(deadline != armed) {
+                    ArmTimerFd(timer_fd, deadline);
+                    armed = deadline;
+                }
+                if(!m_stopping && !canRetire()) {
+                    timeout = -1;
+                }
+            } else if(deadline != ~0ull) {
+                timeout = std::min<uint64_t>(deadline - now, MAX_TIMEOUT);
             }
 
             // 等待事件发生，返回发生事件数量，-1 出错， 0 超时
-            rt = epoll_wait(m_epfd, events, MAX_EVENTS, (int)next_timeout);
+            rt = epoll_pwait(epfd, events, MAX_EVENTS, timeout, &wait_mask);
+            if(reactor) {
+                reactor->sleeping = false;
+            }
 
-            // 如果是中断，继续等待
+            // 被定向唤醒信号打断，回到调度协程检查 mailbox
             if(rt < 0 && errno == EINTR){
-            } else { // 否则退出循环
-                break;
+                rt = 0;
             }
+            break;
         } while(true);
 
+        // 每轮刷新一次本线程的缓存时间，定时器的到期检查和下一轮的等待时间都用它
+        // 使用精确时钟: 粗粒度时钟可能还没走到 timerfd 的到期时间
+        GetMonotonicUS();
         std::vector<std::function<void()>> cbs;
         listExpiredCb(cbs);
         if(!cbs.empty()) {
-            schedule(cbs.begin(), cbs.end());
+            // 定时器回调批量到期时不应推迟请求处理，以后台优先级调度
+            schedule(cbs.begin(), cbs.end(), BACKGROUND);
             cbs.clear();
         }
+        // io_uring 的完成事件 (eventfd 事件或自旋时看到的) 不需要读 eventfd，直接检查完成队列
+        if(m_uring && m_uring->hasCompletions()) {
+            reapUring();
+        }
 
         /// 2.处理所有发生的事件
 
@@ -483,9 +1128,27 @@ void IOManager::idle(){
             epoll_event& event = events[i];
             // 如果是管道读端事件，则读取数据
             if(event.data.fd == m_tickleFds[0]) {
-                uint8_t dummy[256];
-                // 读取管道中的数据，直到读完（read返回的字节数为0）
-                while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
+                uint8_t dummy;
+                // 只消费一次唤醒，其余的留给其他空闲线程
+                if(read(m_tickleFds[0], &dummy, 1) == 1) {
+                    --m_pendingTickles;
+                }
+                continue;
+            }
+            // io_uring 的完成事件，上面已经取过
+            if(event.data.u64 == s_uring_data) {
+                continue;
+            }
+            // 线程的 timerfd 到期
+            if(event.data.u64 & 1) {
+                int owner = event.data.u64 >> 32;
+                if(owner == GetThreadId()) {
+                    // 本线程的定时器下面就会处理，之后重新设置
+                    armed = ~0ull;
+                } else {
+                    // 其他线程的定时器，转告所属线程
+                    tickleThread(owner);
+                }
                 continue;
             }
 
@@ -498,7 +1161,7 @@ void IOManager::idle(){
              */
             // 出现这两种事件，应该同时触发fd的读和写事件，否则有可能出现注册的事件永远执行不到的情况
             if(event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+                event.events |= (EPOLLIN | EPOLLOUT) & (m_persistentEvents ? ~0u : fd_ctx->events);
             }
 
             // 实际发生的事件
@@ -506,34 +1169,45 @@ void IOManager::idle(){
             // 读/写事件 则设置实际发生的事件为读/写事件
             if(event.events & EPOLLIN ) { real_events |= READ; }
             if(event.events & EPOLLOUT) { real_events |= WRITE; }
-            //不是读写事件 则跳过
-            if((fd_ctx->events & real_events) == NONE){ continue; }
-
-            /// 3.更新 epoll 事件
-
-            // 剔除已经发生的事件 将剩余事件重新加入 epoll_wait
-            int left_events = (fd_ctx->events & ~real_events);
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events; // 更新事件
-
-            // // 对文件描述符 `fd_ctx -> fd` 执行操作 `op`，并将结果存储在 `rt2` 中
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if(rt2) {
-                SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                        << (EpollCtlOp)op << ", " << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events << "):"
-                        << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
-                continue;
+
+            if(m_persistentEvents) {
+                // 持久注册模式: 没有等待者的就绪通知记录下来，不修改 epoll 注册
+                if(!fd_ctx->registered) { continue; }  // 已被 cancleAll 删除
+                fd_ctx->ready = (Event)(fd_ctx->ready | (real_events & ~fd_ctx->events));
+                real_events &= fd_ctx->events;
+                if(real_events == NONE){ continue; }
+            } else {
+                // 只处理仍在等待的事件 (可能在 epoll_wait 返回后被取消)
+                real_events &= fd_ctx->events;
+                //不是读写事件 则跳过
+                if(real_events == NONE){ continue; }
+
+                /// 3.更新 epoll 事件
+
+                // 剔除已经发生的事件 将剩余事件重新加入 epoll_wait
+                int left_events = (fd_ctx->events & ~real_events);
+                int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+                event.events = EPOLLET | left_events; // 更新事件
+
+                // // 对文件描述符 `fd_ctx -> fd` 执行操作 `op`，并将结果存储在 `rt2` 中
+                int rt2 = epoll_ctl(epollFd(fd_ctx), op, fd_ctx->fd, &event);
+                if(rt2) {
+                    SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epollFd(fd_ctx) << ", "
+                            << (EpollCtlOp)op << ", " << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events << "):"
+                            << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
+                    continue;
+                }
             }
 
             /// 4.触发事件和更新挂起事件计数
 
             // 触发 读/写 事件
             if(real_events & READ) {
-                fd_ctx->triggerEvent(READ);
+                fd_ctx->triggerEvent(READ, ownerThread(fd_ctx, READ));
                 --m_pendingEventCount;
             }
             if(real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
+                fd_ctx->triggerEvent(WRITE, ownerThread(fd_ctx, WRITE));
                 --m_pendingEventCount;
             }
         }
@@ -549,10 +1223,34 @@ void IOManager::idle(){
         // 让出执行权
         raw_ptr->swapOut();
     }
+    if(timer_fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, timer_fd, nullptr);
+        close(timer_fd);
+    }
+    // 剩余的定时器交给其他线程
+    detachTimerThread();
+}
+
+/// 线程忙于执行任务时不进入 idle，在取任务之间处理本线程到期的定时器
+void IOManager::poll() {
+    std::vector<std::function<void()>> cbs;
+    listLocalExpiredCb(cbs);
+    if(!cbs.empty()) {
+        schedule(cbs.begin(), cbs.end(), BACKGROUND);
+    }
+    // 所有线程都忙时没有线程等在 epoll 上，io_uring 的完成事件在这里取
+    if(m_uring && m_uring->hasCompletions()) {
+        reapUring();
+    }
 }
 
 void IOManager::onTimerInsertedAtFront() {
-    tickle();
+    // 自旋的线程不会重新计算定时器的等待时间，必须写 pipe
+    wakeIdle(false);
+}
+
+void IOManager::onTimerThreadNotify(int thread) {
+    tickleThread(thread);
 }
 
 }
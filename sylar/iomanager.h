@@ -2,7 +2,7 @@
   ******************************************************************************
   * @file           : iomanager.h
   * @author         : 18483
-  * @brief          : 基于 Epoll 的 IO协程调度器
+  * @brief          : 基于 Epoll 的 IO协程调度器 (可选 io_uring 后端)
   * @attention      : fd->(File Description)  文件描述符
   * @date           : 2025/2/14
   ******************************************************************************
@@ -15,8 +15,12 @@
 #include "scheduler.h"
 #include "timer.h"
 
+struct io_uring_sqe;
+
 namespace sylar {
 
+class IoUring;
+
 class IOManager : public Scheduler , public TimerManager {
 public:
     typedef std::shared_ptr<IOManager> ptr;
@@ -65,9 +69,10 @@ private:
         /**
          * @brief 触发事件
          * @param event 事件类型
+         * @param thread 回调协程或回调函数执行的线程id，-1 表示任意线程
          * @details 根据事件类型调用对应上下文结构中的调度器去调度回调协程或回调函数
          */
-        void triggerEvent(Event event);
+        void triggerEvent(Event event, int thread = -1);
 
         /// 读事件上下文
         EventContext read;
@@ -79,6 +84,14 @@ private:
         /// 当前的事件
         /// 该fd添加了哪些事件的回调函数，或者说该fd关心哪些事件
         Event events = NONE;
+        /// 持久注册模式: fd 是否已经以读写、边缘触发注册到 epoll
+        bool registered = false;
+        /// 持久注册模式: 注册时 fd 的 FdCtx 代数，与当前 FdCtx 不同说明 fd 关闭时没有经过 cancleAll
+        uint64_t generation = 0;
+        /// 持久注册模式: 已就绪但没有等待者的事件，下次 addEvent 时直接消费
+        Event ready = NONE;
+        /// 多 reactor 模式: fd 所属的 reactor 下标，-1 表示尚未分配
+        int owner = -1;
         MutexType mutex; /// 事件上下文的锁
     };
 
@@ -102,6 +115,13 @@ public:
      * @param event 事件类型
      * @param cb 事件回调函数
      * @return 添加成功返回 0， 失败返回 -1
+     *         持久注册模式下事件已经就绪且没有传入 cb 时返回 1，不等待，调用者直接重试 IO
+     * @details 持久注册模式 (iomanager.persistent_events) 下 fd 第一次添加事件时以读写、边缘触发注册到 epoll，
+     *          直到 cancleAll 才删除，之后添加、删除、触发事件都不再调用 epoll_ctl；
+     *          没有等待者时到达的就绪通知记录在 FdContext::ready 中；
+     *          fd 的 FdCtx 已经换过 (关闭时没有调用 cancleAll，句柄号被复用) 时重新注册
+     *          多 reactor 模式 (iomanager.multi_reactor) 下 fd 注册到所属 reactor 的 epoll，
+     *          事件触发后等待的协程在该 reactor 的线程上恢复执行
      */
     int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
 
@@ -124,19 +144,82 @@ public:
     /**
      * @brief 取消所有事件
      * @param fd socket 句柄
+     * @attention 持久注册模式下同时从 epoll 中删除 fd，关闭 fd 之前必须调用 (hook 的 close 会调用)
      */
     bool cancleAll(int fd);
 
+    /**
+     * @brief 进程内唯一的编号，不随地址复用
+     * @details 缓存了本调度器定时器的对象 (如 FdCtx 的超时定时器) 用它判断调度器是否还是同一个
+     */
+    uint64_t getId() const { return m_id; }
+
+    /**
+     * @brief 是否使用持久注册模式 (构造时 iomanager.persistent_events 的值)
+     */
+    bool isPersistentEvents() const { return m_persistentEvents; }
+
+    /**
+     * @brief 是否使用多 reactor 模式 (构造时 iomanager.multi_reactor 的值且有工作线程)
+     */
+    bool isMultiReactor() const { return !m_reactors.empty(); }
+
+    /**
+     * @brief 把 fd 分配给一个 reactor (轮流分配)
+     * @param fd socket 句柄
+     * @return fd 所属 reactor 的线程id，未使用多 reactor 模式或该线程尚未启动时返回 -1
+     * @details 已经分配过的 fd 保持原来的 reactor，cancleAll 后重新分配；
+     *          hook 的 accept 对新连接调用，可以把处理连接的协程调度到返回的线程上
+     */
+    int assignReactor(int fd);
+
+    /**
+     * @brief 是否使用 io_uring 后端 (iomanager.backend 为 io_uring 且内核支持)
+     */
+    bool hasUring() const { return m_uring != nullptr; }
+
+    /**
+     * @brief 向 io_uring 提交一个 IO 操作，挂起当前协程直到操作完成
+     * @param sqe 填好的 SQE，user_data 由本函数设置
+     * @param timeout_ms 超时时间毫秒，~0ull 表示不超时
+     * @return CQE 的结果，失败为 -errno，超时为 -ETIMEDOUT，操作被取消为 -ECANCELED
+     * @attention 只能在本调度器的协程中调用，需要 hasUring()
+     */
+    int submitIo(const io_uring_sqe& sqe, uint64_t timeout_ms);
+
+    /**
+     * @brief 取消 fd 上所有提交到 io_uring 的操作，等待的协程得到 -ECANCELED
+     * @details io_uring 中的操作不区分读写方向，只能全部取消；未使用 io_uring 时什么也不做
+     */
+    void cancleUringIo(int fd);
+
     /**
      * @brief 返回当前的 IOManager
      */
     static IOManager* GetThis();
 
+    /**
+     * @brief 返回 idle 自旋期间等到任务或事件 (免去一次休眠) 的次数
+     */
+    uint64_t getSpinHits() const { return m_spinHits; }
+
+    /**
+     * @brief 返回 idle 自旋后仍然进入休眠的次数
+     */
+    uint64_t getSpinMisses() const { return m_spinMisses; }
+
+    std::ostream& dump(std::ostream& os) override;
+
 protected:
     void tickle() override;
+    void tickleThread(int thread) override;
+    void tickleAll() override;
+    void onThreadStart() override;
     bool stopping() override;
     void idle() override;
+    void poll() override;
     void onTimerInsertedAtFront() override;
+    void onTimerThreadNotify(int thread) override;
 
     /**
      * @brief 重置 socket 句柄上下文的容器大小
@@ -146,9 +229,52 @@ protected:
 
     /**
      * @brief 判断是否可以停止
-     * @param timeout 最近要触发的定时器事件间隔
+     * @param deadline 最近要触发的定时器的到期时间 (毫秒时间戳)，没有定时器时为 ~0ull
+     */
+    bool stopping(uint64_t& deadline);
+
+    /**
+     * @brief 写 pipe 唤醒一个空闲线程 (多 reactor 模式下向一个休眠的 reactor 线程发送唤醒信号)
+     * @param skip_spinning 有线程在自旋时不唤醒 (自旋只检查任务，定时器变化不能省略)
+     */
+    void wakeIdle(bool skip_spinning);
+
+    /**
+     * @brief 取出 io_uring 的所有完成事件，调度等待的协程
+     */
+    void reapUring();
+private:
+    /**
+     * @brief 多 reactor 模式下每个工作线程一个 reactor
+     * @details 线程只等待自己的 epoll，fd 的事件只在所属 reactor 的线程上取到并恢复执行
+     */
+    struct Reactor {
+        /// epoll 文件句柄
+        int epfd = -1;
+        /// 所属线程id，线程进入 idle 后设置
+        std::atomic<int> thread = {-1};
+        /// 线程是否 (即将) 阻塞在 epoll_pwait 中，唤醒时清除
+        std::atomic<bool> sleeping = {false};
+    };
+
+    /**
+     * @brief 当前线程的 reactor 下标，不是本调度器的 reactor 线程时返回 -1
+     */
+    int currentReactor() const;
+
+    /**
+     * @brief fd 注册所在的 epoll 句柄
+     * @attention 需要持有 fd_ctx->mutex
+     */
+    int epollFd(FdContext* fd_ctx) const {
+        return fd_ctx->owner < 0 ? m_epfd : m_reactors[fd_ctx->owner]->epfd;
+    }
+
+    /**
+     * @brief 触发事件时回调执行的线程 (fd 所属 reactor 的线程)，-1 表示任意线程
+     * @attention 需要持有 fd_ctx->mutex
      */
-    bool stopping(uint64_t& timeout);
+    int ownerThread(FdContext* fd_ctx, Event event);
 private:
     /// epoll 文件句柄
     int m_epfd = 0;
@@ -156,10 +282,32 @@ private:
     int m_tickleFds[2];
     /// 当前等待执行的事件数量
     std::atomic<size_t> m_pendingEventCount = {0};
+    /// 已写入 pipe 但尚未被读走的唤醒数
+    std::atomic<size_t> m_pendingTickles = {0};
+    /// 正在 idle 中自旋的线程数，大于 0 时 tickle 无需写 pipe
+    std::atomic<size_t> m_spinningCount = {0};
+    /// 自旋免去休眠的次数
+    std::atomic<uint64_t> m_spinHits = {0};
+    /// 自旋后仍然休眠的次数
+    std::atomic<uint64_t> m_spinMisses = {0};
+    /// 进程内唯一的编号
+    uint64_t m_id;
     /// IOManager 的 Mutex
     RWMutexType m_mutex;
     /// socket事件上下文数组
     std::vector<FdContext*> m_fdContexts;
+    /// fd 是否持久注册到 epoll
+    bool m_persistentEvents = false;
+    /// io_uring 后端，使用 epoll 后端时为 nullptr
+    IoUring* m_uring = nullptr;
+    /// io_uring 有完成事件时由内核写入，加入 epoll 唤醒空闲线程
+    int m_uringEventFd = -1;
+    /// 多 reactor 模式下的 reactor，下标为工作线程编号减去 caller 线程数，未使用时为空
+    std::vector<Reactor*> m_reactors;
+    /// 轮流分配 fd 的计数
+    std::atomic<uint32_t> m_nextReactor = {0};
+    /// 轮流唤醒 reactor 的计数
+    std::atomic<uint32_t> m_nextWake = {0};
 };
 
 
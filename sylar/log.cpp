@@ -5,6 +5,7 @@
 #include <functional>
 #include <time.h>
 #include <string.h>
+#include <atomic>
 #include "config.h"
 
 namespace sylar{
@@ -166,7 +167,8 @@ class DateTimeFormatItem : public LogFormatter::FormatItem {
 public:
     ///m_format 存储时间格式字符串
     DateTimeFormatItem(const std::string& format = "%Y-%m-%d %H:%M:%S")
-            :m_format(format) {
+            :m_format(format)
+            ,m_id(++s_id) {
         ///如果传入的 format 为空，则设置默认值
         if(m_format.empty()){
             m_format = "%Y-%m-%d %H:%M:%S";
@@ -174,24 +176,45 @@ public:
     }
     /**
      * @brief 输出格式化时间字符串
+     * @details 同一秒内的结果相同，每个线程缓存上一次的结果，省去 localtime_r 和 strftime
      */
     void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        ///创建 tm 结构体 用于存储本地时间
-        struct tm tm;
         /// 从 LogEvent 对象中获取日志事件时间戳
         time_t time = event->getTime();
-        ///将 time_t 转换为本地时间 tm 结构
-        localtime_r(&time, &tm);
-        ///用于存储格式化后的时间字符串
-        char buf[64];
-        ///strftime标准库函数 将 tm 结构按指定的 m_format 格式化为字符串 结果保存在 buf 中
-        strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-        os << buf;
+        if(t_cache.id != m_id || t_cache.time != time) {
+            ///创建 tm 结构体 用于存储本地时间
+            struct tm tm;
+            ///将 time_t 转换为本地时间 tm 结构
+            localtime_r(&time, &tm);
+            ///strftime标准库函数 将 tm 结构按指定的 m_format 格式化为字符串 结果保存在缓存中
+            t_cache.len = strftime(t_cache.buf, sizeof(t_cache.buf), m_format.c_str(), &tm);
+            t_cache.id = m_id;
+            t_cache.time = time;
+        }
+        os.write(t_cache.buf, t_cache.len);
     }
 private:
+    /**
+     * @brief 线程最近一次格式化的结果
+     */
+    struct Cache {
+        /// 格式化它的 DateTimeFormatItem，0 表示无效
+        uint64_t id;
+        time_t time;
+        size_t len;
+        char buf[64];
+    };
+    static thread_local Cache t_cache;
+    /// 用于区分不同的 DateTimeFormatItem (地址可能被复用)
+    static std::atomic<uint64_t> s_id;
+
     std::string m_format;
+    uint64_t m_id;
 };
 
+thread_local DateTimeFormatItem::Cache DateTimeFormatItem::t_cache = {0, 0, 0, {0}};
+std::atomic<uint64_t> DateTimeFormatItem::s_id = {0};
+
 class FileNameFormatItem : public LogFormatter::FormatItem {
 public:
     FileNameFormatItem(const std::string& str = ""){}
@@ -10,6 +10,8 @@
 
 
 #include <stdexcept>
+#include <errno.h>
+#include <time.h>
 #include "mutex.h"
 
 namespace sylar {
@@ -32,6 +34,28 @@ void Semaphore::wait(){
     }
 }
 
+bool Semaphore::waitFor(uint64_t ms) {
+    // sem_timedwait 使用 CLOCK_REALTIME 的绝对时间
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if(ts.tv_nsec >= 1000000000) {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000000000;
+    }
+    while(sem_timedwait(&m_semaphore, &ts)) {
+        if(errno == EINTR) {
+            continue;
+        }
+        if(errno == ETIMEDOUT) {
+            return false;
+        }
+        throw std::logic_error("sem_timedwait error");
+    }
+    return true;
+}
+
 /// 释放信号量
 void Semaphore::notify(){
     if(sem_post(&m_semaphore)){
@@ -50,6 +50,13 @@ public:
      */
     void wait();
 
+    /**
+     * @brief 在指定时间内获取信号量
+     * @param ms 超时时间 (毫秒)
+     * @return 超时返回 false
+     */
+    bool waitFor(uint64_t ms);
+
     /**
      * @brief 释放信号量
      */
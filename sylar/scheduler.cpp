@@ -9,19 +9,207 @@
   */
 
 
+#include <algorithm>
+
 #include "scheduler.h"
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "config.h"
 
 namespace sylar {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+static sylar::ConfigVar<uint32_t>::ptr g_scheduler_starvation_limit =
+        sylar::Config::Lookup<uint32_t>("scheduler.starvation_limit", 8
+                , "low priority task runs once after being skipped this many times");
+
+static sylar::ConfigVar<std::map<std::string, std::vector<int> > >::ptr g_scheduler_cpus =
+        sylar::Config::Lookup("scheduler.cpus", std::map<std::string, std::vector<int> >()
+                , "worker thread cpu affinity, scheduler name -> cpu list");
+
+static sylar::ConfigVar<std::map<std::string, uint32_t> >::ptr g_scheduler_max_threads =
+        sylar::Config::Lookup("scheduler.max_threads", std::map<std::string, uint32_t>()
+                , "elastic pool upper bound by scheduler name, same meaning as ctor threads");
+
+static sylar::ConfigVar<uint32_t>::ptr g_scheduler_grow_latency_us =
+        sylar::Config::Lookup<uint32_t>("scheduler.grow_latency_us", 2000
+                , "add a worker when average queue wait exceeds this (elastic pool only)");
+
+static sylar::ConfigVar<uint32_t>::ptr g_scheduler_grow_interval_ms =
+        sylar::Config::Lookup<uint32_t>("scheduler.grow_interval_ms", 1000
+                , "min interval between two worker additions");
+
+static sylar::ConfigVar<uint32_t>::ptr g_scheduler_retire_idle_ms =
+        sylar::Config::Lookup<uint32_t>("scheduler.retire_idle_ms", 60 * 1000
+                , "a worker idle this long exits (elastic pool only)");
+
+static sylar::ConfigVar<uint32_t>::ptr g_scheduler_watchdog_ms =
+        sylar::Config::Lookup<uint32_t>("scheduler.watchdog_ms", 0
+                , "log the stack of a fiber running longer than this without yielding, 0 disables");
+
+static sylar::ConfigVar<bool>::ptr g_scheduler_shared_stack =
+        sylar::Config::Lookup<bool>("scheduler.shared_stack", false
+                , "callback fibers run on a per-thread shared stack, parked fibers keep a copy of the used part");
+
+/// 调度热路径上读取，避免每次取任务都加配置锁
+static uint32_t s_starvation_limit = 8;
+static bool s_shared_stack = false;
+static uint32_t s_grow_latency_us = 2000;
+static uint32_t s_grow_interval_ms = 1000;
+static uint32_t s_retire_idle_ms = 60 * 1000;
+struct _SchedulerIniter {
+    _SchedulerIniter() {
+        s_starvation_limit = std::max(g_scheduler_starvation_limit->getValue(), 1u);
+        s_grow_latency_us = g_scheduler_grow_latency_us->getValue();
+        s_grow_interval_ms = g_scheduler_grow_interval_ms->getValue();
+        s_retire_idle_ms = g_scheduler_retire_idle_ms->getValue();
+        s_shared_stack = g_scheduler_shared_stack->getValue();
+
+        g_scheduler_shared_stack->addListener([](const bool& old_value, const bool& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "scheduler shared stack changed from "
+                                     << old_value << " to " << new_value;
+            s_shared_stack = new_value;
+        });
+
+        g_scheduler_grow_latency_us->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "scheduler grow latency changed from "
+                                     << old_value << " to " << new_value;
+            s_grow_latency_us = new_value;
+        });
+        g_scheduler_grow_interval_ms->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "scheduler grow interval changed from "
+                                     << old_value << " to " << new_value;
+            s_grow_interval_ms = new_value;
+        });
+        g_scheduler_retire_idle_ms->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "scheduler retire idle changed from "
+                                     << old_value << " to " << new_value;
+            s_retire_idle_ms = new_value;
+        });
+
+        g_scheduler_starvation_limit->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "scheduler starvation limit changed from "
+                                     << old_value << " to " << new_value;
+            s_starvation_limit = std::max(new_value, 1u);
+        });
+    }
+};
+static _SchedulerIniter s_scheduler_initer;
+
 /// 线程局部变量 指向当前线程的调度器对象，同一个调度器下的所有线程共享一个调度器
 static thread_local Scheduler* t_scheduler = nullptr;
 /// 线程局部变量 当前线程的调度协程，每个线程都独有一份，包括caller线程
 static thread_local Fiber* t_scheduler_fiber = nullptr;
+/// 线程局部变量 当前线程在所属调度器中的工作线程编号 (本地队列下标)
+static thread_local int t_worker_id = -1;
+
+namespace {
+
+/**
+ * @brief 空闲的任务节点
+ */
+struct FreeNode {
+    FreeNode* next;
+};
+
+/// 线程缓存的空闲节点上限，超过时归还一半到全局池
+static const size_t s_node_cache_max = 1024;
+/// 线程缓存为空时一次从全局池取走的节点数
+static const size_t s_node_cache_batch = 64;
+
+/**
+ * @brief 全局空闲节点池
+ * @details 线程缓存不足或过多时批量存取，单个节点的分配释放不经过这里
+ */
+struct NodePool {
+    Spinlock mutex;
+    FreeNode* head = nullptr;
+    size_t count = 0;
+};
+
+static NodePool& GetNodePool() {
+    static NodePool* s_pool = new NodePool;
+    return *s_pool;
+}
+
+/**
+ * @brief 线程本地的空闲节点缓存
+ * @details 节点可以在一个线程分配、在另一个线程释放，
+ *          释放的节点进入释放线程的缓存，线程退出时全部归还到全局池
+ */
+struct NodeCache {
+    FreeNode* head = nullptr;
+    size_t count = 0;
+
+    /**
+     * @brief 从链表头取出 n 个节点归还到全局池
+     */
+    void release(size_t n) {
+        if(!n) {
+            return;
+        }
+        FreeNode* first = head;
+        FreeNode* last = head;
+        for(size_t i = 1; i < n; ++i) {
+            last = last->next;
+        }
+        head = last->next;
+        count -= n;
+
+        NodePool& pool = GetNodePool();
+        Spinlock::Lock lock(pool.mutex);
+        last->next = pool.head;
+        pool.head = first;
+        pool.count += n;
+    }
+
+    ~NodeCache() {
+        release(count);
+    }
+};
+
+static thread_local NodeCache t_node_cache;
+
+}
+
+void* Scheduler::TaskNode::operator new(size_t size) {
+    SYLAR_ASSERT(size == sizeof(TaskNode));
+    NodeCache& cache = t_node_cache;
+    if(!cache.head) {
+        NodePool& pool = GetNodePool();
+        Spinlock::Lock lock(pool.mutex);
+        for(size_t i = 0; i < s_node_cache_batch && pool.head; ++i) {
+            FreeNode* node = pool.head;
+            pool.head = node->next;
+            --pool.count;
+            node->next = cache.head;
+            cache.head = node;
+            ++cache.count;
+        }
+    }
+    if(!cache.head) {
+        return ::operator new(size);
+    }
+    FreeNode* node = cache.head;
+    cache.head = node->next;
+    --cache.count;
+    return node;
+}
+
+void Scheduler::TaskNode::operator delete(void* ptr) {
+    if(!ptr) {
+        return;
+    }
+    NodeCache& cache = t_node_cache;
+    FreeNode* node = static_cast<FreeNode*>(ptr);
+    node->next = cache.head;
+    cache.head = node;
+    if(++cache.count > s_node_cache_max) {
+        cache.release(cache.count / 2);
+    }
+}
 
 /*
  * use_caller = true  在主线程上创建调度协程，其中main主线程上有 1.main的主协程，2.调度协程，3.任务子协程
@@ -49,12 +237,36 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
         t_scheduler_fiber = m_rootFiber.get();  // 设置当前协程调度协程
         m_rootThread = sylar::GetThreadId();    // 获取当前线程的ID
         m_threadIds.push_back(m_rootThread);    // 保存线程ID（根线程）
+        t_worker_id = 0;                        // caller 线程使用 0 号本地队列
 
     } else { // use_caller == false
         // 没有主协程的情况，rootThread设置为-1
         m_rootThread = -1; // 未指定主调度线程
     }
     m_threadCount = threads;
+    m_minThreads = threads;
+    m_maxThreads = threads;
+    // 配置了 scheduler.max_threads 时线程数在 [threads, max_threads] 之间弹性伸缩
+    auto max_conf = g_scheduler_max_threads->getValue();
+    auto it = max_conf.find(m_name);
+    if(it != max_conf.end() && it->second > threads + (use_caller ? 1 : 0)) {
+        m_maxThreads = it->second - (use_caller ? 1 : 0);
+    }
+
+    // 每个工作线程 (包括 caller 线程) 一个本地队列，按上限预留
+    // 新线程的队列在线程内绑核后再分配 (见 start)，保证内存分配在该线程所在的 NUMA 节点
+    std::vector<std::atomic<WorkQueue*> > queues(m_maxThreads + (use_caller ? 1 : 0));
+    m_workQueues.swap(queues);
+    if(use_caller) {
+        WorkQueue* queue = new WorkQueue;
+        queue->threadId = m_rootThread;
+        queue->pthread = pthread_self();
+        queue->cpu = GetCurrentCpu(&queue->node);
+        m_workQueues[0] = queue;
+    }
+    for(auto& i : m_queueDepth) {
+        i = 0;
+    }
 }
 
 
@@ -63,6 +275,25 @@ Scheduler::~Scheduler(){
     SYLAR_ASSERT(m_stopping);
     if(GetThis() == this){
         t_scheduler = nullptr; // 清空全局线程局部变量 t_scheduler
+        t_worker_id = -1;
+    }
+    // 释放各队列中残留的节点
+    TaskList rest = TakeInbox(m_inbox);
+    for(auto& i : m_workQueues) {
+        WorkQueue* queue = i;
+        if(!queue) {
+            continue;
+        }
+        TaskList mailbox = TakeInbox(queue->mailbox);
+        rest.splice(mailbox);
+        rest.splice(queue->pinned);
+        for(auto& tasks : queue->tasks) {
+            rest.splice(tasks);
+        }
+        delete queue;
+    }
+    while(TaskNode* node = rest.pop_front()) {
+        delete node;
     }
 }
 
@@ -76,6 +307,84 @@ Fiber* Scheduler::GetMainFiber() {
     return t_scheduler_fiber;
 }
 
+int Scheduler::GetWorkerId() {
+    return t_worker_id;
+}
+
+const char* Scheduler::PriorityToString(Priority prio) {
+    switch(prio) {
+#define XX(name) \
+        case name: \
+            return #name;
+        XX(HIGH);
+        XX(NORMAL);
+        XX(BACKGROUND);
+#undef XX
+        default:
+            return "UNKNOWN";
+    }
+}
+
+uint64_t Scheduler::getQueueLatency() const {
+    uint64_t total = 0;
+    size_t count = 0;
+    for(auto& i : m_workQueues) {
+        WorkQueue* queue = i;
+        if(queue && !queue->retired) {
+            total += queue->latency.load(std::memory_order_relaxed);
+            ++count;
+        }
+    }
+    return count ? total / count : 0;
+}
+
+std::ostream& Scheduler::dump(std::ostream& os) {
+    os << "[Scheduler name=" << m_name
+       << " size=" << m_threadCount
+       << " min=" << m_minThreads
+       << " max=" << m_maxThreads
+       << " active_count=" << m_activeThreadCount
+       << " idle_count=" << m_idleThreadCount
+       << " stopping=" << m_stopping
+       << " task_count=" << m_taskCount
+       << " queue_latency=" << getQueueLatency() << "us"
+       << " ]" << std::endl;
+    for(int i = 0; i < PRIORITY_COUNT; ++i) {
+        os << "    queue." << PriorityToString((Priority)i)
+           << "=" << m_queueDepth[i] << std::endl;
+    }
+    for(size_t i = 0; i < m_workQueues.size(); ++i) {
+        WorkQueue* queue = m_workQueues[i];
+        if(!queue || queue->retired) {
+            continue;
+        }
+        os << "    worker[" << i << "] thread=" << queue->threadId
+           << " affinity=" << queue->pinnedCpu
+           << " cpu=" << queue->cpu
+           << " node=" << queue->node
+           << " latency=" << queue->latency << "us" << std::endl;
+    }
+    return os;
+}
+
+Scheduler::WorkQueue* Scheduler::getLocalQueue() {
+    if(t_scheduler != this || t_worker_id < 0) {
+        return nullptr;
+    }
+    return m_workQueues[t_worker_id];
+}
+
+Scheduler::WorkQueue* Scheduler::getWorkQueue(int thread) {
+    // 工作线程数量很少且 m_workQueues 构造后不再变化，直接无锁遍历
+    for(auto& i : m_workQueues) {
+        WorkQueue* queue = i;
+        if(queue && queue->threadId == thread) {
+            return queue;
+        }
+    }
+    return nullptr;
+}
+
 /**
  * @brief 启动调度
  * @details 初始化调度线程池，如果只使用caller线程进行调度，那这个方法啥也不做
@@ -89,17 +398,188 @@ void Scheduler::start() {
     m_stopping = false;
     SYLAR_ASSERT(m_threads.empty());
 
-    // 创建调度线程池
-    m_threads.resize(m_threadCount);
+    // 创建调度线程池，按预留的本地队列数留出位置，弹性增加的线程放在空位上
+    m_threads.resize(m_workQueues.size() - (m_rootThread == -1 ? 0 : 1));
+    // 配置了 scheduler.cpus 时新线程依次绑定到列表中的 CPU (caller 线程不绑定)
+    m_cpus.clear();
+    auto cpus_conf = g_scheduler_cpus->getValue();
+    auto it = cpus_conf.find(m_name);
+    if(it != cpus_conf.end()) {
+        m_cpus = it->second;
+    }
+
     // 根据线程池大小 为每个线程创建一个新线程，执行调度器的 run 方法
     for(size_t i = 0; i < m_threadCount; ++i){
-        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this)
-                            , m_name + "_" + std::to_string(i)));
-        m_threadIds.push_back(m_threads[i]->getId()); // 记录线程 id
+        spawnWorker(i);
+    }
+    // 配置了运行时间上限时启动看门狗线程
+    if(g_scheduler_watchdog_ms->getValue()) {
+        m_watchdog.reset(new Thread(std::bind(&Scheduler::watchdog, this), m_name + "_watchdog"));
     }
     lock.unlock();
 }
 
+void Scheduler::setThreadRange(size_t min_threads, size_t max_threads) {
+    MutexType::Lock lock(m_mutex);
+    size_t callers = m_rootThread == -1 ? 0 : 1;
+    // 上限不能超过构造时预留的本地队列数
+    size_t capacity = m_workQueues.size() - callers;
+    SYLAR_ASSERT(min_threads > callers && min_threads <= max_threads);
+    m_minThreads = std::min(min_threads - callers, capacity);
+    m_maxThreads = std::min(max_threads - callers, capacity);
+    SYLAR_LOG_INFO(g_logger) << m_name << " thread range [" << m_minThreads
+                             << ", " << m_maxThreads << "]";
+    if(m_stopping) {
+        m_threadCount = std::min(std::max((size_t)m_threadCount, m_minThreads), m_maxThreads);
+        return;
+    }
+    // 运行中提高下限时立即补足线程；超过上限的线程空闲后自行退出
+    while(m_threadCount < m_minThreads && spawnFreeSlot()) {
+    }
+}
+
+/// 创建工作线程
+void Scheduler::spawnWorker(size_t index) {
+    // caller 线程占用 0 号本地队列，新线程的队列编号依次往后排
+    int worker_id = index + (m_rootThread == -1 ? 0 : 1);
+    int cpu = m_cpus.empty() ? -1 : m_cpus[index % m_cpus.size()];
+    Semaphore ready;
+    m_threads[index].reset(new Thread([this, worker_id, cpu, &ready](){
+                            t_worker_id = worker_id;
+                            setupWorker(worker_id, cpu);
+                            ready.notify();
+                            run();
+                        }, m_name + "_" + std::to_string(index)));
+    // 等待本地队列就绪，返回后该工作线程就可以被投递任务
+    ready.wait();
+    m_threadIds.push_back(m_threads[index]->getId()); // 记录线程 id
+}
+
+/// 排队延迟过高，增加工作线程
+void Scheduler::grow() {
+    uint64_t now = GetMonotonicMS();
+    uint64_t last = m_lastGrow;
+    if(now - last < s_grow_interval_ms
+            || !m_lastGrow.compare_exchange_strong(last, now)) {
+        return;
+    }
+    MutexType::Lock lock(m_mutex);
+    if(m_stopping.load(std::memory_order_acquire) || m_threadCount >= m_maxThreads) {
+        return;
+    }
+    if(spawnFreeSlot()) {
+        SYLAR_LOG_INFO(g_logger) << m_name << " grow to " << m_threadCount
+                                 << " threads, queue latency=" << getQueueLatency() << "us";
+    }
+}
+
+/// 在空位上创建工作线程
+bool Scheduler::spawnFreeSlot() {
+    // 找一个从未使用或线程已经退出的位置
+    size_t first_worker = m_rootThread == -1 ? 0 : 1;
+    for(size_t i = 0; i < m_threads.size(); ++i) {
+        WorkQueue* queue = m_workQueues[first_worker + i];
+        if(m_threads[i] && !(queue && queue->retired)) {
+            continue;
+        }
+        if(m_threads[i]) {
+            // 已退出的线程在 retireWorker 之后不再访问调度器，立即可以回收
+            m_threads[i]->join();
+        }
+        ++m_threadCount;
+        spawnWorker(i);
+        return true;
+    }
+    return false;
+}
+
+/// 空闲过久时退出当前工作线程
+bool Scheduler::tryRetire(WorkQueue* local) {
+    // caller 线程不退出；正在停止时由 stop 统一回收
+    // 共享栈上还有挂起的协程时不退出，它们只能在本线程恢复
+    if(m_stopping.load(std::memory_order_acquire) || local->retiring || m_threadCount <= m_minThreads
+            || (m_rootThread != -1 && t_worker_id == 0)
+            || Fiber::SharedStackFibers() > 0) {
+        return false;
+    }
+    // 超过上限 (上限被调低) 时不必等待空闲超时
+    uint64_t now = GetMonotonicUS();
+    if(m_threadCount <= m_maxThreads
+            && now - local->lastBusy < s_retire_idle_ms * 1000ull) {
+        return false;
+    }
+    size_t count = m_threadCount;
+    do {
+        if(count <= m_minThreads) {
+            return false;
+        }
+    } while(!m_threadCount.compare_exchange_weak(count, count - 1));
+    local->retiring = true;
+    SYLAR_LOG_INFO(g_logger) << m_name << " retire idle worker " << t_worker_id
+                             << ", " << m_threadCount << " threads left";
+    return true;
+}
+
+/// 退出的工作线程转交残留任务
+void Scheduler::retireWorker(WorkQueue* local) {
+    {
+        MutexType::Lock lock(m_mutex);
+        auto it = std::find(m_threadIds.begin(), m_threadIds.end(), (int)local->threadId);
+        if(it != m_threadIds.end()) {
+            m_threadIds.erase(it);
+        }
+    }
+    // 先标记退出再取 mailbox：之后迟到的指定线程任务由 tickleWorker 唤醒其他线程从 steal 中取走
+    local->threadId = -1;
+    local->retired = true;
+
+    TaskList rest = TakeInbox(local->mailbox);
+    rest.splice(local->pinned);
+    // 指定的线程已经不存在，改为任意线程执行
+    for(TaskNode* node = rest.head; node; node = node->next) {
+        node->task.thread = -1;
+        ++m_queueDepth[node->task.prio];
+    }
+    {
+        WorkQueue::MutexType::Lock lock(local->mutex);
+        for(auto& tasks : local->tasks) {
+            rest.splice(tasks);
+        }
+    }
+    if(rest.empty()) {
+        return;
+    }
+    // 先加入收件箱再扣减计数，stopping() 不会看到任务数短暂为 0
+    size_t count = rest.size;
+    pushInbox(rest);
+    m_taskCount -= count;
+    tickle();
+}
+
+
+/// 在工作线程内绑核并分配本地队列
+void Scheduler::setupWorker(int worker_id, int cpu) {
+    if(cpu >= 0) {
+        Thread::SetAffinity(cpu);
+    }
+    // 绑核后再分配，glibc 的线程 arena 按首次访问把页面放在本地 NUMA 节点
+    // 之后本线程创建的 idle 协程、回调协程的栈同样是本地分配
+    WorkQueue* queue = m_workQueues[worker_id].load(std::memory_order_acquire);
+    if(!queue) {
+        queue = new WorkQueue;
+    }
+    queue->pthread = pthread_self();
+    queue->cpu = GetCurrentCpu(&queue->node);
+    queue->pinnedCpu = cpu;
+    queue->retiring = false;
+    queue->lastBusy = GetMonotonicUS();
+    queue->latency = 0;
+    // 复用退出线程的队列: 先清除退出标记再公布线程 id
+    // 之后指定到本线程的任务不会被 steal 当作迟到任务改成任意线程执行
+    queue->retired.store(false, std::memory_order_release);
+    queue->threadId.store(GetThreadId(), std::memory_order_release);
+    m_workQueues[worker_id].store(queue, std::memory_order_release);
+}
 
 void Scheduler::stop(){
     // 设置自动停止标志，表示调度器会在适当的时候停止
@@ -127,9 +607,7 @@ void Scheduler::stop(){
     m_stopping = true;  // 设置调度器正在停止
 
     // 唤醒所有调度的线程
-    for(size_t i = 0; i < m_threadCount; ++i){
-        tickle();
-    }
+    tickleAll();
 
     if(m_rootFiber){
         tickle();
@@ -150,7 +628,15 @@ void Scheduler::stop(){
     }
 
     for(auto& i : thrs){
-        i->join(); // 等待所有线程退出
+        if(i) {
+            i->join(); // 等待所有线程退出
+        }
+    }
+
+    if(m_watchdog) {
+        m_watchdogSem.notify();
+        m_watchdog->join();
+        m_watchdog.reset();
     }
 }
 
@@ -158,6 +644,331 @@ void Scheduler::setThis() {
     t_scheduler = this;
 }
 
+/// 从本地队列队头取任务
+bool Scheduler::popLocal(WorkQueue* local, FiberAndThread& ft, bool& tickle_me) {
+    TaskNode* node = nullptr;
+    {
+        WorkQueue::MutexType::Lock lock(local->mutex);
+        int picked = local->pick(s_starvation_limit);
+        if(picked < 0) {
+            return false;
+        }
+        // 先取选中的优先级，其中的协程都还在执行时再按优先级依次尝试其他队列
+        for(int i = -1; i < PRIORITY_COUNT && !node; ++i) {
+            if(i == picked) {
+                continue;
+            }
+            TaskList& tasks = local->tasks[i < 0 ? picked : i];
+            // 最多轮转一遍队列，跳过仍在其他线程上执行的协程
+            for(size_t n = tasks.size; n > 0; --n) {
+                TaskNode* front = tasks.pop_front();
+                SYLAR_ASSERT(front->task.fiber || front->task.cb);
+                if(front->task.fiber && front->task.fiber->getState() == Fiber::EXEC) {
+                    tasks.push_back(front);
+                    tickle_me = true;
+                    continue;
+                }
+                node = front;
+                break;
+            }
+        }
+        if(!node) {
+            return false;
+        }
+        --m_taskCount;
+        --m_queueDepth[node->task.prio];
+        // 队列中还有任务，唤醒空闲线程来窃取
+        tickle_me |= !local->empty();
+    }
+    ft = std::move(node->task);
+    delete node;
+    return true;
+}
+
+/// 无锁压入收件箱
+bool Scheduler::pushInbox(std::atomic<TaskNode*>& inbox, TaskNode* first
+                          , TaskNode* last, size_t count) {
+    // 先计数再入队，保证 stopping() 不会在任务可见前判定为空
+    m_taskCount += count;
+    TaskNode* head = inbox.load(std::memory_order_relaxed);
+    do {
+        last->next = head;
+    } while(!inbox.compare_exchange_weak(head, first));
+    // 只有收件箱由空变为非空时才需要唤醒，突发提交只产生一次唤醒
+    return head == nullptr;
+}
+
+/// 取走收件箱中的全部节点
+Scheduler::TaskList Scheduler::TakeInbox(std::atomic<TaskNode*>& inbox) {
+    TaskList list;
+    if(!inbox.load(std::memory_order_relaxed)) {
+        return list;
+    }
+    TaskNode* head = inbox.exchange(nullptr, std::memory_order_acquire);
+    // 收件箱是后进先出的，反转为提交顺序
+    list.tail = head;
+    while(head) {
+        TaskNode* next = head->next;
+        head->next = list.head;
+        list.head = head;
+        ++list.size;
+        head = next;
+    }
+    return list;
+}
+
+/// 投递单个任务
+void Scheduler::scheduleNode(TaskNode* node) {
+    node->task.enqueueTime = GetMonotonicUS();
+    if(node->task.thread == -1 && node->task.fiber) {
+        // 共享栈协程只能回到原线程恢复，通过 mailbox 投递
+        node->task.thread = node->task.fiber->getOwnerThread();
+    }
+    if(node->task.thread == -1) {
+        WorkQueue* local = getLocalQueue();
+        if(local) {
+            bool need_tickle = false;
+            {
+                // 本地队列只有所属线程和窃取线程竞争，不经过全局锁
+                WorkQueue::MutexType::Lock lock(local->mutex);
+                // 队列为空，唤醒调度器；队列不为空，已有任务，无需立即唤醒
+                need_tickle = local->empty();
+                ++m_queueDepth[node->task.prio];
+                local->tasks[node->task.prio].push_back(node);
+                ++m_taskCount;
+            }
+            if(need_tickle) {
+                tickle();
+            }
+            return;
+        }
+    } else {
+        WorkQueue* worker = getWorkQueue(node->task.thread);
+        if(worker) {
+            // 直接投递到目标线程，不经过任何共享队列
+            if(pushInbox(worker->mailbox, node, node, 1)) {
+                tickleWorker(worker);
+            }
+            return;
+        }
+        SYLAR_LOG_WARN(g_logger) << m_name << " schedule to unknown thread="
+                                 << node->task.thread << ", run on any thread";
+        node->task.thread = -1;
+    }
+    ++m_queueDepth[node->task.prio];
+    if(pushInbox(m_inbox, node, node, 1)) {
+        tickle();
+    }
+}
+
+/// 批量投递任务
+void Scheduler::scheduleList(TaskList& list) {
+    if(list.empty()) {
+        return;
+    }
+    bool need_tickle = false;
+    Priority prio = list.head->task.prio;
+    uint64_t now = GetMonotonicUS();
+    // 绑定了线程的共享栈协程单独投递到所属线程
+    TaskList rest;
+    while(TaskNode* node = list.pop_front()) {
+        if(node->task.fiber && node->task.fiber->getOwnerThread() != -1) {
+            scheduleNode(node);
+            continue;
+        }
+        node->task.enqueueTime = now;
+        rest.push_back(node);
+    }
+    list.splice(rest);
+    if(list.empty()) {
+        return;
+    }
+    m_queueDepth[prio] += list.size;
+    WorkQueue* local = getLocalQueue();
+    if(local) {
+        size_t count = list.size;
+        WorkQueue::MutexType::Lock lock(local->mutex);
+        need_tickle = local->empty();
+        local->tasks[prio].splice(list);
+        m_taskCount += count;
+    } else {
+        need_tickle = pushInbox(list);
+    }
+    if(need_tickle) {
+        tickle();
+    }
+}
+
+/// 一组节点挂入收件箱
+bool Scheduler::pushInbox(TaskList& list) {
+    // 收件箱是后进先出的栈，先把链表反转为新任务在前，再一次性挂入
+    TaskNode* first = nullptr;
+    TaskNode* last = list.head;
+    size_t count = list.size;
+    while(TaskNode* node = list.pop_front()) {
+        node->next = first;
+        first = node;
+    }
+    return pushInbox(m_inbox, first, last, count);
+}
+
+/// 唤醒指定工作线程
+void Scheduler::tickleWorker(WorkQueue* worker) {
+    // 目标线程已退出，唤醒任意线程从 steal 中取走
+    if(worker->retired) {
+        tickle();
+        return;
+    }
+    // 目标线程忙碌时会在下次取任务时看到 mailbox，无需唤醒
+    if(!worker->idle) {
+        return;
+    }
+    tickleThread(worker->threadId);
+}
+
+/// 批量取走收件箱
+bool Scheduler::popInbox(WorkQueue* local, FiberAndThread& ft, bool& tickle_me) {
+    TaskList list = TakeInbox(m_inbox);
+    if(list.empty()) {
+        return false;
+    }
+    {
+        // 按优先级分发到本地队列
+        WorkQueue::MutexType::Lock lock(local->mutex);
+        while(TaskNode* node = list.pop_front()) {
+            local->tasks[node->task.prio].push_back(node);
+        }
+    }
+    return popLocal(local, ft, tickle_me);
+}
+
+/// 取本线程的指定任务
+bool Scheduler::popPinned(WorkQueue* local, FiberAndThread& ft, bool& tickle_me) {
+    if(local->pinned.empty()) {
+        TaskList list = TakeInbox(local->mailbox);
+        local->pinned.splice(list);
+    }
+    // 只有本线程访问 pinned，无需加锁；最多轮转一遍，跳过仍在执行中的协程
+    for(size_t n = local->pinned.size; n > 0; --n) {
+        TaskNode* node = local->pinned.pop_front();
+        if(node->task.fiber && node->task.fiber->getState() == Fiber::EXEC) {
+            local->pinned.push_back(node);
+            continue;
+        }
+        ft = std::move(node->task);
+        delete node;
+        --m_taskCount;
+        return true;
+    }
+    return false;
+}
+
+/// 单次窃取的任务数上限，限制持有 victim 锁的时间
+static const size_t MAX_STEAL = 64;
+
+/// 从其他线程的本地队列窃取任务
+bool Scheduler::steal(WorkQueue* local, FiberAndThread& ft, bool& tickle_me) {
+    size_t count = m_workQueues.size();
+    if(count <= 1 || m_taskCount == 0) {
+        return false;
+    }
+    size_t self = t_worker_id;
+    TaskList stolen;
+    bool adopted = false;
+    for(size_t i = 1; i < count; ++i) {
+        WorkQueue* victim = m_workQueues[(self + i) % count].load(std::memory_order_acquire);
+        if(!victim) {
+            continue;
+        }
+        if(victim->retired.load(std::memory_order_acquire)) {
+            // 线程退出后才到达的指定线程任务，改为任意线程执行
+            TaskList late = TakeInbox(victim->mailbox);
+            if(late.empty()) {
+                continue;
+            }
+            TaskList back;
+            if(!victim->retired.load(std::memory_order_acquire)) {
+                // 取走的同时队列被新线程复用，指定给新线程的任务放回 mailbox
+                int thread = victim->threadId.load(std::memory_order_acquire);
+                for(size_t n = late.size; n > 0; --n) {
+                    TaskNode* node = late.pop_front();
+                    if(thread != -1 && node->task.thread == thread) {
+                        back.push_back(node);
+                    } else {
+                        late.push_back(node);
+                    }
+                }
+            }
+            if(!late.empty()) {
+                WorkQueue::MutexType::Lock lock(local->mutex);
+                while(TaskNode* node = late.pop_front()) {
+                    node->task.thread = -1;
+                    ++m_queueDepth[node->task.prio];
+                    local->tasks[node->task.prio].push_back(node);
+                }
+                adopted = true;
+            }
+            if(!back.empty()) {
+                // 任务仍在 m_taskCount 中，不经 pushInbox 重复计数; 反转为新任务在前再挂入
+                TaskNode* first = nullptr;
+                TaskNode* last = back.head;
+                while(TaskNode* node = back.pop_front()) {
+                    node->next = first;
+                    first = node;
+                }
+                TaskNode* head = victim->mailbox.load(std::memory_order_relaxed);
+                do {
+                    last->next = head;
+                } while(!victim->mailbox.compare_exchange_weak(head, first));
+                tickleWorker(victim);
+            }
+            continue;
+        }
+        {
+            WorkQueue::MutexType::Lock lock(victim->mutex);
+            for(auto& tasks : victim->tasks) {
+                if(tasks.empty()) {
+                    continue;
+                }
+                // 窃取最高优先级队列的一半 (向上取整)，单链表只能从队头摘取
+                size_t n = std::min((tasks.size + 1) / 2, MAX_STEAL);
+                for(size_t j = 0; j < n; ++j) {
+                    stolen.push_back(tasks.pop_front());
+                }
+                break;
+            }
+            tickle_me |= !victim->empty();
+        }
+        if(!stolen.empty()) {
+            break;
+        }
+    }
+    if(stolen.empty()) {
+        return adopted && popLocal(local, ft, tickle_me);
+    }
+
+    // 最早入队的任务取出执行，其余按原顺序放入本地队列
+    TaskNode* node = stolen.pop_front();
+    Priority prio = node->task.prio;
+    if(!stolen.empty()) {
+        WorkQueue::MutexType::Lock lock(local->mutex);
+        local->tasks[prio].splice(stolen);
+        tickle_me = true;
+    }
+    if(node->task.fiber && node->task.fiber->getState() == Fiber::EXEC) {
+        // 协程还在其他线程上执行，放回本地队列稍后再试
+        WorkQueue::MutexType::Lock lock(local->mutex);
+        local->tasks[prio].push_back(node);
+        tickle_me = true;
+        return false;
+    }
+    --m_taskCount;
+    --m_queueDepth[prio];
+    ft = std::move(node->task);
+    delete node;
+    return true;
+}
+
 /**
  * @brief 调度方法
  * @attention 每个调度线程的入口函数 主要任务是从协程队列中选择待执行的协程（或回调），并执行它们
@@ -168,6 +979,7 @@ void Scheduler::run(){
     set_hook_enable(true);
     // 设置当前调度器为全局调度器
     setThis();
+    onThreadStart();
     // 如果当前线程不是根线程，则将 t_scheduler_fiber 设置为当前协程
     if(sylar::GetThreadId() != m_rootThread) {
         t_scheduler_fiber = Fiber::GetThis().get();
@@ -179,40 +991,39 @@ void Scheduler::run(){
 
     // 存储当前调度的协程和线程信息
     FiberAndThread ft;
+    // 当前线程的本地队列
+    WorkQueue* local = getLocalQueue();
+    SYLAR_ASSERT(local);
+    // 取任务计数，每隔一段先检查收件箱，避免本地任务持续不断时收件箱饿死
+    uint32_t pick_tick = 0;
+    // 本次任务开始执行的时间 (微秒)
+    uint64_t run_begin = 0;
 
     // 不停地从任务队列取任务并执行
     while(true) {
         ft.reset();  // 重置协程和线程信息
+        poll();
         bool tickle_me = false;  // 标记是否需要唤醒
         bool is_active = false;  // 标记是否有活跃协程
-        {
-            MutexType::Lock lock(m_mutex);
-            // 遍历所有待调度任务队列 寻找一个待执行的协程
-            auto it = m_fibers.begin();
-            while(it != m_fibers.end()){
-                // 检查线程是否匹配，如果不匹配则跳过
-                if(it->thread != -1 && it->thread != sylar::GetThreadId()) {
-                    ++it;
-                    tickle_me = true;
-                    continue;
-                }
-
-                // 如果协程的状态是执行中，跳过当前协程
-                SYLAR_ASSERT(it->fiber || it->cb);
-                if(it->fiber && it->fiber->getState() == Fiber::EXEC) {
-                    ++it;
-                    continue;
-                }
-
-                // 找到一个可执行的协程
-                ft = *it;
-                m_fibers.erase(it++);  // 从队列中移除
-                ++m_activeThreadCount;  // 活跃线程数加 1
-                is_active = true;
-                break;
-            }
-            // 如果队列中有其他协程，则设置为需要唤醒
-            tickle_me |= it != m_fibers.end();  // < |= > 位或赋值操作符
+        // 先计入活跃线程再从队列取出任务，保证 stopping() 不会看到任务"凭空消失"
+        ++m_activeThreadCount;
+        if(++pick_tick % 61 == 0) {
+            is_active = popInbox(local, ft, tickle_me)
+                    || popPinned(local, ft, tickle_me)
+                    || popLocal(local, ft, tickle_me);
+        } else {
+            is_active = popPinned(local, ft, tickle_me)
+                    || popLocal(local, ft, tickle_me)
+                    || popInbox(local, ft, tickle_me);
+        }
+        if(!is_active) {
+            // 本地和全局都没有任务，去其他线程窃取
+            is_active = steal(local, ft, tickle_me);
+        }
+        if(!is_active) {
+            --m_activeThreadCount;
+        } else {
+            run_begin = onTaskPicked(local, ft);
         }
         if(tickle_me) {
             tickle();
@@ -221,40 +1032,58 @@ void Scheduler::run(){
         // 有效协程
         if(ft.fiber && (ft.fiber->getState() != Fiber::TERM
                     && ft.fiber->getState() != Fiber::EXCEPT)) {
+            local->runFiber.store(ft.fiber->getId(), std::memory_order_relaxed);
+            local->runBegin.store(run_begin, std::memory_order_relaxed);
             ft.fiber->swapIn();  // 执行协程
             --m_activeThreadCount; // 活跃线程数 -1
+            recordRun(local, run_begin);
 
             // 如果协程的状态为 READY，则重新调度它
             if(ft.fiber->getState() == Fiber::READY){
-                schedule(ft.fiber);
+                schedule(std::move(ft.fiber), -1, ft.prio);
             } else if(ft.fiber->getState() != Fiber::TERM
                    && ft.fiber->getState() != Fiber::EXCEPT){
-                ft.fiber->m_state = Fiber::HOLD;  // 将协程状态设置为 HOLD，保持在队列中
+                // 将协程状态设置为 HOLD，保持在队列中
+                // release: 切出时保存的上下文先于 HOLD 对取到该协程的其他线程可见
+                ft.fiber->m_state.store(Fiber::HOLD, std::memory_order_release);
             }
             ft.reset();
         }
         // 如果回调函数有效
         else if (ft.cb){
+            // 按入口的栈用量选择栈大小，已有协程的栈大小不同时不复用
+            uint32_t stack_size = 0;
+            if(!s_shared_stack) {
+                stack_size = Fiber::StackSizeFor(ft.cb);
+                if(cb_fiber && cb_fiber->getStackSize() != stack_size) {
+                    cb_fiber.reset();
+                }
+            }
             // 如果已有回调协程，重置它
+            // 回调函数移动到协程内，不拷贝
             if(cb_fiber){
-                cb_fiber->reset(ft.cb);
+                cb_fiber->reset(std::move(ft.cb));
             } else {
                 // 否则创建一个新的回调协程
-                cb_fiber.reset(new Fiber(ft.cb));
+                cb_fiber.reset(new Fiber(std::move(ft.cb), stack_size, false, s_shared_stack));
             }
+            Priority prio = ft.prio;
             ft.reset();  // 重置协程和线程信息
+            local->runFiber.store(cb_fiber->getId(), std::memory_order_relaxed);
+            local->runBegin.store(run_begin, std::memory_order_relaxed);
             cb_fiber->swapIn();  // 执行回调协程
             --m_activeThreadCount;  // 活跃线程数减 1
+            recordRun(local, run_begin);
 
             // 重新调用协程
             if(cb_fiber->getState() == Fiber::READY) {
-                schedule(cb_fiber);
+                schedule(cb_fiber, -1, prio);
                 cb_fiber.reset();
             } else if(cb_fiber->getState() == Fiber::EXCEPT
                    || cb_fiber->getState() == Fiber::TERM) {
                 cb_fiber->reset(nullptr);
             } else {
-                cb_fiber->m_state = Fiber::HOLD;
+                cb_fiber->m_state.store(Fiber::HOLD, std::memory_order_release);
                 cb_fiber.reset();
             }
         }
@@ -269,9 +1098,26 @@ void Scheduler::run(){
                 SYLAR_LOG_INFO(g_logger) << "idle fiber term";
                 break;
             }
+            // 队列已经取空，之前的排队延迟不再代表当前负载
+            local->latency = 0;
+            // 空闲过久且线程数大于下限，让 idle 协程结束后退出本线程
+            tryRetire(local);
 
             ++m_idleThreadCount;  // 空闲线程数加1
+            // 先标记空闲再检查 mailbox，与 tickleWorker 配合避免丢失定向唤醒
+            local->idle = true;
+            if(local->mailbox.load()) {
+                local->idle = false;
+                --m_idleThreadCount;
+                continue;
+            }
+            uint64_t idle_begin = GetMonotonicUS();
             idle_fiber->swapIn();  // 执行空闲协程
+            local->idle = false;
+            uint64_t idle_end = GetMonotonicUS();
+            local->idleTime.record(idle_end > idle_begin ? idle_end - idle_begin : 0);
+            local->switches.store(local->switches.load(std::memory_order_relaxed) + 1
+                                  , std::memory_order_relaxed);
             --m_idleThreadCount;  // 空闲线程数减1
             // 如果空闲协程没有终止或异常状态，设置为 HOLD
             if(idle_fiber->getState() != Fiber::TERM
@@ -280,23 +1126,225 @@ void Scheduler::run(){
             }
         }
     }
+    if(local->retiring) {
+        retireWorker(local);
+    }
+}
+
+/// 更新排队延迟
+uint64_t Scheduler::onTaskPicked(WorkQueue* local, const FiberAndThread& ft) {
+    uint64_t now = GetMonotonicUS();
+    local->lastBusy = now;
+    if(!ft.enqueueTime) {
+        return now;
+    }
+    // 滑动平均 avg += (wait - avg) / 8，只有所属线程写
+    int64_t wait = now > ft.enqueueTime ? now - ft.enqueueTime : 0;
+    local->queueWait.record(wait);
+    int64_t avg = local->latency.load(std::memory_order_relaxed);
+    avg += (wait - avg) / 8;
+    local->latency.store(avg, std::memory_order_relaxed);
+    // 所有线程都在忙且排队过久，增加工作线程
+    if((uint64_t)avg > s_grow_latency_us && m_threadCount < m_maxThreads
+            && m_idleThreadCount == 0 && !m_stopping.load(std::memory_order_acquire)) {
+        grow();
+    }
+    return now;
+}
+
+void Scheduler::recordRun(WorkQueue* local, uint64_t begin) {
+    local->runBegin.store(0, std::memory_order_relaxed);
+    uint64_t now = GetMonotonicUS();
+    local->runTime.record(now > begin ? now - begin : 0);
+    // 只有所属线程写，不需要原子自增
+    local->switches.store(local->switches.load(std::memory_order_relaxed) + 1
+                          , std::memory_order_relaxed);
+}
+
+void Scheduler::getStats(std::vector<WorkerStats>& stats) const {
+    stats.clear();
+    for(size_t i = 0; i < m_workQueues.size(); ++i) {
+        WorkQueue* queue = m_workQueues[i];
+        if(!queue) {
+            continue;
+        }
+        stats.emplace_back();
+        WorkerStats& s = stats.back();
+        s.worker = i;
+        s.thread = queue->retired ? -1 : (int)queue->threadId;
+        s.switches = queue->switches.load(std::memory_order_relaxed);
+        queue->queueWait.snapshot(s.queueWait);
+        queue->runTime.snapshot(s.runTime);
+        queue->idleTime.snapshot(s.idleTime);
+    }
+}
+
+/**
+ * @brief 去掉 backtrace_symbols 结果中的偏移和地址，同一函数内的位置归为一个调用点
+ * @details "prog(_ZN3foo3barEv+0x1a) [0x401234]" -> "prog(_ZN3foo3barEv)"
+ *          没有符号的 "prog(+0x1234) [0x401234]" 保留偏移 -> "prog(+0x1234)"
+ */
+static std::string TrimFrame(const std::string& frame) {
+    size_t lp = frame.find('(');
+    size_t rp = frame.find(')', lp);
+    if(lp == std::string::npos || rp == std::string::npos) {
+        return frame;
+    }
+    size_t plus = frame.find('+', lp);
+    if(plus != std::string::npos && plus > lp + 1 && plus < rp) {
+        return frame.substr(0, plus) + ")";
+    }
+    return frame.substr(0, rp + 1);
+}
+
+/**
+ * @brief 从采样的栈中找出任务入口作为统计的调用点
+ * @details 栈底是 Fiber::MainFunc，往栈顶方向跳过 Task、std::function、std::bind 的包装，
+ *          第一个其他函数就是调度时传入的回调；找不到时用被打断的位置
+ */
+static std::string WatchdogCallsite(const std::vector<std::string>& bt) {
+    if(bt.empty()) {
+        return "unknown";
+    }
+    int entry = -1;
+    for(int i = bt.size() - 1; i >= 0; --i) {
+        if(bt[i].find("5Fiber8MainFunc") != std::string::npos
+                || bt[i].find("5Fiber12CallMainFunc") != std::string::npos) {
+            entry = i;
+            break;
+        }
+    }
+    for(int i = entry - 1; i >= 0; --i) {
+        const std::string& f = bt[i];
+        size_t lp = f.find('(');
+        if(lp == std::string::npos) {
+            continue;
+        }
+        std::string sym = f.substr(lp + 1);
+        if(sym.compare(0, 14, "_ZN5sylar4Task") == 0
+                || sym.compare(0, 5, "_ZNSt") == 0
+                || sym.compare(0, 6, "_ZNKSt") == 0
+                || sym.compare(0, 4, "_ZSt") == 0) {
+            continue;
+        }
+        return TrimFrame(f);
+    }
+    return TrimFrame(bt[0]);
+}
+
+void Scheduler::watchdog() {
+    SYLAR_LOG_INFO(g_logger) << m_name << " watchdog start";
+    while(true) {
+        uint64_t budget_ms = g_scheduler_watchdog_ms->getValue();
+        // 每 1/4 个上限检查一次，超时后最多再过 1/4 个上限被发现
+        uint64_t interval = budget_ms ? std::max(budget_ms / 4, (uint64_t)1) : 1000;
+        if(m_watchdogSem.waitFor(interval)) {
+            break;
+        }
+        if(!budget_ms) {
+            continue;
+        }
+        uint64_t now = GetMonotonicUS();
+        for(size_t i = 0; i < m_workQueues.size(); ++i) {
+            WorkQueue* queue = m_workQueues[i];
+            if(!queue || queue->retired) {
+                continue;
+            }
+            uint64_t begin = queue->runBegin.load(std::memory_order_relaxed);
+            // 同一次执行只报告一次
+            if(!begin || begin == queue->reported || now < begin + budget_ms * 1000) {
+                continue;
+            }
+            queue->reported = begin;
+            reportLongRun(i, queue, begin);
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << m_name << " watchdog stop";
+}
+
+void Scheduler::reportLongRun(size_t worker, WorkQueue* queue, uint64_t begin) {
+    uint64_t fiber_id = queue->runFiber.load(std::memory_order_relaxed);
+    std::vector<std::string> bt;
+    bool sampled = ThreadBacktrace(queue->pthread, bt);
+    // 采样期间协程已经切走，栈属于其他任务
+    if(queue->runBegin.load(std::memory_order_relaxed) != begin) {
+        return;
+    }
+    std::string callsite = sampled ? WatchdogCallsite(bt) : "unknown";
+    uint64_t hits = 0;
+    {
+        MutexType::Lock lock(m_watchdogMutex);
+        hits = ++m_watchdogHits[callsite];
+    }
+
+    std::stringstream ss;
+    ss << m_name << " fiber running too long without yield, worker=" << worker
+       << " thread=" << queue->threadId << " fiber_id=" << fiber_id
+       << " used=" << (GetMonotonicUS() - begin) / 1000 << "ms"
+       << " callsite=" << callsite << " hits=" << hits;
+    if(sampled) {
+        for(auto& i : bt) {
+            ss << std::endl << "    " << i;
+        }
+    } else {
+        ss << std::endl << "    <stack sample timeout>";
+    }
+    SYLAR_LOG_WARN(g_logger) << ss.str();
+}
+
+void Scheduler::getWatchdogHits(std::map<std::string, uint64_t>& hits) {
+    MutexType::Lock lock(m_watchdogMutex);
+    hits = m_watchdogHits;
+}
+
+bool Scheduler::isRetiring() {
+    WorkQueue* local = getLocalQueue();
+    return local && local->retiring;
+}
+
+bool Scheduler::canRetire() const {
+    return m_threadCount > m_minThreads
+        && !(m_rootThread != -1 && t_worker_id == 0);
+}
+
+bool Scheduler::hasPendingWork() {
+    WorkQueue* local = getLocalQueue();
+    if(local && (local->mailbox.load() || !local->pinned.empty())) {
+        return true;
+    }
+    // 收件箱和各本地队列中未指定线程的任务都可以取到
+    for(auto& i : m_queueDepth) {
+        if(i > 0) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void Scheduler::tickle() {
     SYLAR_LOG_INFO(g_logger) << "tickle";
 }
 
+void Scheduler::tickleThread(int thread) {
+    tickle();
+}
+
+void Scheduler::tickleAll() {
+    for(size_t i = 0; i < m_threadCount; ++i){
+        tickle();
+    }
+}
+
 /// 判断调度器是否可以停止
 bool Scheduler::stopping() {
-    MutexType::Lock lock(m_mutex);
-    // 自动停止 / 正在停止 / 子协程为空 / 无活跃线程
+    // 自动停止 / 正在停止 / 所有队列为空 / 无活跃线程
     return m_autoStop && m_stopping
-        && m_fibers.empty() && m_activeThreadCount == 0;
+        && m_taskCount == 0 && m_activeThreadCount == 0;
 }
 
 void Scheduler::idle() {
     SYLAR_LOG_INFO(g_logger) << "idle";
-    while(!stopping()) {
+    while(!stopping() && !isRetiring()) {
         sylar::Fiber::YiledToHold();
     }
 }
@@ -14,11 +14,12 @@
 
 #include <memory>
 #include <vector>
-#include <list>
+#include <map>
 #include <iostream>
 
 #include "fiber.h"
 #include "thread.h"
+#include "histogram.h"
 
 namespace sylar {
 
@@ -32,6 +33,27 @@ public:
     typedef std::shared_ptr<Scheduler> ptr;
     typedef Mutex MutexType;
 
+    /**
+     * @brief 调度优先级
+     * @details 工作线程总是先取高优先级的任务，
+     *          低优先级任务被连续跳过 scheduler.starvation_limit 次后插队执行一次
+     */
+    enum Priority {
+        /// 延迟敏感的任务
+        HIGH = 0,
+        /// 普通任务 (默认)
+        NORMAL = 1,
+        /// 后台任务，如到期的定时器回调
+        BACKGROUND = 2
+    };
+    /// 优先级数量
+    static const int PRIORITY_COUNT = 3;
+
+    /**
+     * @brief 返回优先级名称
+     */
+    static const char* PriorityToString(Priority prio);
+
     /**
      * @brief 构造函数
      * @param threads 线程数量
@@ -60,6 +82,28 @@ public:
      */
     static Fiber* GetMainFiber();
 
+    /**
+     * @brief 调整工作线程数量的弹性范围
+     * @details 线程数量含义与构造函数的 threads 相同 (包含 caller 线程)
+     *          默认范围是 [threads, scheduler.max_threads 中该调度器名称对应的值]，
+     *          上限不能超过构造时的预留值，运行中也可以调整
+     *          排队延迟超过 scheduler.grow_latency_us 且没有空闲线程时增加工作线程，
+     *          工作线程空闲超过 scheduler.retire_idle_ms 时退出
+     * @param min_threads 最少线程数
+     * @param max_threads 最多线程数
+     */
+    void setThreadRange(size_t min_threads, size_t max_threads);
+
+    /**
+     * @brief 返回当前调度器创建的工作线程数量 (不含 caller 线程)
+     */
+    size_t getThreadCount() const { return m_threadCount; }
+
+    /**
+     * @brief 返回各工作线程任务排队时间 (微秒) 滑动平均的平均值
+     */
+    uint64_t getQueueLatency() const;
+
     /**
      * @brief 启动协程调度器
      */
@@ -74,21 +118,22 @@ public:
     /**
      * @brief 单个协程调度
      * @details 将一个协程或回调函数 调度到执行队列中，并通知调度器执行
+     *          工作线程内调度且未指定线程时放入本线程的本地队列，
+     *          指定线程时直接投递到目标线程的 mailbox，其余放入无锁收件箱
+     *          任务节点来自内存池，回调函数移动到节点内，稳定运行后不分配堆内存
      * @param fc 协程或者函数
      * @param thread 协程执行的线程id ，-1标识 任意线程
+     * @param prio 调度优先级
      */
     template<class FiberOrCb>
-    void schedule(FiberOrCb fc, int thread = -1){
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex); //线程安全
-            //将协程添加到 m_fibers 容器中，并返回是否触发调度器
-            need_tickle = scheduleNoLock(fc, thread);
-        }
-        //唤醒调度器
-        if(need_tickle){
-            tickle();
+    void schedule(FiberOrCb fc, int thread = -1, Priority prio = NORMAL){
+        TaskNode* node = new TaskNode(std::move(fc), thread, prio);
+        // 无效协程或回调函数直接丢弃
+        if(!node->task.fiber && !node->task.cb) {
+            delete node;
+            return;
         }
+        scheduleNode(node);
     }
 
     /**
@@ -96,43 +141,72 @@ public:
      * @details 将一组协程调度到执行队列中，并通知调度器执行
      * @param begin 协程数组开始迭代器
      * @param end   协程数组结束迭代器
+     * @param prio 调度优先级
+     * @post 数组中的协程和回调函数被转移到任务队列中
      */
     template<class InputIterator>
-    void schedule(InputIterator begin, InputIterator end) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            while(begin != end){
-                //更新 need_tickle 若为 true，说明有协程被调度
-                need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-                ++begin;
+    void schedule(InputIterator begin, InputIterator end, Priority prio = NORMAL) {
+        TaskList list;
+        while(begin != end){
+            TaskNode* node = new TaskNode(&*begin, -1, prio);
+            ++begin;
+            if(!node->task.fiber && !node->task.cb) {
+                delete node;
+                continue;
             }
+            list.push_back(node);
         }
-        if(need_tickle){
-            tickle();
-        }
+        scheduleList(list);
     }
 
-private:
     /**
-     * @brief 协程调度启动(无锁)
-     * @param fc
-     * @param thread
-     * @return
+     * @brief 返回当前线程在所属调度器中的工作线程编号
+     * @return 非调度线程返回 -1
      */
-    template<class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread){
-        // 是否有协程待执行
-        // 队列为空，唤醒调度器并传入协程
-        // 队列不为空，已有协程任务，无需立即唤醒调度器
-        bool need_tickle = m_fibers.empty();
-        FiberAndThread ft(fc, thread);  // 保存协程对象和线程信息
-        // 有效协程或回调函数 则加入队列
-        if(ft.fiber || ft.cb) {
-            m_fibers.push_back(ft);
-        }
-        return need_tickle;
-    }
+    static int GetWorkerId();
+
+    /**
+     * @brief 返回指定优先级排队中的任务数 (不含指定线程的任务)
+     */
+    size_t getQueueDepth(Priority prio) const { return m_queueDepth[prio]; }
+
+    /**
+     * @brief 工作线程的统计快照 (时间单位均为微秒)
+     */
+    struct WorkerStats {
+        /// 工作线程编号
+        int worker = -1;
+        /// 线程 id，线程已退出时为 -1
+        int thread = -1;
+        /// 协程切换次数 (执行任务和进入 idle 各计一次)
+        uint64_t switches = 0;
+        /// 任务从提交到被取出的排队时间
+        Histogram::Snapshot queueWait;
+        /// 每次 swapIn 执行任务到切回调度协程的时间
+        Histogram::Snapshot runTime;
+        /// 每次进入 idle 到返回的时间
+        Histogram::Snapshot idleTime;
+    };
+
+    /**
+     * @brief 获取各工作线程的统计数据
+     * @details 统计数据从调度器创建开始累计，弹性退出的线程的数据保留在原编号下
+     * @param[out] stats 每个用过的工作线程一项，按编号排列
+     */
+    void getStats(std::vector<WorkerStats>& stats) const;
+
+    /**
+     * @brief 获取看门狗按调用点统计的超时次数
+     * @details scheduler.watchdog_ms 大于 0 时，start() 启动看门狗线程，
+     *          任务一次 swapIn 后超过该时间仍未让出，采样其调用栈写入 system 日志并计数
+     * @param[out] hits 调用点 -> 超时次数
+     */
+    void getWatchdogHits(std::map<std::string, uint64_t>& hits);
+
+    /**
+     * @brief 输出调度器状态
+     */
+    virtual std::ostream& dump(std::ostream& os);
 
 protected:
     /**
@@ -140,10 +214,29 @@ protected:
      */
     virtual void tickle();
 
+    /**
+     * @brief 通知指定线程有任务了
+     * @param thread 线程 id，该线程当前处于 idle 中
+     */
+    virtual void tickleThread(int thread);
+
+    /**
+     * @brief 停止时唤醒所有空闲线程，使它们检查停止状态
+     * @details 默认对每个线程调用一次 tickle()
+     */
+    virtual void tickleAll();
+
     /**
      * @brief 协程调度函数
      */
     void run();
+
+    /**
+     * @brief 线程开始调度之前在该线程中调用
+     * @details 子类在这里设置线程级别的状态 (如 IOManager 屏蔽定向唤醒信号)
+     */
+    virtual void onThreadStart() {}
+
     /**
      * @brief 返回是否可以停止
      */
@@ -154,6 +247,13 @@ protected:
      */
     virtual void idle();
 
+    /**
+     * @brief 调度循环每次取任务之前调用
+     * @details 线程一直有任务可做时不会进入 idle，子类在这里处理本线程必须及时处理的工作
+     *          (如 IOManager 的线程定时器)，调用频繁，应当在无事可做时立即返回
+     */
+    virtual void poll() {}
+
     /**
      * @brief 设置当前的协程调度器
      */
@@ -164,6 +264,24 @@ protected:
      */
     bool hasIdleThreads() {return m_idleThreadCount > 0; }
 
+    /**
+     * @brief 当前工作线程是否有可取的任务 (无锁，用于 idle 中自旋检查)
+     * @details 包括本线程的指定任务、收件箱和可窃取的本地队列
+     */
+    bool hasPendingWork();
+
+    /**
+     * @brief 当前工作线程是否正在退出 (弹性线程池收缩)
+     * @details idle 看到后应当尽快返回，使 idle 协程结束
+     */
+    bool isRetiring();
+
+    /**
+     * @brief 当前线程空闲后是否可能退出 (线程数大于下限且不是 caller 线程)
+     * @details 空闲退出要等 idle 返回后检查，idle 不能无限期阻塞
+     */
+    bool canRetire() const;
+
 private:
     /**
      * @brief 协程 / 函数 / 线程组
@@ -173,9 +291,13 @@ private:
         /// 协程智能指针
         Fiber::ptr fiber;
         /// 协程执行函数
-        std::function<void()> cb;
+        Task cb;
         /// 线程 id
         int thread;
+        /// 调度优先级
+        Priority prio = NORMAL;
+        /// 入队时间 (微秒)
+        uint64_t enqueueTime = 0;
 
         /**
          * @brief 构造函数
@@ -184,7 +306,7 @@ private:
          * @details 直接通过协程对象构造
          */
         FiberAndThread(Fiber::ptr f, int thr)
-                :fiber(f), thread(thr){
+                :fiber(std::move(f)), thread(thr){
         }
 
         /**
@@ -201,24 +323,28 @@ private:
 
         /**
          * @brief 构造函数
-         * @param f 协程执行函数
+         * @param f 协程执行函数指针
          * @param thr 线程id
-         * @details 通过回调函数构造
+         * @post *f = nullptr
+         * @details 从回调函数指针中获取执行逻辑，并把它转交给 cb 成员
          */
-        FiberAndThread(std::function<void()> f, int thr)
-                :cb(f), thread(thr){
+        FiberAndThread(std::function<void()>* f, int thr)
+                :cb(std::move(*f)), thread(thr){
+            *f = nullptr;
         }
 
         /**
          * @brief 构造函数
-         * @param f 协程执行函数指针
+         * @param f 协程执行函数 (任意可调用对象)
          * @param thr 线程id
-         * @post *f = nullptr
-         * @details 从回调函数指针中获取执行逻辑，并把它转交给 cb 成员
+         * @details 可调用对象直接移动到 cb 中，不经过 std::function
          */
-        FiberAndThread(std::function<void()>* f, int thr)
-                :thread(thr){
-            cb.swap(*f);
+        template<class F, class = typename std::enable_if<
+                !std::is_convertible<F, Fiber::ptr>::value
+                && !std::is_same<typename std::decay<F>::type
+                                , std::function<void()>*>::value>::type>
+        FiberAndThread(F&& f, int thr)
+                :cb(std::forward<F>(f)), thread(thr){
         }
 
         /**
@@ -236,16 +362,366 @@ private:
             fiber = nullptr;
             cb = nullptr;
             thread = -1;
+            prio = NORMAL;
+            enqueueTime = 0;
         }
     };
 
+    /**
+     * @brief 任务节点
+     * @details 所有队列 (收件箱、mailbox、本地队列) 都以单链表串联任务节点，
+     *          任务在队列之间转移时只修改指针，不拷贝任务
+     *          节点内存由线程本地的空闲链表缓存，稳定运行后不再调用 malloc
+     */
+    struct TaskNode {
+        template<class FiberOrCb>
+        TaskNode(FiberOrCb&& fc, int thr, Priority prio)
+            :task(std::forward<FiberOrCb>(fc), thr) {
+            task.prio = prio;
+        }
+
+        /**
+         * @brief 从节点内存池分配
+         */
+        static void* operator new(size_t size);
+
+        /**
+         * @brief 归还到节点内存池
+         */
+        static void operator delete(void* ptr);
+
+        /// 任务
+        FiberAndThread task;
+        /// 下一个节点
+        TaskNode* next = nullptr;
+    };
+
+    /**
+     * @brief 任务节点组成的 FIFO 单链表
+     */
+    struct TaskList {
+        /// 队头 (最早入队)
+        TaskNode* head = nullptr;
+        /// 队尾 (最新入队)
+        TaskNode* tail = nullptr;
+        /// 节点数量
+        size_t size = 0;
+
+        bool empty() const { return head == nullptr; }
+
+        /**
+         * @brief 节点放入队尾
+         */
+        void push_back(TaskNode* node) {
+            node->next = nullptr;
+            if(tail) {
+                tail->next = node;
+            } else {
+                head = node;
+            }
+            tail = node;
+            ++size;
+        }
+
+        /**
+         * @brief 取出队头节点
+         * @return 队列为空时返回 nullptr
+         */
+        TaskNode* pop_front() {
+            TaskNode* node = head;
+            if(node) {
+                head = node->next;
+                if(!head) {
+                    tail = nullptr;
+                }
+                node->next = nullptr;
+                --size;
+            }
+            return node;
+        }
+
+        /**
+         * @brief 将 other 的全部节点接到队尾
+         * @post other 为空
+         */
+        void splice(TaskList& other) {
+            if(other.empty()) {
+                return;
+            }
+            if(tail) {
+                tail->next = other.head;
+            } else {
+                head = other.head;
+            }
+            tail = other.tail;
+            size += other.size;
+            other.head = other.tail = nullptr;
+            other.size = 0;
+        }
+    };
+
+    /**
+     * @brief 工作线程的本地任务队列
+     * @details 每个优先级一个队列，所属线程和窃取线程都从队头取任务
+     *          指定在该线程执行的任务经 mailbox 投递，不会被其他线程窃取
+     */
+    struct WorkQueue {
+        typedef Spinlock MutexType;
+        /// 队列锁
+        MutexType mutex;
+        /// 待执行的任务，下标为优先级
+        TaskList tasks[PRIORITY_COUNT];
+        /// 各优先级有任务却被跳过的次数 (持有 mutex 访问)
+        uint32_t starved[PRIORITY_COUNT] = {0};
+        /// 所属线程 id
+        std::atomic<int> threadId = {-1};
+        /// 指定在该线程执行的任务收件箱 (多生产者无锁)
+        std::atomic<TaskNode*> mailbox = {nullptr};
+        /// 从 mailbox 取出的待执行任务，只有所属线程访问
+        TaskList pinned;
+        /// 所属线程是否处于 idle
+        std::atomic<bool> idle = {false};
+        /// 所属线程绑定的 CPU，-1 表示未绑定
+        int pinnedCpu = -1;
+        /// 所属线程启动时所在的 CPU
+        int cpu = -1;
+        /// 所属线程启动时所在的 NUMA 节点
+        int node = -1;
+        /// 所属线程已退出，mailbox 中迟到的任务由其他线程取走
+        std::atomic<bool> retired = {false};
+        /// 所属线程正在退出，只有所属线程访问
+        bool retiring = false;
+        /// 最近一次取到任务的时间 (微秒)，只有所属线程访问
+        uint64_t lastBusy = 0;
+        /// 任务排队时间 (微秒) 的滑动平均，所属线程写
+        std::atomic<uint64_t> latency = {0};
+        /// 以下统计只有所属线程写，任意线程读
+        /// 任务排队时间 (微秒)
+        Histogram queueWait;
+        /// 任务每次执行的时间 (微秒)
+        Histogram runTime;
+        /// 每次 idle 的时间 (微秒)
+        Histogram idleTime;
+        /// 协程切换次数
+        std::atomic<uint64_t> switches = {0};
+        /// 所属线程的 pthread 句柄，看门狗向它发信号采样调用栈
+        pthread_t pthread = 0;
+        /// 正在执行的任务开始的时间 (微秒)，0 表示没有在执行任务，所属线程写
+        std::atomic<uint64_t> runBegin = {0};
+        /// 正在执行的协程 id，所属线程写
+        std::atomic<uint64_t> runFiber = {0};
+        /// 看门狗已经报告过的 runBegin，只有看门狗线程访问
+        uint64_t reported = 0;
+
+        /**
+         * @brief 所有优先级的队列是否都为空 (调用方持有 mutex)
+         */
+        bool empty() const {
+            for(auto& i : tasks) {
+                if(!i.empty()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief 选出本次取任务的优先级 (调用方持有 mutex)
+         * @details 默认取最高优先级，低优先级被连续跳过 limit 次后取一次低优先级
+         * @return 所有队列为空时返回 -1
+         */
+        int pick(uint32_t limit) {
+            int top = -1;
+            int starving = -1;
+            for(int i = 0; i < PRIORITY_COUNT; ++i) {
+                if(tasks[i].empty()) {
+                    starved[i] = 0;
+                    continue;
+                }
+                if(top < 0) {
+                    top = i;
+                } else if(++starved[i] >= limit) {
+                    starving = i;
+                }
+            }
+            int prio = starving >= 0 ? starving : top;
+            if(prio >= 0) {
+                starved[prio] = 0;
+            }
+            return prio;
+        }
+    };
+
+    /**
+     * @brief 将一串节点挂入收件箱 (多生产者无锁)
+     * @param inbox 目标收件箱
+     * @param first 链表头 (最新提交的任务)
+     * @param last 链表尾 (最早提交的任务)
+     * @param count 节点数量
+     * @return 收件箱原本为空时返回 true，需要唤醒工作线程
+     */
+    bool pushInbox(std::atomic<TaskNode*>& inbox, TaskNode* first
+                   , TaskNode* last, size_t count);
+
+    /**
+     * @brief 将一组节点按顺序挂入收件箱
+     * @post list 为空
+     * @return 收件箱原本为空时返回 true
+     */
+    bool pushInbox(TaskList& list);
+
+    /**
+     * @brief 一次性取走收件箱中的全部节点
+     * @return 按提交顺序排列的链表
+     */
+    static TaskList TakeInbox(std::atomic<TaskNode*>& inbox);
+
+    /**
+     * @brief 投递一个任务
+     * @details 工作线程内未指定线程的任务放入本地队列，
+     *          指定线程的任务投递到目标线程的 mailbox，其余放入收件箱
+     */
+    void scheduleNode(TaskNode* node);
+
+    /**
+     * @brief 投递一组未指定线程、同一优先级的任务
+     * @post list 为空
+     */
+    void scheduleList(TaskList& list);
+
+    /**
+     * @brief 一次性取走收件箱中的全部任务放入本地队列，再从本地队列取一个任务
+     */
+    bool popInbox(WorkQueue* local, FiberAndThread& ft, bool& tickle_me);
+
+    /**
+     * @brief 从本线程的 mailbox 取一个指定在本线程执行的任务
+     */
+    bool popPinned(WorkQueue* local, FiberAndThread& ft, bool& tickle_me);
+
+    /**
+     * @brief 返回线程 id 对应的工作线程队列
+     * @return 不是本调度器的线程时返回 nullptr
+     */
+    WorkQueue* getWorkQueue(int thread);
+
+    /**
+     * @brief 唤醒指定的工作线程
+     * @details 目标线程忙碌时会在下次取任务时看到 mailbox，只有空闲时才需要唤醒
+     */
+    void tickleWorker(WorkQueue* worker);
+
+    /**
+     * @brief 在新工作线程内完成初始化
+     * @details 先绑定 CPU，再分配本地队列，使其落在该线程的 NUMA 节点上
+     * @param worker_id 工作线程编号
+     * @param cpu 绑定的 CPU，-1 表示不绑定
+     */
+    void setupWorker(int worker_id, int cpu);
+
+    /**
+     * @brief 创建一个工作线程 (调用方持有 m_mutex)
+     * @param index 线程池下标，对应工作线程编号 index + (use_caller ? 1 : 0)
+     */
+    void spawnWorker(size_t index);
+
+    /**
+     * @brief 取到任务后更新排队延迟，必要时增加工作线程
+     * @return 当前时间 (微秒)，即任务开始执行的时间
+     */
+    uint64_t onTaskPicked(WorkQueue* local, const FiberAndThread& ft);
+
+    /**
+     * @brief 任务切回调度协程后记录执行时间和切换次数
+     * @param begin 任务开始执行的时间 (微秒)
+     */
+    void recordRun(WorkQueue* local, uint64_t begin);
+
+    /**
+     * @brief 看门狗线程，定期检查各工作线程当前任务的执行时间
+     */
+    void watchdog();
+
+    /**
+     * @brief 采样超时任务的调用栈，记录日志并按调用点计数
+     * @param worker 工作线程编号
+     * @param queue 工作线程的本地队列
+     * @param begin 任务开始执行的时间 (微秒)
+     */
+    void reportLongRun(size_t worker, WorkQueue* queue, uint64_t begin);
+
+    /**
+     * @brief 排队延迟过高时增加一个工作线程
+     */
+    void grow();
+
+    /**
+     * @brief 在未使用或线程已退出的位置上创建工作线程 (调用方持有 m_mutex)
+     * @return 没有空位时返回 false
+     */
+    bool spawnFreeSlot();
+
+    /**
+     * @brief 当前线程空闲过久且线程数大于下限时，标记为退出
+     * @return 是否开始退出
+     */
+    bool tryRetire(WorkQueue* local);
+
+    /**
+     * @brief 退出的工作线程把本地残留任务转交到收件箱
+     */
+    void retireWorker(WorkQueue* local);
+
+    /**
+     * @brief 返回当前线程的本地队列
+     * @return 当前线程不是本调度器的工作线程时返回 nullptr
+     */
+    WorkQueue* getLocalQueue();
+
+    /**
+     * @brief 从本地队列取一个可执行的任务
+     * @param local 本地队列
+     * @param ft 取出的任务
+     * @param tickle_me 队列中仍有任务时置为 true
+     */
+    bool popLocal(WorkQueue* local, FiberAndThread& ft, bool& tickle_me);
+
+    /**
+     * @brief 从其他工作线程的本地队列窃取任务
+     * @details 从 victim 最高优先级的非空队列队头窃取一半 (最多 MAX_STEAL 个) 任务，
+     *          返回其中一个，其余放入本地队列
+     */
+    bool steal(WorkQueue* local, FiberAndThread& ft, bool& tickle_me);
+
 private:
     ///Mutex
     MutexType m_mutex;
     ///线程池
     std::vector<Thread::ptr> m_threads;
-    ///待执行的协程队列
-    std::list<FiberAndThread> m_fibers;
+    ///工作线程的本地队列，下标为工作线程编号，线程启动前为空
+    std::vector<std::atomic<WorkQueue*> > m_workQueues;
+    ///非工作线程提交任务的无锁收件箱 (栈顶为最新提交的任务)
+    std::atomic<TaskNode*> m_inbox = {nullptr};
+    ///所有队列中的任务总数
+    std::atomic<size_t> m_taskCount = {0};
+    ///各优先级排队中的任务数 (不含指定线程的任务)
+    std::atomic<size_t> m_queueDepth[PRIORITY_COUNT];
+    ///工作线程数量下限 (不含 caller 线程)
+    size_t m_minThreads = 0;
+    ///工作线程数量上限 (不含 caller 线程)
+    size_t m_maxThreads = 0;
+    ///上次增加工作线程的时间 (毫秒)
+    std::atomic<uint64_t> m_lastGrow = {0};
+    ///工作线程绑定的 CPU 列表 (scheduler.cpus)
+    std::vector<int> m_cpus;
+    ///看门狗线程 (scheduler.watchdog_ms 大于 0 时创建)
+    Thread::ptr m_watchdog;
+    ///通知看门狗线程退出
+    Semaphore m_watchdogSem;
+    ///保护 m_watchdogHits
+    MutexType m_watchdogMutex;
+    ///看门狗按调用点统计的超时次数
+    std::map<std::string, uint64_t> m_watchdogHits;
     /// use_caller 为 true 时有效，调度协程
     Fiber::ptr m_rootFiber;
     /// 协程调度器名称
@@ -255,13 +731,13 @@ protected:
     /// 协程下的线程 id 数组
     std::vector<int> m_threadIds;
     /// 线程数量
-    size_t m_threadCount = 0;
+    std::atomic<size_t> m_threadCount = {0};
     /// 工作线程数量
     std::atomic<size_t> m_activeThreadCount = {0};
     /// 空闲线程数量
     std::atomic<size_t> m_idleThreadCount = {0};
-    /// 是否正在停止
-    bool m_stopping = true;
+    /// 是否正在停止，spin 和弹性扩缩容路径跨线程读取
+    std::atomic<bool> m_stopping = {true};
     /// 是否自动停止
     bool m_autoStop = false;
     /// 主线程 id  (use_caller)
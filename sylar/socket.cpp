@@ -554,10 +554,13 @@ bool Socket::cancelWrite(){
     return IOManager::GetThis()->cancleEvent(m_sock, sylar::IOManager::WRITE);
 }
 bool Socket::cancelAccept(){
+    // 监听 socket 上只有 accept，io_uring 中的操作可以全部取消
+    IOManager::GetThis()->cancleUringIo(m_sock);
     return IOManager::GetThis()->cancleEvent(m_sock, sylar::IOManager::READ);
 }
 
 bool Socket::cancelAll(){
+    IOManager::GetThis()->cancleUringIo(m_sock);
     return IOManager::GetThis()->cancleAll(m_sock);
 }
 
@@ -0,0 +1,355 @@
+/**
+  ******************************************************************************
+  * @file           : stack_allocator.cpp
+  * @author         : 18483
+  * @brief          : None
+  * @attention      : None
+  * @date           : 2025/4/15
+  ******************************************************************************
+  */
+
+#include "stack_allocator.h"
+#include "config.h"
+#include "log.h"
+#include "macro.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static ConfigVar<std::string>::ptr g_fiber_stack_allocator =
+        Config::Lookup<std::string>("fiber.stack_allocator", "pool"
+                , "fiber stack allocator: pool (mmap with guard page, cached) or malloc");
+
+static ConfigVar<uint32_t>::ptr g_fiber_stack_thread_cache =
+        Config::Lookup<uint32_t>("fiber.stack_thread_cache", 16
+                , "cached stacks per thread per size class (pool allocator)");
+
+static ConfigVar<uint64_t>::ptr g_fiber_stack_cache_bytes =
+        Config::Lookup<uint64_t>("fiber.stack_cache_bytes", 64 * 1024 * 1024
+                , "max bytes of stacks cached globally (pool allocator)");
+
+/// 按配置创建分配器
+static StackAllocator::ptr CreateStackAllocator(const std::string& type) {
+    if(type == "malloc") {
+        return std::make_shared<MallocStackAllocator>();
+    }
+    if(type != "pool") {
+        SYLAR_LOG_ERROR(g_logger) << "unknown fiber.stack_allocator=" << type << ", use pool";
+    }
+    return std::make_shared<PooledStackAllocator>(g_fiber_stack_thread_cache->getValue()
+                                                  , g_fiber_stack_cache_bytes->getValue());
+}
+
+/**
+ * @brief 默认分配器，不随静态对象析构 (线程退出时还会归还线程缓存)
+ */
+struct DefaultStackAllocator {
+    Spinlock mutex;
+    StackAllocator::ptr allocator;
+};
+
+static DefaultStackAllocator& GetDefaultHolder() {
+    static DefaultStackAllocator* s_holder = new DefaultStackAllocator;
+    return *s_holder;
+}
+
+struct _StackAllocatorIniter {
+    _StackAllocatorIniter() {
+        g_fiber_stack_allocator->addListener([](const std::string& old_value, const std::string& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "fiber stack allocator changed from "
+                                     << old_value << " to " << new_value;
+            StackAllocator::SetDefault(CreateStackAllocator(new_value));
+        });
+    }
+};
+static _StackAllocatorIniter s_stack_allocator_initer;
+
+StackAllocator::ptr StackAllocator::GetDefault() {
+    DefaultStackAllocator& holder = GetDefaultHolder();
+    Spinlock::Lock lock(holder.mutex);
+    if(!holder.allocator) {
+        lock.unlock();
+        StackAllocator::ptr allocator = CreateStackAllocator(g_fiber_stack_allocator->getValue());
+        lock.lock();
+        if(!holder.allocator) {
+            holder.allocator = allocator;
+        }
+    }
+    return holder.allocator;
+}
+
+void StackAllocator::SetDefault(StackAllocator::ptr allocator) {
+    DefaultStackAllocator& holder = GetDefaultHolder();
+    Spinlock::Lock lock(holder.mutex);
+    // 旧的分配器由使用它的协程持有，最后一个协程析构时释放
+    holder.allocator.swap(allocator);
+    lock.unlock();
+}
+
+void* MallocStackAllocator::alloc(size_t size) {
+    void* vp = malloc(size);
+    if(vp) {
+        m_inUseBytes += size;
+    }
+    return vp;
+}
+
+void MallocStackAllocator::dealloc(void* vp, size_t size) {
+    m_inUseBytes -= size;
+    free(vp);
+}
+
+std::ostream& MallocStackAllocator::dump(std::ostream& os) {
+    os << "[MallocStackAllocator in_use=" << m_inUseBytes << "]";
+    return os;
+}
+
+/**
+ * @brief 线程缓存锁
+ * @details 保护线程缓存的占用关系和各分配器的线程缓存列表
+ *          线程退出和分配器析构都会解除占用，需要同一把锁，不随静态对象析构
+ */
+static Mutex& GetThreadCacheMutex() {
+    static Mutex* s_mutex = new Mutex;
+    return *s_mutex;
+}
+
+/// 线程缓存已析构 (线程正在退出)，之后归还的栈直接进入全局缓存
+/// 平凡析构，线程缓存析构之后仍然可以访问
+static thread_local bool t_stack_cache_destroyed = false;
+
+/**
+ * @brief 线程缓存
+ * @details 第一个在本线程分配或归还栈的 PooledStackAllocator 占用线程缓存，
+ *          其他分配器在本线程直接使用全局缓存；占用的分配器析构后线程缓存可以被其他分配器占用
+ */
+struct PooledStackAllocator::ThreadCache {
+    /// 占用的分配器，只在持有线程缓存锁时修改
+    std::atomic<PooledStackAllocator*> owner = {nullptr};
+    FreeList lists[CLASS_COUNT];
+
+    ~ThreadCache() {
+        t_stack_cache_destroyed = true;
+        Mutex::Lock lock(GetThreadCacheMutex());
+        PooledStackAllocator* allocator = owner;
+        if(allocator) {
+            allocator->detach(this);
+        }
+    }
+};
+
+static thread_local PooledStackAllocator::ThreadCache t_stack_cache;
+
+PooledStackAllocator::PooledStackAllocator(size_t thread_cache, size_t global_cache_bytes)
+    :m_pageSize(sysconf(_SC_PAGESIZE))
+    ,m_threadCache(thread_cache)
+    ,m_globalCacheBytes(global_cache_bytes) {
+}
+
+PooledStackAllocator::~PooledStackAllocator() {
+    // 没有协程再持有本分配器，各线程不会再访问本分配器占用的线程缓存
+    {
+        Mutex::Lock lock(GetThreadCacheMutex());
+        while(!m_threadCaches.empty()) {
+            detach(m_threadCaches.back());
+        }
+    }
+    MutexType::Lock lock(m_mutex);
+    for(int i = 0; i < CLASS_COUNT; ++i) {
+        FreeList& list = m_global[i];
+        while(list.head) {
+            void* vp = list.head;
+            list.head = *static_cast<void**>(vp);
+            unmap(vp, classSize(i));
+        }
+        list.count = 0;
+    }
+    m_globalBytes = 0;
+}
+
+int PooledStackAllocator::classOf(size_t size) const {
+    size_t s = m_pageSize;
+    int cls = 0;
+    while(s < size && cls < CLASS_COUNT) {
+        s <<= 1;
+        ++cls;
+    }
+    return cls < CLASS_COUNT ? cls : -1;
+}
+
+void* PooledStackAllocator::map(size_t size) {
+    // 多映射一页放在低地址作为保护页 (栈向低地址增长)
+    void* base = mmap(nullptr, size + m_pageSize, PROT_READ | PROT_WRITE
+                      , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if(base == MAP_FAILED) {
+        SYLAR_LOG_ERROR(g_logger) << "mmap stack size=" << size << " errno=" << errno
+                                  << " errstr=" << strerror(errno);
+        return nullptr;
+    }
+    if(mprotect(base, m_pageSize, PROT_NONE)) {
+        SYLAR_LOG_ERROR(g_logger) << "mprotect guard page errno=" << errno
+                                  << " errstr=" << strerror(errno);
+        munmap(base, size + m_pageSize);
+        return nullptr;
+    }
+    m_mappedBytes += size;
+    return static_cast<char*>(base) + m_pageSize;
+}
+
+void PooledStackAllocator::unmap(void* vp, size_t size) {
+    munmap(static_cast<char*>(vp) - m_pageSize, size + m_pageSize);
+    m_mappedBytes -= size;
+}
+
+void PooledStackAllocator::refill(FreeList& list, int cls, size_t count) {
+    MutexType::Lock lock(m_mutex);
+    FreeList& global = m_global[cls];
+    while(global.head && count--) {
+        void* vp = global.head;
+        global.head = *static_cast<void**>(vp);
+        --global.count;
+        m_globalBytes -= classSize(cls);
+        *static_cast<void**>(vp) = list.head;
+        list.head = vp;
+        ++list.count;
+    }
+}
+
+void PooledStackAllocator::release(FreeList& list, int cls, size_t count) {
+    size_t size = classSize(cls);
+    MutexType::Lock lock(m_mutex);
+    FreeList& global = m_global[cls];
+    while(list.head && count--) {
+        void* vp = list.head;
+        list.head = *static_cast<void**>(vp);
+        --list.count;
+        if(m_globalBytes + size > m_globalCacheBytes) {
+            unmap(vp, size);
+            continue;
+        }
+        *static_cast<void**>(vp) = global.head;
+        global.head = vp;
+        ++global.count;
+        m_globalBytes += size;
+    }
+}
+
+PooledStackAllocator::ThreadCache* PooledStackAllocator::getThreadCache() {
+    // 线程缓存析构后不能再访问，退出过程中释放的协程栈走全局缓存
+    if(t_stack_cache_destroyed) {
+        return nullptr;
+    }
+    PooledStackAllocator* owner = t_stack_cache.owner.load(std::memory_order_acquire);
+    if(!owner) {
+        Mutex::Lock lock(GetThreadCacheMutex());
+        owner = t_stack_cache.owner;
+        if(!owner) {
+            owner = this;
+            m_threadCaches.push_back(&t_stack_cache);
+            t_stack_cache.owner.store(this, std::memory_order_release);
+        }
+    }
+    return owner == this ? &t_stack_cache : nullptr;
+}
+
+void PooledStackAllocator::detach(ThreadCache* cache) {
+    for(int i = 0; i < CLASS_COUNT; ++i) {
+        release(cache->lists[i], i, cache->lists[i].count);
+    }
+    m_threadCaches.erase(std::find(m_threadCaches.begin(), m_threadCaches.end(), cache));
+    cache->owner.store(nullptr, std::memory_order_release);
+}
+
+void* PooledStackAllocator::alloc(size_t size) {
+    int cls = classOf(size);
+    if(cls < 0) {
+        // 超大的栈不缓存
+        size = (size + m_pageSize - 1) / m_pageSize * m_pageSize;
+        ++m_misses;
+        void* vp = map(size);
+        if(vp) {
+            m_inUseBytes += size;
+        }
+        return vp;
+    }
+
+    size_t csize = classSize(cls);
+    ThreadCache* cache = getThreadCache();
+    FreeList tmp;
+    FreeList& list = cache ? cache->lists[cls] : tmp;
+    if(!list.head) {
+        // 一次取半个线程缓存，减少加锁次数
+        refill(list, cls, cache ? std::max(m_threadCache / 2, (size_t)1) : 1);
+    }
+    void* vp = list.head;
+    if(vp) {
+        list.head = *static_cast<void**>(vp);
+        --list.count;
+        ++m_hits;
+    } else {
+        ++m_misses;
+        vp = map(csize);
+        if(!vp) {
+            return nullptr;
+        }
+    }
+    m_inUseBytes += csize;
+    return vp;
+}
+
+void PooledStackAllocator::dealloc(void* vp, size_t size) {
+    int cls = classOf(size);
+    if(cls < 0) {
+        size = (size + m_pageSize - 1) / m_pageSize * m_pageSize;
+        m_inUseBytes -= size;
+        unmap(vp, size);
+        return;
+    }
+
+    m_inUseBytes -= classSize(cls);
+    ThreadCache* cache = getThreadCache();
+    if(!cache) {
+        FreeList tmp;
+        *static_cast<void**>(vp) = nullptr;
+        tmp.head = vp;
+        tmp.count = 1;
+        release(tmp, cls, 1);
+        return;
+    }
+    FreeList& list = cache->lists[cls];
+    *static_cast<void**>(vp) = list.head;
+    list.head = vp;
+    ++list.count;
+    if(list.count > m_threadCache) {
+        // 线程缓存满了，一半移到全局缓存给其他线程用
+        release(list, cls, list.count - m_threadCache / 2);
+    }
+}
+
+std::ostream& PooledStackAllocator::dump(std::ostream& os) {
+    size_t global_bytes = 0;
+    {
+        MutexType::Lock lock(m_mutex);
+        global_bytes = m_globalBytes;
+    }
+    // 各计数分别读取，并发分配时可能短暂不一致
+    int64_t thread_bytes = (int64_t)m_mappedBytes - (int64_t)m_inUseBytes - (int64_t)global_bytes;
+    os << "[PooledStackAllocator hits=" << m_hits
+       << " misses=" << m_misses
+       << " mapped=" << m_mappedBytes
+       << " in_use=" << m_inUseBytes
+       << " global_cached=" << global_bytes
+       << " thread_cached=" << std::max(thread_bytes, (int64_t)0)
+       << "]";
+    return os;
+}
+
+}
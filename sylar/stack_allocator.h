@@ -0,0 +1,216 @@
+/**
+  ******************************************************************************
+  * @file           : stack_allocator.h
+  * @author         : 18483
+  * @brief          : 协程栈分配器
+  * @attention      : None
+  * @date           : 2025/4/15
+  ******************************************************************************
+  */
+
+
+#ifndef SYLAR_STACK_ALLOCATOR_H
+#define SYLAR_STACK_ALLOCATOR_H
+
+#include <memory>
+#include <atomic>
+#include <ostream>
+#include <vector>
+
+#include "mutex.h"
+
+namespace sylar {
+
+/**
+ * @brief 协程栈分配器接口
+ * @details 协程创建时从 GetDefault() 取得分配器并持有它，直到协程析构归还栈
+ *          alloc 和 dealloc 可能在不同线程调用
+ */
+class StackAllocator {
+public:
+    typedef std::shared_ptr<StackAllocator> ptr;
+
+    virtual ~StackAllocator() {}
+
+    /**
+     * @brief 分配协程栈
+     * @param size 栈大小
+     * @return 栈的低地址，失败返回 nullptr
+     */
+    virtual void* alloc(size_t size) = 0;
+
+    /**
+     * @brief 归还协程栈
+     * @param vp alloc 返回的地址
+     * @param size 分配时的大小
+     */
+    virtual void dealloc(void* vp, size_t size) = 0;
+
+    /**
+     * @brief 输出分配器状态
+     */
+    virtual std::ostream& dump(std::ostream& os) = 0;
+
+    /**
+     * @brief 返回新建协程使用的分配器
+     * @details 第一次调用时按配置 fiber.stack_allocator (pool / malloc) 创建
+     */
+    static StackAllocator::ptr GetDefault();
+
+    /**
+     * @brief 替换新建协程使用的分配器，已经存在的协程仍归还到原来的分配器
+     */
+    static void SetDefault(StackAllocator::ptr allocator);
+};
+
+/**
+ * @brief 直接 malloc/free 的分配器
+ */
+class MallocStackAllocator : public StackAllocator {
+public:
+    void* alloc(size_t size) override;
+    void dealloc(void* vp, size_t size) override;
+    std::ostream& dump(std::ostream& os) override;
+
+private:
+    /// 已分配未归还的字节数
+    std::atomic<uint64_t> m_inUseBytes = {0};
+};
+
+/**
+ * @brief mmap 分配、带保护页、按大小分级缓存的分配器
+ * @details 栈大小向上取整到 2 的幂 (不小于一页)，作为一个大小级别
+ *          每个栈的最低地址一页设置为 PROT_NONE，栈溢出时立即 SIGSEGV，而不是破坏相邻内存
+ *          归还的栈先放进当前线程的空闲链表，超过 thread_cache 个时一半移到全局链表，
+ *          全局缓存超过 global_cache_bytes 时 munmap
+ *          超过最大级别 (页大小 << (CLASS_COUNT - 1)) 的栈不缓存
+ *          分配器记录占用了线程缓存的线程，析构时把这些线程缓存中的栈解除映射并解除占用
+ */
+class PooledStackAllocator : public StackAllocator {
+public:
+    typedef std::shared_ptr<PooledStackAllocator> ptr;
+    typedef Spinlock MutexType;
+
+    /// 大小级别数，第 i 级为 页大小 << i
+    static const int CLASS_COUNT = 12;
+
+    /**
+     * @brief 构造函数
+     * @param thread_cache 每个线程每个大小级别最多缓存的栈数
+     * @param global_cache_bytes 全局缓存的栈最多占用的字节数
+     */
+    PooledStackAllocator(size_t thread_cache = 16, size_t global_cache_bytes = 64 * 1024 * 1024);
+
+    /**
+     * @brief 析构函数，释放全局缓存和各线程缓存中的栈
+     */
+    ~PooledStackAllocator();
+
+    void* alloc(size_t size) override;
+    void dealloc(void* vp, size_t size) override;
+    std::ostream& dump(std::ostream& os) override;
+
+    /**
+     * @brief 从缓存取到栈的次数
+     */
+    uint64_t getHits() const { return m_hits; }
+
+    /**
+     * @brief 缓存为空需要 mmap 的次数
+     */
+    uint64_t getMisses() const { return m_misses; }
+
+    /**
+     * @brief 已映射的栈内存 (使用中 + 缓存中，不含保护页) 字节数
+     * @details 栈按需分配物理页，常驻内存不超过这个值
+     */
+    uint64_t getMappedBytes() const { return m_mappedBytes; }
+
+    /**
+     * @brief 协程正在使用的栈内存字节数
+     */
+    uint64_t getInUseBytes() const { return m_inUseBytes; }
+
+    /**
+     * @brief 线程缓存，线程退出时归还给所属分配器
+     */
+    struct ThreadCache;
+
+private:
+    /**
+     * @brief 空闲栈链表，next 指针存放在栈内存的起始位置
+     */
+    struct FreeList {
+        void* head = nullptr;
+        size_t count = 0;
+    };
+
+    /**
+     * @brief 返回 size 对应的大小级别，不缓存时返回 -1
+     */
+    int classOf(size_t size) const;
+
+    /**
+     * @brief 返回大小级别对应的栈大小
+     */
+    size_t classSize(int cls) const { return m_pageSize << cls; }
+
+    /**
+     * @brief 映射一个栈，最低一页为保护页
+     */
+    void* map(size_t size);
+
+    /**
+     * @brief 解除栈的映射
+     */
+    void unmap(void* vp, size_t size);
+
+    /**
+     * @brief 从全局缓存取最多 count 个栈放入线程缓存
+     */
+    void refill(FreeList& list, int cls, size_t count);
+
+    /**
+     * @brief 把线程缓存中的 count 个栈移到全局缓存，超出全局上限的解除映射
+     */
+    void release(FreeList& list, int cls, size_t count);
+
+    /**
+     * @brief 返回当前线程属于本分配器的缓存，线程缓存被其他分配器占用时返回 nullptr
+     */
+    ThreadCache* getThreadCache();
+
+    /**
+     * @brief 把线程缓存中的栈全部归还，解除线程缓存的占用
+     * @attention 需要持有线程缓存锁，线程缓存所属的线程此时不能在使用它
+     */
+    void detach(ThreadCache* cache);
+
+private:
+    /// 页大小
+    size_t m_pageSize;
+    /// 每个线程每个大小级别最多缓存的栈数
+    size_t m_threadCache;
+    /// 全局缓存的字节数上限
+    size_t m_globalCacheBytes;
+    /// 全局缓存锁
+    MutexType m_mutex;
+    /// 全局缓存，下标为大小级别
+    FreeList m_global[CLASS_COUNT];
+    /// 全局缓存的字节数
+    size_t m_globalBytes = 0;
+    /// 从缓存取到栈的次数
+    std::atomic<uint64_t> m_hits = {0};
+    /// 需要 mmap 的次数
+    std::atomic<uint64_t> m_misses = {0};
+    /// 已映射的字节数
+    std::atomic<uint64_t> m_mappedBytes = {0};
+    /// 使用中的字节数
+    std::atomic<uint64_t> m_inUseBytes = {0};
+    /// 本分配器占用的线程缓存，由线程缓存锁保护
+    std::vector<ThreadCache*> m_threadCaches;
+};
+
+}
+
+#endif //SYLAR_STACK_ALLOCATOR_H
@@ -0,0 +1,277 @@
+/**
+  ******************************************************************************
+  * @file           : stack_profiler.cpp
+  * @author         : 18483
+  * @brief          : None
+  * @attention      : None
+  * @date           : 2025/4/17
+  ******************************************************************************
+  */
+
+#include "stack_profiler.h"
+#include "config.h"
+#include "log.h"
+#include "mutex.h"
+
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static ConfigVar<bool>::ptr g_fiber_stack_profile =
+        Config::Lookup<bool>("fiber.stack_profile", false
+                , "paint fiber stacks and record peak stack usage per entry");
+
+static ConfigVar<bool>::ptr g_fiber_stack_adaptive =
+        Config::Lookup<bool>("fiber.stack_adaptive", false
+                , "size scheduler callback stacks from recorded usage (implies fiber.stack_profile)");
+
+static ConfigVar<uint32_t>::ptr g_fiber_stack_adaptive_samples =
+        Config::Lookup<uint32_t>("fiber.stack_adaptive_samples", 16
+                , "runs of an entry recorded before its stack size is adapted");
+
+static ConfigVar<uint32_t>::ptr g_fiber_stack_min_size =
+        Config::Lookup<uint32_t>("fiber.stack_min_size", 16 * 1024
+                , "smallest stack chosen by fiber.stack_adaptive");
+
+/// 创建协程时读取，避免每次都加配置锁
+static bool s_stack_profile = false;
+static bool s_stack_adaptive = false;
+static uint32_t s_adaptive_samples = 16;
+static uint32_t s_stack_min_size = 16 * 1024;
+
+struct _StackProfilerIniter {
+    _StackProfilerIniter() {
+        s_stack_profile = g_fiber_stack_profile->getValue();
+        s_stack_adaptive = g_fiber_stack_adaptive->getValue();
+        s_adaptive_samples = g_fiber_stack_adaptive_samples->getValue();
+        s_stack_min_size = g_fiber_stack_min_size->getValue();
+
+        g_fiber_stack_profile->addListener([](const bool& old_value, const bool& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "fiber stack profile changed from "
+                                     << old_value << " to " << new_value;
+            s_stack_profile = new_value;
+        });
+        g_fiber_stack_adaptive->addListener([](const bool& old_value, const bool& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "fiber stack adaptive changed from "
+                                     << old_value << " to " << new_value;
+            s_stack_adaptive = new_value;
+        });
+        g_fiber_stack_adaptive_samples->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+            s_adaptive_samples = new_value;
+        });
+        g_fiber_stack_min_size->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+            s_stack_min_size = new_value;
+        });
+    }
+};
+static _StackProfilerIniter s_stack_profiler_initer;
+
+/**
+ * @brief 一个入口的统计
+ */
+struct StackUsageEntry {
+    /// 入口函数地址
+    const void* target = nullptr;
+    /// 入口类型
+    const std::type_info* type = nullptr;
+    /// 保证 used 只有一个写者
+    Spinlock mutex;
+    /// 栈用量
+    Histogram used;
+    /// 记录次数
+    std::atomic<uint64_t> count = {0};
+    /// 最大栈用量
+    std::atomic<uint64_t> maxUsed = {0};
+    /// 最近一次运行的栈大小
+    std::atomic<uint64_t> stackSize = {0};
+    /// 最近一次建议的栈大小
+    std::atomic<uint64_t> suggested = {0};
+    /// 已经报告过接近栈溢出
+    std::atomic<bool> warned = {false};
+};
+
+/**
+ * @brief 所有入口的统计，条目只增不删
+ */
+struct StackUsageTable {
+    RWMutex mutex;
+    std::unordered_map<const void*, StackUsageEntry*> entries;
+};
+
+static StackUsageTable& GetTable() {
+    // 不随静态对象析构，线程退出时可能还有协程结束
+    static StackUsageTable* s_table = new StackUsageTable;
+    return *s_table;
+}
+
+/// 函数指针以函数地址区分，其他可调用对象以类型区分
+static const void* EntryKey(const void* target, const std::type_info* type) {
+    return target ? target : static_cast<const void*>(type);
+}
+
+static StackUsageEntry* FindEntry(const void* key) {
+    StackUsageTable& table = GetTable();
+    RWMutex::ReadLock lock(table.mutex);
+    auto it = table.entries.find(key);
+    return it == table.entries.end() ? nullptr : it->second;
+}
+
+static std::string EntryName(const StackUsageEntry* entry) {
+    if(entry->target) {
+        void* addr = const_cast<void*>(entry->target);
+        char** strings = backtrace_symbols(&addr, 1);
+        if(!strings) {
+            return "unknown";
+        }
+        std::string name = strings[0];
+        free(strings);
+        // binary(symbol+0x0) [addr]，尽量还原成函数名
+        size_t begin = name.find('(');
+        size_t end = name.find('+', begin);
+        if(begin != std::string::npos && end != std::string::npos && end > begin + 1) {
+            std::string symbol = name.substr(begin + 1, end - begin - 1);
+            int status = 0;
+            char* v = abi::__cxa_demangle(symbol.c_str(), nullptr, nullptr, &status);
+            if(v) {
+                symbol = v;
+                free(v);
+            }
+            return symbol;
+        }
+        return name;
+    }
+    if(entry->type) {
+        int status = 0;
+        char* v = abi::__cxa_demangle(entry->type->name(), nullptr, nullptr, &status);
+        if(v) {
+            std::string name(v);
+            free(v);
+            return name;
+        }
+        return entry->type->name();
+    }
+    return "unknown";
+}
+
+const uint64_t StackProfiler::PATTERN;
+
+bool StackProfiler::IsEnabled() {
+    return s_stack_profile || s_stack_adaptive;
+}
+
+bool StackProfiler::IsAdaptive() {
+    return s_stack_adaptive;
+}
+
+void StackProfiler::Paint(void* stack, size_t size) {
+    uint64_t* p = static_cast<uint64_t*>(stack);
+    std::fill(p, p + size / sizeof(uint64_t), PATTERN);
+}
+
+size_t StackProfiler::Measure(const void* stack, size_t size) {
+    const uint64_t* begin = static_cast<const uint64_t*>(stack);
+    const uint64_t* end = begin + size / sizeof(uint64_t);
+    const uint64_t* p = begin;
+    while(p != end && *p == PATTERN) {
+        ++p;
+    }
+    return (end - p) * sizeof(uint64_t);
+}
+
+void StackProfiler::Record(const void* target, const std::type_info* type, size_t used, size_t size) {
+    const void* key = EntryKey(target, type);
+    if(!key) {
+        return;
+    }
+    StackUsageEntry* entry = FindEntry(key);
+    if(!entry) {
+        StackUsageTable& table = GetTable();
+        RWMutex::WriteLock lock(table.mutex);
+        StackUsageEntry*& e = table.entries[key];
+        if(!e) {
+            e = new StackUsageEntry;
+            e->target = target;
+            e->type = type;
+        }
+        entry = e;
+    }
+    {
+        Spinlock::Lock lock(entry->mutex);
+        entry->used.record(used);
+        if(used > entry->maxUsed.load(std::memory_order_relaxed)) {
+            entry->maxUsed.store(used, std::memory_order_relaxed);
+        }
+    }
+    entry->stackSize.store(size, std::memory_order_relaxed);
+    entry->count.fetch_add(1, std::memory_order_relaxed);
+
+    if(used * 4 > size * 3 && !entry->warned.exchange(true)) {
+        SYLAR_LOG_WARN(g_logger) << "fiber entry " << EntryName(entry) << " used " << used
+                                 << " of " << size << " bytes stack";
+    }
+}
+
+size_t StackProfiler::SuggestStackSize(const Task& cb, size_t max_size) {
+    if(!s_stack_adaptive || !cb) {
+        return 0;
+    }
+    StackUsageEntry* entry = FindEntry(EntryKey(cb.target(), cb.type()));
+    if(!entry || entry->count.load(std::memory_order_relaxed) < s_adaptive_samples) {
+        return 0;
+    }
+    size_t want = entry->maxUsed.load(std::memory_order_relaxed) * 2;
+    size_t size = std::max((size_t)s_stack_min_size, (size_t)4096);
+    while(size < want && size < max_size) {
+        size <<= 1;
+    }
+    size = std::min(size, max_size);
+    entry->suggested.store(size, std::memory_order_relaxed);
+    return size;
+}
+
+void StackProfiler::ListAll(std::vector<Usage>& usages) {
+    std::vector<StackUsageEntry*> entries;
+    {
+        StackUsageTable& table = GetTable();
+        RWMutex::ReadLock lock(table.mutex);
+        entries.reserve(table.entries.size());
+        for(auto& i : table.entries) {
+            entries.push_back(i.second);
+        }
+    }
+    for(auto entry : entries) {
+        Usage u;
+        u.name = EntryName(entry);
+        u.stackSize = entry->stackSize.load(std::memory_order_relaxed);
+        u.suggested = entry->suggested.load(std::memory_order_relaxed);
+        entry->used.snapshot(u.used);
+        usages.push_back(std::move(u));
+    }
+    std::sort(usages.begin(), usages.end(), [](const Usage& a, const Usage& b) {
+        return a.used.max > b.used.max;
+    });
+}
+
+std::ostream& StackProfiler::Dump(std::ostream& os) {
+    std::vector<Usage> usages;
+    ListAll(usages);
+    os << "[StackProfiler enabled=" << IsEnabled()
+       << " adaptive=" << IsAdaptive()
+       << " entries=" << usages.size() << "]" << std::endl;
+    for(auto& u : usages) {
+        os << "    " << u.name << std::endl
+           << "        stack_size=" << u.stackSize
+           << " suggested=" << u.suggested << " used: ";
+        u.used.dump(os) << std::endl;
+    }
+    return os;
+}
+
+}
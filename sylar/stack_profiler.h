@@ -0,0 +1,111 @@
+/**
+  ******************************************************************************
+  * @file           : stack_profiler.h
+  * @author         : 18483
+  * @brief          : 协程栈用量统计
+  * @attention      : None
+  * @date           : 2025/4/17
+  ******************************************************************************
+  */
+
+
+#ifndef SYLAR_STACK_PROFILER_H
+#define SYLAR_STACK_PROFILER_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+
+#include "task.h"
+#include "histogram.h"
+
+namespace sylar {
+
+/**
+ * @brief 协程栈用量统计
+ * @details 开启 fiber.stack_profile 后，新建协程的栈先整体填充 PATTERN，
+ *          协程结束时从栈底向上找第一个被改写的字，得到本次执行的最大栈深度，
+ *          按入口 (函数指针的地址，或者可调用对象的类型) 汇总成直方图
+ *          协程复用 (reset) 时只重新填充上次用到的部分
+ *          开启 fiber.stack_adaptive 后，调度器为回调选择栈大小：
+ *          同一入口的样本数达到 fiber.stack_adaptive_samples 后，
+ *          取最大用量的两倍向上取整到 2 的幂，不小于 fiber.stack_min_size，不大于 fiber.stack_size
+ * @attention 填充会让整个栈都分配物理页，只适合用来评估栈大小
+ *            自适应按历史最大值选栈，以后出现更深的调用仍然可能溢出
+ */
+class StackProfiler {
+public:
+    /// 填充栈的字
+    static const uint64_t PATTERN = 0x5a5aa5a55a5aa5a5ull;
+
+    /**
+     * @brief 一个入口的栈用量
+     */
+    struct Usage {
+        /// 入口名称 (函数符号或者可调用对象的类型名)
+        std::string name;
+        /// 最近一次运行的栈大小
+        uint64_t stackSize = 0;
+        /// 自适应选择的栈大小 (样本不足时为 0)
+        uint64_t suggested = 0;
+        /// 栈用量 (字节)
+        Histogram::Snapshot used;
+    };
+
+    /**
+     * @brief 新建协程是否填充并统计栈
+     */
+    static bool IsEnabled();
+
+    /**
+     * @brief 调度器是否按统计结果选择回调协程的栈大小
+     */
+    static bool IsAdaptive();
+
+    /**
+     * @brief 填充整个栈
+     * @param stack 栈的低地址
+     * @param size 栈大小
+     */
+    static void Paint(void* stack, size_t size);
+
+    /**
+     * @brief 测量栈用量
+     * @param stack 栈的低地址
+     * @param size 栈大小
+     * @return 从栈顶到最深被改写位置的字节数
+     */
+    static size_t Measure(const void* stack, size_t size);
+
+    /**
+     * @brief 记录一次执行的栈用量
+     * @param target 入口函数地址，见 Task::target()
+     * @param type 入口类型，见 Task::type()
+     * @param used 栈用量
+     * @param size 栈大小
+     */
+    static void Record(const void* target, const std::type_info* type, size_t used, size_t size);
+
+    /**
+     * @brief 按入口的统计结果返回建议的栈大小
+     * @param cb 入口
+     * @param max_size 栈大小上限 (fiber.stack_size)
+     * @return 样本不足或未开启自适应时返回 0
+     */
+    static size_t SuggestStackSize(const Task& cb, size_t max_size);
+
+    /**
+     * @brief 返回所有入口的栈用量
+     */
+    static void ListAll(std::vector<Usage>& usages);
+
+    /**
+     * @brief 输出所有入口的栈用量
+     */
+    static std::ostream& Dump(std::ostream& os);
+};
+
+}
+
+#endif //SYLAR_STACK_PROFILER_H
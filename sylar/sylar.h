@@ -19,6 +19,7 @@
 #include "thread.h"
 #include "macro.h"
 #include "fiber.h"
+#include "fiber_local.h"
 #include "scheduler.h"
 #include "iomanager.h"
 
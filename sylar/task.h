@@ -0,0 +1,312 @@
+/**
+  ******************************************************************************
+  * @file           : task.h
+  * @author         : 18483
+  * @brief          : 小对象优化的可调用对象封装
+  * @attention      : 只能移动不能拷贝
+  * @date           : 2025/4/10
+  ******************************************************************************
+  */
+
+
+#ifndef SYLAR_TASK_H
+#define SYLAR_TASK_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+namespace sylar {
+
+/**
+ * @brief 无参无返回值的可调用对象
+ * @details 与 std::function<void()> 类似，但是
+ *          1. 只能移动，移动时不会拷贝被包装的对象
+ *          2. 不超过 INLINE_SIZE 的对象直接存放在内部缓冲区，不分配堆内存
+ *             例如 std::bind(&TcpServer::handleClient, shared_from_this(), client)
+ */
+class Task {
+public:
+    /// 内部缓冲区大小 (字节)
+    static const size_t INLINE_SIZE = 64;
+
+    /**
+     * @brief 构造空任务
+     */
+    Task() {}
+
+    /**
+     * @brief 构造空任务
+     */
+    Task(std::nullptr_t) {}
+
+    /**
+     * @brief 通过可调用对象构造
+     * @param f 可调用对象，空的函数指针或空的 std::function 构造出空任务
+     */
+    template<class F, class = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) {
+        typedef typename std::decay<F>::type Fn;
+        if(IsNull(f)) {
+            return;
+        }
+        // 编译期选择存放位置，放不下的对象不会实例化内部缓冲区上的 placement new
+        construct<Fn>(std::forward<F>(f), std::integral_constant<bool,
+                sizeof(Fn) <= INLINE_SIZE
+                && alignof(Fn) <= alignof(Storage)
+                && std::is_nothrow_move_constructible<Fn>::value>());
+    }
+
+    /**
+     * @brief 移动构造函数
+     */
+    Task(Task&& other) {
+        moveFrom(other);
+    }
+
+    /**
+     * @brief 移动赋值
+     */
+    Task& operator=(Task&& other) {
+        if(this != &other) {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    /**
+     * @brief 置为空任务
+     */
+    Task& operator=(std::nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    /**
+     * @brief 析构函数
+     */
+    ~Task() {
+        reset();
+    }
+
+    /**
+     * @brief 是否非空
+     */
+    explicit operator bool() const { return m_ops != nullptr; }
+
+    /**
+     * @brief 执行任务
+     * @pre 任务非空
+     */
+    void operator()() {
+        m_ops->invoke(&m_storage);
+    }
+
+    /**
+     * @brief 交换两个任务
+     */
+    void swap(Task& other) {
+        Task tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    /**
+     * @brief 释放被包装的对象，置为空任务
+     */
+    void reset() {
+        if(m_ops) {
+            m_ops->destroy(&m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    /**
+     * @brief 被包装的对象是否存放在内部缓冲区
+     */
+    bool isInline() const { return m_ops && m_ops->is_inline; }
+
+    /**
+     * @brief 被包装的函数指针
+     * @return 被包装的是普通函数指针时返回函数地址，否则返回 nullptr
+     */
+    const void* target() const { return m_ops ? m_ops->target(&m_storage) : nullptr; }
+
+    /**
+     * @brief 被包装对象的类型，空任务返回 nullptr
+     * @details 每个 lambda 的类型都不同，std::bind 的类型只区分被绑定函数的签名
+     */
+    const std::type_info* type() const { return m_ops ? m_ops->type : nullptr; }
+
+private:
+    typedef typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type Storage;
+
+    /**
+     * @brief 被包装对象的操作表
+     */
+    struct Ops {
+        /// 调用
+        void (*invoke)(void* storage);
+        /// 移动到 dst 并析构 src
+        void (*move)(void* dst, void* src);
+        /// 析构
+        void (*destroy)(void* storage);
+        /// 被包装的函数指针
+        const void* (*target)(const void* storage);
+        /// 被包装对象的类型
+        const std::type_info* type;
+        /// 是否存放在内部缓冲区
+        bool is_inline;
+    };
+
+    /**
+     * @brief 存放在内部缓冲区的对象操作
+     */
+    template<class Fn>
+    struct InlineOps {
+        static void Invoke(void* storage) {
+            (*static_cast<Fn*>(storage))();
+        }
+        static void Move(void* dst, void* src) {
+            new(dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        }
+        static void Destroy(void* storage) {
+            static_cast<Fn*>(storage)->~Fn();
+        }
+        static const void* Target(const void* storage) {
+            return FunctionAddress(*static_cast<const Fn*>(storage));
+        }
+        static const Ops s_ops;
+    };
+
+    /**
+     * @brief 存放在堆上的对象操作 (缓冲区中只保存指针)
+     */
+    template<class Fn>
+    struct HeapOps {
+        static void Invoke(void* storage) {
+            (**static_cast<Fn**>(storage))();
+        }
+        static void Move(void* dst, void* src) {
+            *static_cast<Fn**>(dst) = *static_cast<Fn**>(src);
+        }
+        static void Destroy(void* storage) {
+            Fn* fn = *static_cast<Fn**>(storage);
+            fn->~Fn();
+            Deallocate(fn, OverAligned<Fn>());
+        }
+        static const void* Target(const void* storage) {
+            return FunctionAddress(**static_cast<Fn* const*>(storage));
+        }
+        static const Ops s_ops;
+    };
+
+    /**
+     * @brief 在内部缓冲区构造对象
+     */
+    template<class Fn, class F>
+    void construct(F&& f, std::true_type) {
+        new(&m_storage) Fn(std::forward<F>(f));
+        m_ops = &InlineOps<Fn>::s_ops;
+    }
+
+    /**
+     * @brief 在堆上构造对象，缓冲区中只保存指针
+     */
+    template<class Fn, class F>
+    void construct(F&& f, std::false_type) {
+        void* p = Allocate<Fn>(OverAligned<Fn>());
+        try {
+            *reinterpret_cast<Fn**>(&m_storage) = new(p) Fn(std::forward<F>(f));
+        } catch(...) {
+            Deallocate(p, OverAligned<Fn>());
+            throw;
+        }
+        m_ops = &HeapOps<Fn>::s_ops;
+    }
+
+    /// 对齐要求是否超过 operator new 的保证 (C++11 的 new 不会按类型的对齐分配)
+    template<class Fn>
+    using OverAligned = std::integral_constant<bool, (alignof(Fn) > alignof(std::max_align_t))>;
+
+    template<class Fn>
+    static void* Allocate(std::false_type) {
+        return ::operator new(sizeof(Fn));
+    }
+    template<class Fn>
+    static void* Allocate(std::true_type) {
+        void* p = nullptr;
+        if(posix_memalign(&p, alignof(Fn), sizeof(Fn))) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+    static void Deallocate(void* p, std::false_type) {
+        ::operator delete(p);
+    }
+    static void Deallocate(void* p, std::true_type) {
+        free(p);
+    }
+
+    template<class Fn>
+    static bool IsNull(const Fn&) { return false; }
+    template<class R, class... Args>
+    static bool IsNull(R (* const& f)(Args...)) { return f == nullptr; }
+    template<class Sig>
+    static bool IsNull(const std::function<Sig>& f) { return !f; }
+
+    template<class Fn>
+    static const void* FunctionAddress(const Fn&) { return nullptr; }
+    template<class R, class... Args>
+    static const void* FunctionAddress(R (* const& f)(Args...)) {
+        return reinterpret_cast<const void*>(f);
+    }
+
+    void moveFrom(Task& other) {
+        if(other.m_ops) {
+            other.m_ops->move(&m_storage, &other.m_storage);
+            m_ops = other.m_ops;
+            other.m_ops = nullptr;
+        }
+    }
+
+private:
+    /// 操作表，为空表示空任务
+    const Ops* m_ops = nullptr;
+    /// 内部缓冲区
+    Storage m_storage;
+};
+
+template<class Fn>
+const Task::Ops Task::InlineOps<Fn>::s_ops = {
+    &Task::InlineOps<Fn>::Invoke,
+    &Task::InlineOps<Fn>::Move,
+    &Task::InlineOps<Fn>::Destroy,
+    &Task::InlineOps<Fn>::Target,
+    &typeid(Fn),
+    true
+};
+
+template<class Fn>
+const Task::Ops Task::HeapOps<Fn>::s_ops = {
+    &Task::HeapOps<Fn>::Invoke,
+    &Task::HeapOps<Fn>::Move,
+    &Task::HeapOps<Fn>::Destroy,
+    &Task::HeapOps<Fn>::Target,
+    &typeid(Fn),
+    false
+};
+
+}
+
+#endif //SYLAR_TASK_H
@@ -105,9 +105,10 @@ void TcpServer::startAccept(Socket::ptr sock) {
         Socket::ptr client = sock->accept();   // 接收客户端连接
         if(client){  // 当有新连接时，将其交给 m_ioWorker 处理
             client->setRecvTimeout(m_recvTimeout); // 设置接收超时时间
-            // 分配任务给 IO 线程处理
+            // 分配任务给 IO 线程处理，多 reactor 模式下直接在连接所属的 reactor 线程上处理
+            int thread = m_ioWorker->assignReactor(client->getSocket());
             m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
-                          shared_from_this(), client));
+                          shared_from_this(), client), thread);
         } else {
             SYLAR_LOG_ERROR(g_logger) << "accept errno=" << errno
                                       << " errstr=" << strerror(errno);
@@ -42,6 +42,23 @@ void Thread::SetName(const std::string& name){
     t_thread_name = name;
 }
 
+bool Thread::SetAffinity(int cpu) {
+    if(cpu < 0 || cpu >= CPU_SETSIZE) {
+        SYLAR_LOG_ERROR(g_logger) << "SetAffinity invalid cpu=" << cpu;
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(rt) {
+        SYLAR_LOG_ERROR(g_logger) << "pthread_setaffinity_np fail, rt=" << rt
+                                  << " cpu=" << cpu << " name=" << t_thread_name;
+        return false;
+    }
+    return true;
+}
+
 /// 构造函数，初始化线程并启动
 Thread::Thread(std::function<void()> cb, const std::string &name)
     :m_cb(cb)
@@ -64,6 +64,13 @@ public:
      */
     static void SetName(const std::string& name);
 
+    /**
+     * @brief 将当前线程绑定到指定 CPU
+     * @param cpu CPU 编号
+     * @return 是否成功
+     */
+    static bool SetAffinity(int cpu);
+
 private:
     /**
      * @brief 线程执行函数
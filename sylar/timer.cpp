@@ -10,9 +10,148 @@
 
 #include "timer.h"
 #include "util.h"
+#include "config.h"
+#include "log.h"
+
+#include <algorithm>
+#include <string.h>
+#include <time.h>
 
 namespace sylar {
 
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static ConfigVar<std::string>::ptr g_timer_backend =
+        Config::Lookup<std::string>("timer.backend", "wheel"
+                , "timer queue: wheel (hierarchical timing wheel) or set (std::set)");
+
+static ConfigVar<uint32_t>::ptr g_timer_wheel_tick_ms =
+        Config::Lookup<uint32_t>("timer.wheel_tick_ms", 1
+                , "timing wheel tick in ms, timers fire up to one tick late");
+
+static ConfigVar<uint64_t>::ptr g_timer_slack_ms =
+        Config::Lookup<uint64_t>("timer.slack_ms", 0
+                , "default timer slack in ms, deadlines are rounded up to a multiple of it");
+
+static ConfigVar<bool>::ptr g_clock_coarse =
+        Config::Lookup<bool>("clock.coarse", false
+                , "read timer deadlines from CLOCK_MONOTONIC_COARSE, cheaper but only accurate to a few ms (one kernel tick)");
+
+/// 粗粒度时钟通常落后一个精度，计算到期时间时补上，减少定时器提前触发 (内核 tick 推迟时仍可能提前几毫秒)
+static uint64_t s_clock_lag_ms = 0;
+
+static void SetClockMode(bool coarse) {
+    struct timespec res = {0, 0};
+    if(coarse) {
+        clock_getres(CLOCK_MONOTONIC_COARSE, &res);
+    }
+    s_clock_lag_ms = res.tv_sec * 1000ull + (res.tv_nsec + 999999) / 1000000;
+    SetCoarseClock(coarse);
+}
+
+/// 计算到期时间用的当前时间
+static uint64_t DeadlineNow() {
+    return sylar::GetMonotonicMS() + s_clock_lag_ms;
+}
+
+/// addTimer 每次都要读取，缓存配置值避免加配置锁
+static uint64_t s_timer_slack_ms = 0;
+struct _TimerIniter {
+    _TimerIniter() {
+        SetClockMode(g_clock_coarse->getValue());
+        g_clock_coarse->addListener([](const bool& old_value, const bool& new_value) {
+            SetClockMode(new_value);
+        });
+
+        s_timer_slack_ms = g_timer_slack_ms->getValue();
+        g_timer_slack_ms->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            SYLAR_LOG_INFO(g_logger) << "timer slack_ms changed from "
+                                     << old_value << " to " << new_value;
+            s_timer_slack_ms = new_value;
+        });
+    }
+};
+static _TimerIniter s_timer_initer;
+
+/// 为 true 时处理定时器的线程使用自己的定时器分片
+static ConfigVar<bool>::ptr g_timer_per_thread =
+        Config::Lookup<bool>("timer.per_thread", true
+                , "give each timer thread its own lock-free timer queue");
+
+/**
+ * @brief 交给分片所属线程执行的定时器操作
+ */
+struct TimerOp {
+    enum Type {
+        CANCEL,
+        REFRESH,
+        RESET,
+        /// 可复用定时器按 m_armed 重新放置，节点属于定时器 (Timer::m_syncOp)，不释放
+        SYNC
+    };
+    /// 收件箱链表的下一个操作
+    TimerOp* next = nullptr;
+    Timer::ptr timer;
+    Type type = CANCEL;
+    /// RESET 的新间隔
+    uint64_t ms = 0;
+    /// RESET 是否从当前时间开始
+    bool from_now = false;
+    /// 提交操作的时间
+    uint64_t now = 0;
+};
+
+/// 分片脱离线程后收件箱的标记，之后的操作直接在共享队列上执行
+static TimerOp* const s_closed_inbox = reinterpret_cast<TimerOp*>(1);
+
+/**
+ * @brief 线程的定时器分片
+ * @details queue 和 next 只由所属线程访问，其他线程只能向 inbox 提交操作
+ */
+struct TimerShard {
+    TimerShard(TimerQueue* q)
+        :queue(q) {
+    }
+
+    ~TimerShard() {
+        TimerOp* op = inbox.load();
+        while(op && op != s_closed_inbox) {
+            TimerOp* next = op->next;
+            if(op->type == TimerOp::SYNC) {
+                op->timer.reset();
+            } else {
+                delete op;
+            }
+            op = next;
+        }
+        delete queue;
+    }
+
+    /**
+     * @brief 最早到期时间的下界降到 v
+     */
+    void lower(uint64_t v) {
+        if(v < next.load(std::memory_order_relaxed)) {
+            next.store(v, std::memory_order_relaxed);
+        }
+    }
+
+    /// 定时器队列
+    TimerQueue* queue;
+    /// 最早到期时间的下界，只由所属线程修改，其他线程读取以判断是否需要唤醒
+    std::atomic<uint64_t> next = {~0ull};
+    /// 所属线程 id，-1 表示已脱离
+    std::atomic<int> thread = {-1};
+    /// 定时器数量，供其他线程统计
+    std::atomic<size_t> count = {0};
+    /// 其他线程提交的操作 (后进先出)
+    std::atomic<TimerOp*> inbox = {nullptr};
+};
+
+/// 当前线程的定时器分片及其所属的管理器
+static thread_local TimerManager* t_timer_manager = nullptr;
+static thread_local TimerShard* t_timer_shard = nullptr;
+
 /// Timer类的比较器 比较两个定时器对象的优先级（绝对超时时间）
 bool Timer::Comparator::operator()(const Timer::ptr &lhs,
             const Timer::ptr &rhs) const {
@@ -27,12 +166,13 @@ bool Timer::Comparator::operator()(const Timer::ptr &lhs,
 
 /// 定时器构造函数 初始化循环定时器
 Timer::Timer(uint64_t ms, std::function<void()> cb,
-             bool recurring, TimerManager *manager)
+             bool recurring, TimerManager *manager, uint64_t slack)
      :m_recurring(recurring)
      ,m_ms(ms)   // m_ms ：定时器周期
+     ,m_slack(slack)
      ,m_cb(cb)
      ,m_manager(manager) {
-    m_next = sylar::GetCurrentMS() + m_ms;  // 定时器下次触发时间
+    m_next = deadline(DeadlineNow());  // 定时器下次触发时间
 }
 
 /// 初始化非循环定时器
@@ -40,100 +180,591 @@ Timer::Timer(uint64_t next)
     :m_next(next){
 }
 
+Timer::~Timer() {
+    delete m_syncOp;
+}
+
+uint64_t Timer::deadline(uint64_t start) const {
+    return RoundDeadline(start + m_ms, m_slack);
+}
+
+uint64_t Timer::RoundDeadline(uint64_t next, uint64_t slack) {
+    // 向上取整到 slack 的整数倍，相近的定时器落在同一时刻
+    if(slack > 1) {
+        next = (next + slack - 1) / slack * slack;
+    }
+    return next;
+}
+
 bool Timer::cancle() {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    /// 将回调函数置空 从定时器集合中删除该定时器
-    if(m_cb){
-        m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
+    if(m_reusable) {
+        if(m_armed.exchange(~0ull) == ~0ull) {
+            return false;
+        }
+        m_manager->modifyTimer(shared_from_this(), TimerOp::SYNC, 0, false);
         return true;
     }
-    return false;
+    /// 先标记取消，再从所在的队列中删除 (其他线程的分片通过收件箱删除)
+    if(!m_active.exchange(false)) {
+        return false;
+    }
+    m_manager->modifyTimer(shared_from_this(), TimerOp::CANCEL, 0, false);
+    return true;
 }
 
-/// 刷新定时器 触发时间
-bool Timer::refresh() {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    // 没有回调函数 不能刷新
-    if(!m_cb) {
+bool Timer::arm(uint64_t ms) {
+    if(!m_reusable) {
         return false;
     }
-    // 删除原始的定时器
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
+    m_armed = RoundDeadline(DeadlineNow() + ms, m_slack);
+    m_manager->modifyTimer(shared_from_this(), TimerOp::SYNC, 0, false);
+    return true;
+}
+
+/// 刷新定时器 触发时间
+bool Timer::refresh() {
+    if(!m_active) {
         return false;
     }
-    m_manager->m_timers.erase(it);
-    // 更新定时器时间，重新插入
-    m_next = sylar::GetCurrentMS() + m_ms;
-    m_manager->m_timers.insert(shared_from_this());
-    return true;
+    return m_manager->modifyTimer(shared_from_this(), TimerOp::REFRESH, 0, false);
 }
 
 /// 重置定时器的间隔时间
 bool Timer::reset(uint64_t ms, bool from_now) {
-    // 间隔时间没变 且不用从当前开始，无需重置
-    if(ms == m_ms && !from_now) {
-        return true;
-    }
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if(!m_cb) {
+    if(!m_active) {
         return false;
     }
-    // 删除原始定时器
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
+    return m_manager->modifyTimer(shared_from_this(), TimerOp::RESET, ms, from_now);
+}
+
+
+// ----------------------- SetTimerQueue -------------------------- //
+
+
+bool SetTimerQueue::insert(const Timer::ptr& timer) {
+    // 插入定时器并判断是否插入到集合的最前面
+    return m_timers.insert(timer).first == m_timers.begin();
+}
+
+bool SetTimerQueue::erase(const Timer::ptr& timer) {
+    auto it = m_timers.find(timer);
+    if(it == m_timers.end()) {
         return false;
     }
-    m_manager->m_timers.erase(it);
-    // 初始化定时器开始时间
-    uint64_t start = 0;
-    if(from_now) {
-        start = sylar::GetCurrentMS();
+    m_timers.erase(it);
+    return true;
+}
+
+uint64_t SetTimerQueue::nextExpire() {
+    if(m_timers.empty()) {
+        return ~0ull;
+    }
+    return (*m_timers.begin())->m_next;
+}
+
+void SetTimerQueue::popExpired(uint64_t now_ms, std::vector<Timer::ptr>& expired) {
+    // 创建一个当前时间戳的定时器 用来检查已过期的定时器
+    Timer::ptr now_timer(new Timer(now_ms));
+    // 查找时间 >= 当前时间的第一个定时器
+    auto it = m_timers.lower_bound(now_timer);
+    // 遍历定时器集合 直到找到第一个不再过期的定时器
+    while(it != m_timers.end() && (*it)->m_next == now_ms) {
+        ++it;
+    }
+    // 将已过期的定时器插入到 expired 列表
+    expired.insert(expired.end(), m_timers.begin(), it);
+    m_timers.erase(m_timers.begin(), it); // 移除过期定时器
+}
+
+void SetTimerQueue::popAll(std::vector<Timer::ptr>& timers) {
+    timers.insert(timers.end(), m_timers.begin(), m_timers.end());
+    m_timers.clear();
+}
+
+std::ostream& SetTimerQueue::dump(std::ostream& os) {
+    os << "[SetTimerQueue size=" << m_timers.size() << "]";
+    return os;
+}
+
+
+// ----------------------- WheelTimerQueue -------------------------- //
+
+
+WheelTimerQueue::WheelTimerQueue(uint64_t tick_ms)
+    :m_tick(tick_ms ? tick_ms : 1) {
+    m_current = sylar::GetMonotonicMS() / m_tick;
+}
+
+WheelTimerQueue::~WheelTimerQueue() {
+    // 释放定时器对自身的引用
+    std::vector<Timer::ptr> timers;
+    popAll(timers);
+}
+
+void WheelTimerQueue::popAll(std::vector<Timer::ptr>& timers) {
+    timers.reserve(timers.size() + m_size);
+    for(int level = 0; level <= DUE_LEVEL; ++level) {
+        for(int slot = 0; slot < (level == DUE_LEVEL ? 1 : SLOTS); ++slot) {
+            Timer* timer = head(level, slot);
+            while(timer) {
+                Timer* next = timer->m_wheelNext;
+                timer->m_wheelPrev = timer->m_wheelNext = nullptr;
+                timer->m_wheelLevel = -1;
+                timers.push_back(std::move(timer->m_wheelRef));
+                timer = next;
+            }
+            head(level, slot) = nullptr;
+        }
+    }
+    memset(m_bitmap, 0, sizeof(m_bitmap));
+    m_size = 0;
+    m_earliest.store(~0ull, std::memory_order_relaxed);
+}
+
+void WheelTimerQueue::link(Timer* timer, int level, int slot) {
+    Timer*& first = head(level, slot);
+    timer->m_wheelPrev = nullptr;
+    timer->m_wheelNext = first;
+    if(first) {
+        first->m_wheelPrev = timer;
+    }
+    first = timer;
+    timer->m_wheelLevel = level;
+    timer->m_wheelSlot = slot;
+    if(level != DUE_LEVEL) {
+        m_bitmap[level][slot >> 6] |= 1ull << (slot & 63);
+    }
+}
+
+void WheelTimerQueue::unlink(Timer* timer) {
+    int level = timer->m_wheelLevel;
+    int slot = timer->m_wheelSlot;
+    if(timer->m_wheelPrev) {
+        timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
     } else {
-        start = m_next - m_ms;
+        head(level, slot) = timer->m_wheelNext;
+    }
+    if(timer->m_wheelNext) {
+        timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+    }
+    if(level != DUE_LEVEL && !m_slots[level][slot]) {
+        m_bitmap[level][slot >> 6] &= ~(1ull << (slot & 63));
+    }
+    timer->m_wheelPrev = timer->m_wheelNext = nullptr;
+    timer->m_wheelLevel = -1;
+}
+
+void WheelTimerQueue::place(Timer* timer) {
+    uint64_t expire = expireTick(timer);
+    if(expire < m_current) {
+        // 对应的刻度已经处理过
+        link(timer, DUE_LEVEL, 0);
+        return;
+    }
+    uint64_t delta = expire - m_current;
+    int level = 0;
+    while(level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+    if(delta >= (1ull << (SLOT_BITS * LEVELS))) {
+        // 超出时间轮范围，先放在最远的位置，到时再重新放置
+        expire = m_current + (1ull << (SLOT_BITS * LEVELS)) - 1;
+    }
+    link(timer, level, (expire >> (SLOT_BITS * level)) & (SLOTS - 1));
+}
+
+void WheelTimerQueue::cascade(int level, int slot) {
+    Timer* timer = m_slots[level][slot];
+    if(!timer) {
+        return;
+    }
+    m_slots[level][slot] = nullptr;
+    m_bitmap[level][slot >> 6] &= ~(1ull << (slot & 63));
+    while(timer) {
+        Timer* next = timer->m_wheelNext;
+        place(timer);
+        timer = next;
+    }
+    ++m_cascades;
+}
+
+int WheelTimerQueue::findSlot(int level, int from) const {
+    const int words = SLOTS / 64;
+    from &= SLOTS - 1;
+    // 从 from 所在的字开始，最后回到这个字检查 from 之前的位
+    for(int i = 0; i <= words; ++i) {
+        int word = ((from >> 6) + i) % words;
+        uint64_t bits = m_bitmap[level][word];
+        if(i == 0) {
+            bits &= ~0ull << (from & 63);
+        } else if(i == words) {
+            bits &= (1ull << (from & 63)) - 1;
+        }
+        if(bits) {
+            int slot = word * 64 + __builtin_ctzll(bits);
+            return (slot - from) & (SLOTS - 1);
+        }
+    }
+    return -1;
+}
+
+bool WheelTimerQueue::insert(const Timer::ptr& timer) {
+    timer->m_wheelRef = timer;
+    place(timer.get());
+    ++m_size;
+    bool at_front = timer->m_next < m_earliest.load(std::memory_order_relaxed);
+    if(at_front) {
+        m_earliest.store(timer->m_next, std::memory_order_relaxed);
     }
-    // 重置定时器
-    m_ms = ms;
-    m_next = start +m_ms;
-    m_manager->addTimer(shared_from_this(), lock);
+    return at_front;
+}
+
+bool WheelTimerQueue::erase(const Timer::ptr& timer) {
+    if(timer->m_wheelLevel < 0) {
+        return false;
+    }
+    unlink(timer.get());
+    --m_size;
+    timer->m_wheelRef.reset();
+    // 删除的可能是最早的定时器，m_earliest 偏小会使之后插入的更早的定时器不唤醒
+    nextExpire();
     return true;
 }
 
+uint64_t WheelTimerQueue::nextExpire() {
+    uint64_t earliest = ~0ull;
+    if(m_due) {
+        earliest = 0;
+    } else if(m_size) {
+        // 第 0 层的槽对应确切的刻度，更高层取槽覆盖范围的起点
+        uint64_t tick = ~0ull;
+        int d = findSlot(0, m_current);
+        if(d >= 0) {
+            tick = m_current + d;
+        }
+        for(int level = 1; level < LEVELS; ++level) {
+            int shift = SLOT_BITS * level;
+            uint64_t block = m_current >> shift;
+            int idx = block & (SLOTS - 1);
+            if(!(m_current & ((1ull << shift) - 1))
+                    && (m_bitmap[level][idx >> 6] & (1ull << (idx & 63)))) {
+                // m_current 在当前槽的起点，槽还没有下放
+                tick = std::min(tick, m_current);
+            }
+            // 距离 SLOTS 即当前槽，是一整圈之后
+            d = findSlot(level, idx + 1);
+            if(d >= 0) {
+                tick = std::min(tick, (block + d + 1) << shift);
+            }
+        }
+        earliest = tick * m_tick;
+    }
+    m_earliest.store(earliest, std::memory_order_relaxed);
+    return earliest;
+}
+
+void WheelTimerQueue::popExpired(uint64_t now_ms, std::vector<Timer::ptr>& expired) {
+    uint64_t now_tick = now_ms / m_tick;
+    while(m_due) {
+        Timer* timer = m_due;
+        unlink(timer);
+        --m_size;
+        expired.push_back(std::move(timer->m_wheelRef));
+    }
+    while(m_current <= now_tick) {
+        if(!m_size) {
+            m_current = now_tick + 1;
+            break;
+        }
+        int idx = m_current & (SLOTS - 1);
+        if(idx == 0) {
+            // 进入高层一个槽覆盖的范围，下放到低层
+            for(int level = 1; level < LEVELS; ++level) {
+                int slot = (m_current >> (SLOT_BITS * level)) & (SLOTS - 1);
+                cascade(level, slot);
+                if(slot != 0) {
+                    break;
+                }
+            }
+        }
+        Timer* timer = m_slots[0][idx];
+        if(timer) {
+            m_slots[0][idx] = nullptr;
+            m_bitmap[0][idx >> 6] &= ~(1ull << (idx & 63));
+        }
+        while(timer) {
+            Timer* next = timer->m_wheelNext;
+            timer->m_wheelPrev = timer->m_wheelNext = nullptr;
+            timer->m_wheelLevel = -1;
+            if(timer->m_next > now_ms) {
+                // 超出时间轮范围时放在最远位置的定时器
+                place(timer);
+            } else {
+                --m_size;
+                expired.push_back(std::move(timer->m_wheelRef));
+            }
+            timer = next;
+        }
+        ++m_current;
+        // 跳过空刻度，最多跳到下一次下放的位置
+        idx = m_current & (SLOTS - 1);
+        if(idx != 0 && m_current <= now_tick) {
+            int d = findSlot(0, idx);
+            uint64_t skip = (d >= 0 && idx + d < SLOTS) ? d : SLOTS - idx;
+            m_current = std::min(m_current + skip, now_tick + 1);
+        }
+    }
+    // 取走的定时器不再是最早的，否则清空后插入的定时器与旧的 m_earliest 比较，不会唤醒空闲线程
+    nextExpire();
+}
+
+std::ostream& WheelTimerQueue::dump(std::ostream& os) {
+    os << "[WheelTimerQueue tick_ms=" << m_tick
+       << " size=" << m_size
+       << " cascades=" << m_cascades << "]";
+    return os;
+}
+
 
 // ----------------------- TimerManager -------------------------- //
 
 
+/// 按配置创建定时器队列
+static TimerQueue* CreateTimerQueue(const std::string& type) {
+    if(type == "set") {
+        return new SetTimerQueue;
+    }
+    if(type != "wheel") {
+        SYLAR_LOG_ERROR(g_logger) << "unknown timer.backend=" << type << ", use wheel";
+    }
+    return new WheelTimerQueue(g_timer_wheel_tick_ms->getValue());
+}
+
 TimerManager::TimerManager() {
-    m_previouseTime = sylar::GetCurrentMS();
+    m_queue = CreateTimerQueue(g_timer_backend->getValue());
 }
 
 TimerManager::~TimerManager() {
+    if(t_timer_manager == this) {
+        t_timer_manager = nullptr;
+        t_timer_shard = nullptr;
+    }
+    for(auto i : m_shards) {
+        delete i;
+    }
+    delete m_queue;
+}
+
+TimerShard* TimerManager::localShard() const {
+    return t_timer_manager == this ? t_timer_shard : nullptr;
+}
+
+TimerOp TimerManager::TakeOp(TimerOp* node) {
+    TimerOp op;
+    op.type = node->type;
+    op.timer = std::move(node->timer);
+    if(node->type == TimerOp::SYNC) {
+        op.timer->m_syncPending = false;
+        return op;
+    }
+    op.ms = node->ms;
+    op.from_now = node->from_now;
+    op.now = node->now;
+    delete node;
+    return op;
+}
+
+bool TimerManager::ApplyOp(TimerQueue* queue, const TimerOp& op, bool& at_front) {
+    const Timer::ptr& timer = op.timer;
+    at_front = false;
+    if(op.type == TimerOp::SYNC) {
+        queue->erase(timer);
+        uint64_t armed = timer->m_armed;
+        if(armed == ~0ull) {
+            return true;
+        }
+        timer->m_next = armed;
+        at_front = queue->insert(timer);
+        return true;
+    }
+    if(op.type == TimerOp::CANCEL) {
+        // 取消的定时器可能已被取出，仍要释放回调
+        queue->erase(timer);
+        timer->m_cb = nullptr;
+        return true;
+    }
+    if(!timer->m_active) {
+        return false;
+    }
+    if(op.type == TimerOp::RESET && op.ms == timer->m_ms && !op.from_now) {
+        return true;
+    }
+    // 不在队列中 (已经到期取出) 不能修改
+    if(!queue->erase(timer)) {
+        return false;
+    }
+    if(op.type == TimerOp::REFRESH) {
+        timer->m_next = timer->deadline(op.now);
+    } else {
+        uint64_t start = op.from_now ? op.now : timer->m_next - timer->m_ms;
+        timer->m_ms = op.ms;
+        timer->m_next = timer->deadline(start);
+    }
+    at_front = queue->insert(timer);
+    return true;
 }
 
 /// 创建定时器并 添加到管理器中
 Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb,
-                                  bool recurring) {
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
+                                  bool recurring, uint64_t slack) {
+    if(slack == DEFAULT_SLACK) {
+        slack = s_timer_slack_ms;
+    }
+    Timer::ptr timer(new Timer(ms, cb, recurring, this, slack));
+    timer->m_active = true;
+    TimerShard* shard = localShard();
+    if(shard) {
+        // 放进本线程的分片，本线程正在运行，之后计算等待时间时会看到，无需唤醒
+        timer->m_shard.store(shard, std::memory_order_relaxed);
+        shard->queue->insert(timer);
+        shard->count.store(shard->queue->size(), std::memory_order_relaxed);
+        shard->lower(timer->m_next);
+        return timer;
+    }
     RWMutexType::WriteLock lock(m_mutex);
     addTimer(timer, lock);
     return timer;
 }
 
+Timer::ptr TimerManager::addReusableTimer(std::function<void()> cb, uint64_t slack) {
+    if(slack == DEFAULT_SLACK) {
+        slack = s_timer_slack_ms;
+    }
+    Timer::ptr timer(new Timer(0, cb, false, this, slack));
+    timer->m_reusable = true;
+    timer->m_syncOp = new TimerOp;
+    timer->m_syncOp->type = TimerOp::SYNC;
+    // 属于创建线程的分片，之后在其他线程上设置也提交给该线程
+    timer->m_shard.store(localShard(), std::memory_order_relaxed);
+    return timer;
+}
+
 void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock &lock) {
-    // 插入定时器并返回位置
-    auto it = m_timers.insert(val).first;
-    // 判断是否插入到集合的最前面
-    bool at_front = (it == m_timers.begin()) && !m_tickled;
+    // 插入定时器并判断是否成为最早到期的定时器
+    bool at_front = m_queue->insert(val) && !m_tickled.exchange(true);
+    m_sharedCount.store(m_queue->size(), std::memory_order_relaxed);
+    lock.unlock();
+    // 插入到最前面 触发相关操作
     if(at_front) {
-        m_tickled = true;  // 标记已被触发
+        onTimerInsertedAtFront();
     }
+}
+
+bool TimerManager::modifyTimer(Timer::ptr timer, int type, uint64_t ms, bool from_now) {
+    TimerOp op;
+    op.timer = std::move(timer);
+    op.type = (TimerOp::Type)type;
+    op.ms = ms;
+    op.from_now = from_now;
+    op.now = type == TimerOp::REFRESH || type == TimerOp::RESET ? DeadlineNow() : 0;
+
+    bool at_front = false;
+    TimerShard* shard = op.timer->m_shard.load(std::memory_order_acquire);
+    if(shard && shard == localShard()) {
+        // 本线程的分片，直接修改
+        bool rt = ApplyOp(shard->queue, op, at_front);
+        shard->count.store(shard->queue->size(), std::memory_order_relaxed);
+        if(op.type != TimerOp::SYNC || op.timer->m_armed != ~0ull) {
+            shard->lower(op.timer->m_next);
+        }
+        return rt;
+    }
+    if(shard) {
+        // 其他线程的分片，提交到收件箱
+        Timer* timer = op.timer.get();
+        // 重置或设置得比所属线程等待的时间早，需要唤醒所属线程
+        // (提交后再读 next，与 getNextDeadline 写 next 后再检查收件箱配对)
+        auto notify = [this, shard, timer, &op]() {
+            int thread = shard->thread.load(std::memory_order_relaxed);
+            bool earlier = op.type == TimerOp::RESET
+                    || (op.type == TimerOp::SYNC && timer->m_armed < shard->next.load());
+            if(earlier && thread != -1) {
+                onTimerThreadNotify(thread);
+            }
+        };
+        TimerOp* node = nullptr;
+        if(op.type == TimerOp::SYNC) {
+            // 已提交的同步操作还未执行，执行时会读到这次设置的 m_armed
+            if(timer->m_syncPending.exchange(true)) {
+                notify();
+                return true;
+            }
+            node = timer->m_syncOp;
+            node->timer = op.timer;
+        } else {
+            node = new TimerOp(op);
+        }
+        TimerOp* head = shard->inbox.load(std::memory_order_relaxed);
+        while(head != s_closed_inbox) {
+            node->next = head;
+            if(shard->inbox.compare_exchange_weak(head, node
+                        , std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                notify();
+                return true;
+            }
+        }
+        // 分片已脱离，定时器已经移到共享队列
+        if(op.type == TimerOp::SYNC) {
+            // 脱离时不在队列中的可复用定时器还指向该分片，改为属于共享队列
+            node->timer.reset();
+            timer->m_shard.compare_exchange_strong(shard, nullptr);
+            timer->m_syncPending = false;
+        } else {
+            delete node;
+        }
+    }
+    RWMutexType::WriteLock lock(m_mutex);
+    bool rt = ApplyOp(m_queue, op, at_front);
+    m_sharedCount.store(m_queue->size(), std::memory_order_relaxed);
+    // 重置/设置后成为最早的定时器，与 addTimer 一样唤醒等待的线程 (刷新只会推迟)
+    at_front = at_front && (op.type == TimerOp::RESET || op.type == TimerOp::SYNC)
+                && !m_tickled.exchange(true);
     lock.unlock();
-    // 插入到最前面 触发相关操作
     if(at_front) {
         onTimerInsertedAtFront();
     }
+    return rt;
+}
+
+void TimerManager::drainShard(TimerShard* shard) {
+    if(!shard->inbox.load(std::memory_order_relaxed)) {
+        return;
+    }
+    TimerOp* op = shard->inbox.exchange(nullptr, std::memory_order_acquire);
+    // 收件箱后进先出，反转后按提交顺序执行
+    TimerOp* list = nullptr;
+    while(op) {
+        TimerOp* next = op->next;
+        op->next = list;
+        list = op;
+        op = next;
+    }
+    while(list) {
+        TimerOp* next = list->next;
+        TimerOp op = TakeOp(list);
+        bool at_front = false;
+        if(op.timer->m_shard.load(std::memory_order_relaxed) == shard) {
+            ApplyOp(shard->queue, op, at_front);
+            shard->lower(op.timer->m_next);
+        } else {
+            // 分片曾经脱离过，定时器已经移到共享队列
+            RWMutexType::WriteLock lock(m_mutex);
+            ApplyOp(m_queue, op, at_front);
+            m_sharedCount.store(m_queue->size(), std::memory_order_relaxed);
+        }
+        list = next;
+    }
+    shard->count.store(shard->queue->size(), std::memory_order_relaxed);
 }
 
 /// 通过 std::weak_ptr 来检查条件是否依然有效，如果有效则执行回调函数
@@ -148,88 +779,230 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
 Timer::ptr TimerManager::addConditionTimer(uint64_t ms,
                                            std::function<void()> cb,
                                            std::weak_ptr<void> weak_cond,
-                                           bool recurring) {
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+                                           bool recurring, uint64_t slack) {
+    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring, slack);
 }
 
 /// 返回下一个定时器的时间间隔
 uint64_t TimerManager::getNextTimer() {
-    RWMutexType::ReadLock lock(m_mutex);
-    m_tickled = false;
+    uint64_t next = getNextDeadline();
     // 如果没有定时器 返回一个特殊值
-    if(m_timers.empty()) {
+    if(next == ~0ull) {
         return ~0ull;
     }
-
-    // 获取下一个定时器
-    const Timer::ptr& next = *m_timers.begin();
-    uint64_t now_ms = sylar::GetCurrentMS();
+    uint64_t now_ms = sylar::GetMonotonicMS();
     // 如果当前时间已经超过或等于下一个定时器的时间 则已经到期(立即执行) 返回0
-    if(now_ms >= next->m_next) {
+    if(now_ms >= next) {
         return 0;
     } else {
         // 否则返回下一个定时器到期的时间差
-        return next->m_next - now_ms;
+        return next - now_ms;
+    }
+}
+
+uint64_t TimerManager::getNextDeadline() {
+    uint64_t next = ~0ull;
+    TimerShard* shard = localShard();
+    if(shard) {
+        do {
+            drainShard(shard);
+            next = shard->queue->nextExpire();
+            shard->next.store(next);
+        } while(shard->inbox.load());
+    }
+    m_tickled = false;
+    if(m_sharedCount.load(std::memory_order_relaxed)) {
+        RWMutexType::ReadLock lock(m_mutex);
+        next = std::min(next, m_queue->nextExpire());
     }
+    return next;
+}
+
+void TimerManager::collectExpired(TimerQueue* queue, uint64_t now_ms, std::vector<Timer::ptr>& expired
+                                  , std::vector<std::function<void()>>& cbs) {
+    // 为回调函数分配足够空间
+    cbs.reserve(cbs.size() + expired.size());
+    for(auto& timer : expired) {
+        if(timer->m_reusable) {
+            // 到期时间未被修改才触发，修改过的由之后执行的同步操作重新放置
+            uint64_t armed = timer->m_next;
+            if(timer->m_armed.compare_exchange_strong(armed, ~0ull)) {
+                cbs.push_back(timer->m_cb);
+            }
+            continue;
+        }
+        if(timer->m_recurring) {
+            // 已被其他线程取消，取消操作会释放回调
+            if(!timer->m_active) {
+                continue;
+            }
+            // 将其回调函数加入到 cbs，重新加入到队列
+            cbs.push_back(timer->m_cb);
+            timer->m_next = timer->deadline(now_ms);
+            queue->insert(timer);
+        } else {
+            // 与取消竞争，成功置为无效的一方负责回调
+            bool active = true;
+            if(timer->m_active.compare_exchange_strong(active, false)) {
+                cbs.push_back(std::move(timer->m_cb));
+            }
+            timer->m_cb = nullptr; // 非循环定时器 清空
+        }
+    }
+}
+
+void TimerManager::popShard(TimerShard* shard, uint64_t now_ms
+                            , std::vector<std::function<void()>>& cbs) {
+    std::vector<Timer::ptr> expired;
+    shard->queue->popExpired(now_ms, expired);
+    collectExpired(shard->queue, now_ms, expired, cbs);
+    shard->next.store(shard->queue->nextExpire(), std::memory_order_relaxed);
+    shard->count.store(shard->queue->size(), std::memory_order_relaxed);
 }
 
 /// 检查定时器是否到期 并执行到期的定时器回调函数
 void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs) {
-    uint64_t now_ms = sylar::GetCurrentMS();  // 获取当前时间戳
-    std::vector<Timer::ptr> expired;  // 存储已过期的定时器
+    uint64_t now_ms = sylar::GetCachedMS();  // 当前线程缓存的时间戳
+    TimerShard* shard = localShard();
+    if(shard) {
+        drainShard(shard);
+        if(shard->next <= now_ms) {
+            popShard(shard, now_ms, cbs);
+        }
+    }
+    if(!m_sharedCount.load(std::memory_order_relaxed)) {
+        return;
+    }
+    popShared(now_ms, cbs);
+}
+
+void TimerManager::popShared(uint64_t now_ms, std::vector<std::function<void()>>& cbs) {
     /// 提高并发性能，先使用读锁检查 在使用写锁检查
     {
         RWMutexType::ReadLock lock(m_mutex); // 读锁锁定
-        if(m_timers.empty()){
-            return;  // 没有定时器
+        if(m_queue->empty() || m_queue->nextExpire() > now_ms){
+            return;  // 没有到期的定时器
         }
     }
     RWMutexType::WriteLock lock(m_mutex);    // 写锁锁定
-    if(m_timers.empty()) {
+    if(m_queue->empty()) {
         return;
     }
+    std::vector<Timer::ptr> expired;  // 存储已过期的定时器
+    m_queue->popExpired(now_ms, expired);
+    collectExpired(m_queue, now_ms, expired, cbs);
+    m_sharedCount.store(m_queue->size(), std::memory_order_relaxed);
+}
 
-    // 创建一个当前时间戳的定时器 用来检查已过期的定时器
-    Timer::ptr now_timer(new Timer(now_ms));
-    // 查找时间 >= 当前时间的第一个定时器
-    auto it = m_timers.lower_bound(now_timer);
-    // 遍历定时器集合 直到找到第一个不再过期的定时器
-    while(it != m_timers.end() && (*it)->m_next == now_ms) {
-        ++it;
+void TimerManager::listLocalExpiredCb(std::vector<std::function<void()>>& cbs) {
+    TimerShard* shard = localShard();
+    if(!shard) {
+        return;
     }
-    // 将已过期的定时器插入到 expired 列表
-    expired.insert(expired.begin(), m_timers.begin(), it);
-    m_timers.erase(m_timers.begin(), it); // 移除过期定时器
-    // 为回调函数分配足够空间
-    cbs.reserve(expired.size());
+    drainShard(shard);
+    bool shared = m_sharedCount.load(std::memory_order_relaxed) > 0;
+    if(shard->next == ~0ull && !shared) {
+        return;
+    }
+    uint64_t now_ms = sylar::GetCachedMS();
+    if(shard->next <= now_ms) {
+        popShard(shard, now_ms, cbs);
+    }
+    if(shared) {
+        popShared(now_ms, cbs);
+    }
+}
 
-    for(auto& timer : expired) {
-        // 将其回调函数加入到 cbs
-        cbs.push_back(timer->m_cb);
-        // 循环定时器，重新加入到 m_timers
-        if(timer->m_recurring) {
-            timer->m_next = now_ms + timer->m_ms;
-            m_timers.insert(timer);
-        } else {
-            timer->m_cb = nullptr; // 非循环定时器 清空
+void TimerManager::attachTimerThread() {
+    if(!g_timer_per_thread->getValue() || localShard()) {
+        return;
+    }
+    RWMutexType::WriteLock lock(m_mutex);
+    TimerShard* shard = nullptr;
+    // 复用脱离的分片
+    for(auto i : m_shards) {
+        if(i->thread == -1) {
+            shard = i;
+            break;
         }
     }
-
+    if(!shard) {
+        shard = new TimerShard(CreateTimerQueue(g_timer_backend->getValue()));
+        m_shards.push_back(shard);
+    }
+    shard->thread = sylar::GetThreadId();
+    shard->next.store(~0ull);
+    shard->inbox.store(nullptr);
+    t_timer_manager = this;
+    t_timer_shard = shard;
 }
 
-bool TimerManager::detectClockRollover(uint64_t now_ms) {
-    bool rollover = false;
-    if(now_ms < m_previouseTime &&
-            now_ms < (m_previouseTime - 60 * 60 * 1000)) {
-        rollover = true;
+void TimerManager::detachTimerThread() {
+    TimerShard* shard = localShard();
+    if(!shard) {
+        return;
+    }
+    drainShard(shard);
+    std::vector<Timer::ptr> timers;
+    shard->queue->popAll(timers);
+
+    RWMutexType::WriteLock lock(m_mutex);
+    bool at_front = false;
+    // 先把定时器移到共享队列，再关闭收件箱，之后提交的操作直接在共享队列上执行
+    for(auto& i : timers) {
+        i->m_shard.store(nullptr, std::memory_order_release);
+        at_front = m_queue->insert(i) || at_front;
+    }
+    TimerOp* op = shard->inbox.exchange(s_closed_inbox, std::memory_order_acquire);
+    while(op) {
+        TimerOp* next = op->next;
+        TimerOp local = TakeOp(op);
+        bool front = false;
+        if(local.type == TimerOp::SYNC) {
+            TimerShard* expected = shard;
+            local.timer->m_shard.compare_exchange_strong(expected, nullptr);
+        }
+        ApplyOp(m_queue, local, front);
+        at_front = front || at_front;
+        op = next;
+    }
+    m_sharedCount.store(m_queue->size(), std::memory_order_relaxed);
+    shard->thread = -1;
+    shard->next.store(~0ull);
+    shard->count = 0;
+    t_timer_manager = nullptr;
+    t_timer_shard = nullptr;
+    at_front = at_front && !m_tickled.exchange(true);
+    lock.unlock();
+    // 其他线程接手这些定时器
+    if(at_front) {
+        onTimerInsertedAtFront();
     }
-    m_previouseTime = now_ms;
-    return rollover;
 }
 
 bool TimerManager::hasTimer() {
     RWMutexType::ReadLock lock(m_mutex);
-    return !m_timers.empty();
+    if(!m_queue->empty()) {
+        return true;
+    }
+    for(auto i : m_shards) {
+        if(i->count.load(std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::ostream& TimerManager::dumpTimers(std::ostream& os) {
+    RWMutexType::ReadLock lock(m_mutex);
+    m_queue->dump(os);
+    for(auto i : m_shards) {
+        int thread = i->thread;
+        if(thread != -1) {
+            os << " thread_" << thread << "=" << i->count.load(std::memory_order_relaxed);
+        }
+    }
+    return os;
 }
 
 }
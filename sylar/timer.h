@@ -15,27 +15,51 @@
 #include <memory>
 #include <vector>
 #include <set>
+#include <atomic>
+#include <ostream>
 
 namespace sylar {
 
 class TimerManager;
+class SetTimerQueue;
+class WheelTimerQueue;
+struct TimerShard;
+struct TimerOp;
 
 /**
  * @brief 定时器类
  */
 class Timer : public std::enable_shared_from_this<Timer> {
     friend class TimerManager;
+    friend class SetTimerQueue;
+    friend class WheelTimerQueue;
 public:
     /// 定时器的智能指针类型
     typedef std::shared_ptr<Timer> ptr;
 
+    /**
+     * @brief 析构函数
+     */
+    ~Timer();
+
     /**
      * @brief 取消定时器
+     * @details 定时器属于其他线程时只标记取消并通知所属线程从队列删除，
+     *          标记之后不会再触发 (已经取出的回调仍会执行)
+     *          可复用定时器取消后可以再次 arm()，返回是否取消了尚未触发的设置
      */
     bool cancle();
 
+    /**
+     * @brief 设置可复用定时器 ms 毫秒后触发，已设置时改为新的到期时间
+     * @details 见 TimerManager::addReusableTimer，不是可复用定时器时返回 false
+     */
+    bool arm(uint64_t ms);
+
     /**
      * @brief 刷新设定定时器的执行时间
+     * @details 定时器属于其他线程时交给所属线程执行，返回 true 表示已提交
+     *          可复用定时器用 arm() 重新设置
      */
     bool refresh();
 
@@ -43,6 +67,7 @@ public:
      * @brief 重置定时器时间
      * @param ms 定时器执行间隔时间 （毫秒）
      * @param from_now 是否从当前时间开始计算
+     * @details 定时器属于其他线程时交给所属线程执行，返回 true 表示已提交
      */
     bool reset(uint64_t ms, bool from_now);
 private:
@@ -52,9 +77,10 @@ private:
      * @param cb 回调函数
      * @param recurring 是否循环
      * @param manager 定时器管理器
+     * @param slack 允许推迟的毫秒数
      */
     Timer(uint64_t ms, std::function<void()> cb,
-          bool recurring, TimerManager* manager);
+          bool recurring, TimerManager* manager, uint64_t slack = 0);
 
     /**
      * @brief 构造函数
@@ -62,17 +88,51 @@ private:
      */
     Timer(uint64_t next);
 
+    /**
+     * @brief 从 start 开始计时的到期时间，按 m_slack 向上取整
+     */
+    uint64_t deadline(uint64_t start) const;
+
+    /**
+     * @brief 到期时间 next 向上取整到 slack 的整数倍，相近的定时器落在同一时刻
+     * @details 创建、循环重新加入、refresh/reset 和 arm 都通过这里计算到期时间
+     */
+    static uint64_t RoundDeadline(uint64_t next, uint64_t slack);
+
 private:
     /// 是否循环定时器
     bool m_recurring = false;
     /// 执行周期
     uint64_t m_ms = 0;
+    /// 允许推迟的毫秒数，到期时间取整到它的整数倍
+    uint64_t m_slack = 0;
     /// 精确的执行时间
     uint64_t m_next = 0;
     /// 回调函数
     std::function<void()> m_cb;
     /// 定时器管理器
     TimerManager* m_manager = nullptr;
+    /// 时间轮链表的前后节点
+    Timer* m_wheelPrev = nullptr;
+    Timer* m_wheelNext = nullptr;
+    /// 所在时间轮的层，-1 表示不在时间轮中
+    int16_t m_wheelLevel = -1;
+    /// 所在层的槽
+    uint16_t m_wheelSlot = 0;
+    /// 在时间轮中时持有自身，离开时释放
+    Timer::ptr m_wheelRef;
+    /// 所属线程的定时器分片，nullptr 表示在共享队列中
+    std::atomic<TimerShard*> m_shard = {nullptr};
+    /// 是否有效，取消或非循环定时器触发后为 false
+    std::atomic<bool> m_active = {false};
+    /// 是否可复用定时器，触发后保留回调，用 arm() 重新设置
+    bool m_reusable = false;
+    /// 可复用定时器设置的到期时间，~0ull 表示未设置
+    std::atomic<uint64_t> m_armed = {~0ull};
+    /// 可复用定时器的同步操作是否已提交到所属线程的收件箱
+    std::atomic<bool> m_syncPending = {false};
+    /// 可复用定时器的同步操作，创建时分配，之后反复提交
+    TimerOp* m_syncOp = nullptr;
 private:
     /**
      * @brief 定时器比较仿函数
@@ -88,14 +148,199 @@ private:
 };
 
 
+/**
+ * @brief 定时器队列接口，TimerManager 在持有写锁时调用 (nextExpire / empty 在读锁下调用)
+ */
+class TimerQueue {
+public:
+    virtual ~TimerQueue() {}
+
+    /**
+     * @brief 加入定时器
+     * @return 新定时器是否早于此前最早的到期时间 (需要唤醒等待定时器的线程)
+     */
+    virtual bool insert(const Timer::ptr& timer) = 0;
+
+    /**
+     * @brief 删除定时器
+     * @return 定时器不在队列中时返回 false
+     */
+    virtual bool erase(const Timer::ptr& timer) = 0;
+
+    /**
+     * @brief 最早的到期时间 (毫秒时间戳)
+     * @return 没有定时器时返回 ~0ull，可以早于实际的最早到期时间 (调用者届时再检查一次)
+     */
+    virtual uint64_t nextExpire() = 0;
+
+    /**
+     * @brief 取出 now_ms 时已经到期的定时器
+     */
+    virtual void popExpired(uint64_t now_ms, std::vector<Timer::ptr>& expired) = 0;
+
+    /**
+     * @brief 取出全部定时器
+     */
+    virtual void popAll(std::vector<Timer::ptr>& timers) = 0;
+
+    /**
+     * @brief 是否没有定时器
+     */
+    virtual bool empty() const = 0;
+
+    /**
+     * @brief 定时器数量
+     */
+    virtual size_t size() const = 0;
+
+    /**
+     * @brief 输出队列状态
+     */
+    virtual std::ostream& dump(std::ostream& os) = 0;
+};
+
+/**
+ * @brief 按到期时间排序的 std::set，插入删除 O(log n)
+ */
+class SetTimerQueue : public TimerQueue {
+public:
+    bool insert(const Timer::ptr& timer) override;
+    bool erase(const Timer::ptr& timer) override;
+    uint64_t nextExpire() override;
+    void popExpired(uint64_t now_ms, std::vector<Timer::ptr>& expired) override;
+    void popAll(std::vector<Timer::ptr>& timers) override;
+    bool empty() const override { return m_timers.empty(); }
+    size_t size() const override { return m_timers.size(); }
+    std::ostream& dump(std::ostream& os) override;
+private:
+    /// 定时器集合
+    std::set<Timer::ptr, Timer::Comparator> m_timers;
+};
+
+/**
+ * @brief 分层时间轮，插入删除 O(1)
+ * @details LEVELS 层，每层 SLOTS 个槽，第 i 层一个槽跨 SLOTS^i 个刻度，
+ *          刻度为 tick_ms 毫秒，4 层 256 槽在 1ms 刻度下覆盖约 49 天，更远的定时器放在最高层，到时再重新放置
+ *          到期刻度向上取整，定时器不会提前触发，最多推迟一个刻度
+ *          高层的槽在时间走到该槽覆盖的范围时整体下放 (cascade)
+ *          每层一个位图记录非空槽，取下一个到期时间和跳过空刻度只需扫描位图
+ *          已经到期的定时器放在单独的链表，下一次 popExpired 立即取出
+ */
+class WheelTimerQueue : public TimerQueue {
+public:
+    /// 层数
+    static const int LEVELS = 4;
+    /// 每层槽数的位数
+    static const int SLOT_BITS = 8;
+    /// 每层槽数
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    /**
+     * @brief 构造函数
+     * @param tick_ms 刻度 (毫秒)
+     */
+    WheelTimerQueue(uint64_t tick_ms = 1);
+
+    /**
+     * @brief 析构函数，释放还在时间轮中的定时器
+     */
+    ~WheelTimerQueue();
+
+    bool insert(const Timer::ptr& timer) override;
+    bool erase(const Timer::ptr& timer) override;
+    uint64_t nextExpire() override;
+    void popExpired(uint64_t now_ms, std::vector<Timer::ptr>& expired) override;
+    void popAll(std::vector<Timer::ptr>& timers) override;
+    bool empty() const override { return m_size == 0; }
+    size_t size() const override { return m_size; }
+    std::ostream& dump(std::ostream& os) override;
+
+private:
+    /// 已到期定时器链表所在的层
+    static const int DUE_LEVEL = LEVELS;
+
+    /**
+     * @brief 按到期刻度放进对应的层和槽
+     */
+    void place(Timer* timer);
+
+    /**
+     * @brief 链表头，level 为 DUE_LEVEL 时是已到期链表
+     */
+    Timer*& head(int level, int slot) {
+        return level == DUE_LEVEL ? m_due : m_slots[level][slot];
+    }
+
+    /**
+     * @brief 挂到链表头
+     */
+    void link(Timer* timer, int level, int slot);
+
+    /**
+     * @brief 从所在链表摘下
+     */
+    void unlink(Timer* timer);
+
+    /**
+     * @brief 把高层的一个槽下放到低层
+     */
+    void cascade(int level, int slot);
+
+    /**
+     * @brief 从 from 开始循环查找下一个非空槽
+     * @return 与 from 的距离，没有非空槽返回 -1
+     */
+    int findSlot(int level, int from) const;
+
+    /**
+     * @brief 定时器的到期刻度
+     */
+    uint64_t expireTick(const Timer* timer) const {
+        return (timer->m_next + m_tick - 1) / m_tick;
+    }
+
+private:
+    /// 刻度 (毫秒)
+    uint64_t m_tick;
+    /// 下一个要处理的刻度
+    uint64_t m_current = 0;
+    /// 定时器数量
+    size_t m_size = 0;
+    /// 各层各槽的链表头
+    Timer* m_slots[LEVELS][SLOTS] = {};
+    /// 已到期的定时器链表
+    Timer* m_due = nullptr;
+    /// 各层非空槽的位图
+    uint64_t m_bitmap[LEVELS][SLOTS / 64] = {};
+    /// 上次计算的最早到期时间，插入更早的定时器时需要唤醒
+    std::atomic<uint64_t> m_earliest = {~0ull};
+    /// 下放次数
+    uint64_t m_cascades = 0;
+};
+
+/**
+ * @brief 定时器管理器
+ * @details 调用 attachTimerThread() 的线程拥有自己的定时器分片 (独立的定时器队列)，
+ *          在这些线程上添加的定时器放进本线程的分片，增删和到期处理都不加锁，到期回调在本线程调度
+ *          其他线程对分片中定时器的取消/刷新/重置通过分片的收件箱 (无锁链表) 交给所属线程执行
+ *          其他线程添加的定时器，以及线程 detachTimerThread() 时留下的定时器放在加锁的共享队列，
+ *          所有处理定时器的线程都会检查共享队列
+ *          timer.per_thread 为 false 时不创建分片，所有定时器都在共享队列
+ *          到期时间使用单调时钟 (GetMonotonicMS)，修改系统时间不影响定时器
+ */
 class TimerManager {
     friend class Timer;
 public:
     /// 读写锁类型
     typedef RWMutex RWMutexType;
 
+    /// addTimer 的 slack 取该值时使用配置 timer.slack_ms
+    static const uint64_t DEFAULT_SLACK = ~0ull;
+
     /**
      * @brief 构造函数
+     * @details 按配置 timer.backend 选择定时器队列:
+     *          wheel 为分层时间轮 (刻度 timer.wheel_tick_ms)，set 为按到期时间排序的 std::set
      */
     TimerManager();
 
@@ -109,9 +354,13 @@ public:
      * @param ms 定时器执行间隔时间
      * @param cb 定时器回调函数
      * @param recurring 是否循环定时器
+     * @param slack 允许推迟的毫秒数，默认使用配置 timer.slack_ms
+     * @details slack 大于 1 时到期时间向上取整到 slack 的整数倍，
+     *          到期时间相近的定时器落在同一时刻，一次唤醒、一次 listExpiredCb 一起处理
+     *          定时器最多推迟 slack - 1 毫秒，不会提前；各处使用的 slack 互为倍数 (如 10 / 100 / 1000) 时合并效果最好
      */
     Timer::ptr addTimer(uint64_t ms, std::function<void()> cb,
-                        bool recurring = false);
+                        bool recurring = false, uint64_t slack = DEFAULT_SLACK);
 
     /**
      * @brief 添加条件定时器
@@ -119,19 +368,43 @@ public:
      * @param cb 定时器回调函数
      * @param weak_cond 条件
      * @param recurring 是否循环
+     * @param slack 允许推迟的毫秒数，见 addTimer
      */
     Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb,
                                  std::weak_ptr<void> weak_cond,
-                                 bool recurring = false);
+                                 bool recurring = false,
+                                 uint64_t slack = DEFAULT_SLACK);
+
+    /**
+     * @brief 添加可复用定时器，创建后未设置
+     * @param cb 定时器回调函数，每次触发执行一次
+     * @param slack 允许推迟的毫秒数，见 addTimer
+     * @details 用于反复设置、大多在到期前取消的超时 (如 socket 读写超时)
+     *          Timer::arm() / Timer::cancle() 只修改定时器自身的状态，
+     *          在所属线程上直接修改分片的队列，在其他线程上提交定时器自带的同步操作
+     * @attention 只有时间轮后端 (timer.backend=wheel) 的 arm/cancle 不分配内存，
+     *            set 后端每次加入/移出队列仍会分配/释放一个 std::set 节点
+     *          同步操作未执行前的多次修改合并为一次，所属线程按最后一次设置处理
+     */
+    Timer::ptr addReusableTimer(std::function<void()> cb, uint64_t slack = DEFAULT_SLACK);
 
     /**
      * @brief 到最近一个定时器执行的间隔时间
+     * @details 只考虑当前线程的分片和共享队列
      */
     uint64_t getNextTimer();
 
+    /**
+     * @brief 最近一个定时器的到期时间 (GetMonotonicMS 的毫秒时间戳)，没有定时器时返回 ~0ull
+     * @details 只考虑当前线程的分片和共享队列，可能早于实际的到期时间 (见 TimerQueue::nextExpire)
+     */
+    uint64_t getNextDeadline();
+
     /**
      * @brief 获取需要执行（过期）的定时器回调函数列表
      * @param cbs 回调函数数组
+     * @details 取当前线程的分片和共享队列中到期的定时器
+     *          按当前线程缓存的时间 (GetCachedMS) 判断是否到期，调用前应刷新缓存
      */
     void listExpiredCb(std::vector<std::function<void()>>& cbs);
 
@@ -140,6 +413,22 @@ public:
      */
     bool hasTimer();
 
+    /**
+     * @brief 输出定时器队列状态
+     */
+    std::ostream& dumpTimers(std::ostream& os);
+
+    /**
+     * @brief 当前线程开始处理本管理器的定时器，分配线程的定时器分片
+     * @attention 之后线程必须定期调用 getNextTimer() / listExpiredCb()，退出前调用 detachTimerThread()
+     */
+    void attachTimerThread();
+
+    /**
+     * @brief 当前线程不再处理定时器，分片中的定时器移到共享队列
+     */
+    void detachTimerThread();
+
 protected:
     /**
      * @brief 当有新的定时器插入到定时器的首部， 执行该函数
@@ -147,26 +436,78 @@ protected:
     virtual void onTimerInsertedAtFront() = 0;
 
     /**
-     * @brief 将定时器添加到管理器 m_timers 集合中
+     * @brief 其他线程重置了 thread 线程分片中的定时器，可能需要提前唤醒该线程
+     */
+    virtual void onTimerThreadNotify(int thread) { onTimerInsertedAtFront(); }
+
+    /**
+     * @brief 取当前线程分片中已到期的定时器回调，共享队列非空时也检查共享队列
+     * @details 不读时钟，按当前线程缓存的时间 (GetCachedMS) 判断，用于调度循环中频繁检查
+     *          (忙碌的线程不进入 idle，共享队列中的定时器不能只靠 idle 处理)
+     */
+    void listLocalExpiredCb(std::vector<std::function<void()>>& cbs);
+
+    /**
+     * @brief 将定时器添加到共享队列中
      * @param val
      * @param lock
      */
     void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
 private:
     /**
-     * @brief 检测服务器时间是否被调
-     * @param now_ms
-     * @return
+     * @brief 返回当前线程在本管理器的分片，没有时返回 nullptr
+     */
+    TimerShard* localShard() const;
+
+    /**
+     * @brief 取消/刷新/重置/同步定时器，由 Timer 调用
+     * @param type 操作类型，见 TimerOp
      */
-    bool detectClockRollover(uint64_t now_ms);
+    bool modifyTimer(Timer::ptr timer, int type, uint64_t ms, bool from_now);
+
+    /**
+     * @brief 在持有 queue 的线程上执行操作 (分片所属线程，或持有写锁)
+     * @param[out] at_front 重新插入后是否成为最早到期的定时器
+     */
+    static bool ApplyOp(TimerQueue* queue, const TimerOp& op, bool& at_front);
+
+    /**
+     * @brief 从收件箱取下的操作
+     * @details 普通操作释放节点；同步操作的节点还给定时器，先清除提交标记再读取 m_armed，
+     *          之后的修改会重新提交
+     */
+    static TimerOp TakeOp(TimerOp* node);
+
+    /**
+     * @brief 执行分片收件箱中的操作
+     */
+    void drainShard(TimerShard* shard);
+
+    /**
+     * @brief 取出分片中 now_ms 时到期的定时器回调
+     */
+    void popShard(TimerShard* shard, uint64_t now_ms, std::vector<std::function<void()>>& cbs);
+
+    /**
+     * @brief 取出共享队列中 now_ms 时到期的定时器回调
+     */
+    void popShared(uint64_t now_ms, std::vector<std::function<void()>>& cbs);
+
+    /**
+     * @brief 处理从 queue 取出的到期定时器，循环定时器重新加入 queue
+     */
+    void collectExpired(TimerQueue* queue, uint64_t now_ms, std::vector<Timer::ptr>& expired
+                        , std::vector<std::function<void()>>& cbs);
 private:
     RWMutexType m_mutex;
-    /// 定时器集合
-    std::set<Timer::ptr, Timer::Comparator> m_timers;
+    /// 共享定时器队列，按配置 timer.backend 创建
+    TimerQueue* m_queue = nullptr;
+    /// 共享队列中的定时器数量，为 0 时处理定时器不加锁
+    std::atomic<size_t> m_sharedCount = {0};
+    /// 线程分片 (脱离的分片留给之后的线程复用)
+    std::vector<TimerShard*> m_shards;
     /// 是否触发 onTimerInsertedAtFront() 回调函数
-    bool m_tickled = false;
-    /// 上次执行时间，用于检测时间滚动
-    uint64_t m_previouseTime = 0;
+    std::atomic<bool> m_tickled = {false};
 };
 
 
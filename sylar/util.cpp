@@ -12,6 +12,7 @@
 
 #include <execinfo.h>
 #include <sys/time.h>
+#include <time.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <string.h>
@@ -19,11 +20,17 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
+#include <signal.h>
+#include <errno.h>
+#include <atomic>
+#include <algorithm>
+#include <sched.h>
 
 //#include <google/protobuf/unknown_field_set.h>
 
 #include "log.h"
 #include "fiber.h"
+#include "mutex.h"
 
 
 namespace sylar{
@@ -34,6 +41,21 @@ pid_t GetThreadId(){
     return syscall(SYS_gettid);
 }
 
+int GetCurrentCpu(int* node) {
+    unsigned cpu = 0;
+    unsigned numa = 0;
+    if(syscall(SYS_getcpu, &cpu, &numa, nullptr)) {
+        if(node) {
+            *node = -1;
+        }
+        return -1;
+    }
+    if(node) {
+        *node = numa;
+    }
+    return cpu;
+}
+
 uint32_t GetFiberId(){
     return sylar::Fiber::GetFiberId();
 }
@@ -75,6 +97,99 @@ void Backtrace(std::vector<std::string>& bt, int size, int skip) {
     free(array);
 }
 
+/// 把栈帧地址转换成符号
+static void BacktraceSymbols(std::vector<std::string>& bt, void** frames, int count) {
+    char** strings = backtrace_symbols(frames, count);
+    if(strings == nullptr) {
+        SYLAR_LOG_ERROR(g_logger) << "backtrace_synbols error";
+        return;
+    }
+    for(int i = 0; i < count; ++i) {
+        bt.push_back(strings[i]);
+    }
+    free(strings);
+}
+
+/**
+ * @brief 跨线程采样的结果，由 s_sample_mutex 保证同一时刻只有一次采样
+ * @details 每次采样有一个序号，随信号带给目标线程；信号处理函数先把 pending 从自己的序号
+ *          换成 0 认领这次采样再写 frames，超时后才到达的旧信号认领失败，不会写入下一次采样的结果
+ */
+struct ThreadStackSample {
+    /// 正在等待的采样序号，0 表示没有 (已被认领或已放弃)
+    std::atomic<uint64_t> pending = {0};
+    /// 信号处理函数已经写完 frames 的采样序号
+    std::atomic<uint64_t> done = {0};
+    /// 栈帧数
+    int count = 0;
+    /// 栈帧地址
+    void* frames[128];
+};
+
+static ThreadStackSample s_thread_sample;
+static Mutex s_sample_mutex;
+/// 最近一次采样的序号，由 s_sample_mutex 保护
+static uint64_t s_sample_seq = 0;
+
+/// 运行在目标线程上，只调用 backtrace，不分配内存
+static void OnSampleSignal(int, siginfo_t* info, void*) {
+    int saved = errno;
+    uint64_t seq = (uint64_t)(uintptr_t)info->si_value.sival_ptr;
+    uint64_t expected = seq;
+    if(seq && s_thread_sample.pending.compare_exchange_strong(expected, 0
+                                                               , std::memory_order_acquire)) {
+        s_thread_sample.count = ::backtrace(s_thread_sample.frames, 128);
+        s_thread_sample.done.store(seq, std::memory_order_release);
+    }
+    errno = saved;
+}
+
+bool ThreadBacktrace(pthread_t thread, std::vector<std::string>& bt, int size
+                     , uint64_t timeout_ms) {
+    Mutex::Lock lock(s_sample_mutex);
+    static bool s_installed = false;
+    if(!s_installed) {
+        // backtrace 第一次调用时会加载 libgcc 并分配内存，先在本线程调用一次
+        void* warm[1];
+        ::backtrace(warm, 1);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = &OnSampleSignal;
+        sa.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGRTMIN + 3, &sa, nullptr);
+        s_installed = true;
+    }
+
+    uint64_t seq = ++s_sample_seq;
+    s_thread_sample.pending.store(seq, std::memory_order_release);
+    union sigval value;
+    value.sival_ptr = (void*)(uintptr_t)seq;
+    if(pthread_sigqueue(thread, SIGRTMIN + 3, value)) {
+        s_thread_sample.pending.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    uint64_t deadline = GetMonotonicUS() + timeout_ms * 1000;
+    while(s_thread_sample.done.load(std::memory_order_acquire) != seq) {
+        if(GetMonotonicUS() > deadline) {
+            // 放弃这次采样；认领失败说明信号处理函数已经在写 frames，等它写完
+            uint64_t expected = seq;
+            if(s_thread_sample.pending.compare_exchange_strong(expected, 0)) {
+                return false;
+            }
+        }
+        // 不用 usleep，调度线程中 usleep 被 hook 会切走协程而本函数持有锁
+        sched_yield();
+    }
+    // 跳过信号处理函数和内核插入的 sigreturn 栈帧
+    int skip = 2;
+    int count = std::min(s_thread_sample.count, skip + size);
+    if(count > skip) {
+        BacktraceSymbols(bt, s_thread_sample.frames + skip, count - skip);
+    }
+    return true;
+}
+
 std::string BacktraceToString(int size, int skip, const std::string& prefix){
     std::vector<std::string> bt;
     Backtrace(bt, size, skip);
@@ -92,12 +207,43 @@ uint64_t GetCurrentMS(){
     return tv.tv_sec * 1000ul + tv.tv_usec / 1000;
 }
 
-uint64_t GetCurrenUS(){
+uint64_t GetCurrentUS(){
     struct timeval tv;
     gettimeofday(&tv, nullptr);
     return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
 }
 
+/// 当前线程最近一次读到的单调时钟毫秒，0 表示还没读过
+static thread_local uint64_t t_cached_ms = 0;
+/// GetMonotonicMS 使用的时钟
+static std::atomic<clockid_t> s_ms_clock = {CLOCK_MONOTONIC};
+
+uint64_t GetMonotonicMS() {
+    struct timespec ts;
+    clock_gettime(s_ms_clock.load(std::memory_order_relaxed), &ts);
+    t_cached_ms = ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+    return t_cached_ms;
+}
+
+uint64_t GetMonotonicUS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t us = ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+    t_cached_ms = us / 1000;
+    return us;
+}
+
+uint64_t GetCachedMS() {
+    if(!t_cached_ms) {
+        return GetMonotonicMS();
+    }
+    return t_cached_ms;
+}
+
+void SetCoarseClock(bool v) {
+    s_ms_clock.store(v ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, std::memory_order_relaxed);
+}
+
 std::string Time2Str(time_t ts, const std::string& format) {
     struct tm tm;
     localtime_r(&ts, &tm);
@@ -40,6 +40,13 @@ pid_t GetThreadId();
  */
 uint32_t GetFiberId();
 
+/**
+ * @brief 返回当前线程所在的 CPU
+ * @param[out] node 非空时返回该 CPU 所属的 NUMA 节点
+ * @return 失败返回 -1
+ */
+int GetCurrentCpu(int* node = nullptr);
+
 /**
  * @brief 获取当前的 调用栈
  * @param bt 保存调用栈
@@ -48,6 +55,20 @@ uint32_t GetFiberId();
  */
 void Backtrace(std::vector<std::string>& bt, int size = 64, int skip = 1);
 
+/**
+ * @brief 获取指定线程当前的调用栈
+ * @details 向目标线程发送 SIGRTMIN+3，由目标线程在信号处理函数中记录调用栈
+ *          同一时刻只采样一个线程，目标线程被 ptrace 停住或屏蔽了该信号时等待超时
+ *          结果不包含信号处理函数本身的栈帧，第一层是目标线程被打断的位置
+ * @param thread 目标线程
+ * @param bt 保存调用栈
+ * @param size 最多返回层数
+ * @param timeout_ms 等待目标线程响应的时间 (毫秒)
+ * @return 超时返回 false
+ */
+bool ThreadBacktrace(pthread_t thread, std::vector<std::string>& bt, int size = 64
+                     , uint64_t timeout_ms = 100);
+
 /**
  * @brief 获取当前栈信息的字符串
  * @param size 栈的最大层数
@@ -66,6 +87,31 @@ uint64_t GetCurrentMS();
  */
 uint64_t GetCurrentUS();
 
+/**
+ * @brief 获取单调时钟的毫秒 (系统启动以来，不受修改系统时间影响)，同时刷新当前线程的缓存时间
+ * @details 粗粒度模式 (SetCoarseClock) 下读取 CLOCK_MONOTONIC_COARSE，
+ *          开销更小但精度只有内核的一个 tick (通常 1~4ms)，可能落后精确时钟几毫秒
+ */
+uint64_t GetMonotonicMS();
+
+/**
+ * @brief 获取单调时钟的微秒，始终是精确时钟，同时刷新当前线程的缓存时间
+ */
+uint64_t GetMonotonicUS();
+
+/**
+ * @brief 获取当前线程缓存的单调时钟毫秒，不读时钟
+ * @details 缓存是本线程最近一次 GetMonotonicMS/GetMonotonicUS 的结果，
+ *          调度线程每执行一个任务、IOManager 每轮 idle 循环都会刷新
+ *          线程从未读过时钟时读一次时钟
+ */
+uint64_t GetCachedMS();
+
+/**
+ * @brief 设置 GetMonotonicMS 是否使用粗粒度时钟 (配置 clock.coarse)
+ */
+void SetCoarseClock(bool v);
+
 std::string ToUpper(const std::string& name);
 
 std::string ToLower(const std::string& name);
@@ -0,0 +1,574 @@
+/**
+  ******************************************************************************
+  * @file           : sylar_bench.cpp
+  * @author         : 18483
+  * @brief          : 协程、调度器、定时器、socket IO、时钟、日志、ByteArray、HTTP 解析的性能基准
+  * @attention      : 结果以 JSON 输出到标准输出，日志只输出 ERROR
+  *                   用法: sylar_bench [--filter=子串] [--min-ms=每项最少运行毫秒]
+  * @date           : 2025/4/19
+  ******************************************************************************
+  */
+
+
+#include "../sylar/sylar.h"
+#include "../sylar/bytearray.h"
+#include "../sylar/histogram.h"
+#include "../sylar/fd_manager.h"
+#include "../sylar/hook.h"
+#include "../sylar/http/http_parser.h"
+
+#include <time.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <iostream>
+
+/// 单项结果
+struct BenchResult {
+    /// 名称
+    std::string name;
+    /// 操作次数
+    uint64_t ops = 0;
+    /// 总耗时 (纳秒)
+    uint64_t ns = 0;
+    /// 附加指标
+    std::vector<std::pair<std::string, double> > extra;
+};
+
+/// 执行 n 次操作，把耗时写入 r.ns
+typedef std::function<void(uint64_t n, BenchResult& r)> BenchFunc;
+
+static uint64_t s_min_ns = 200 * 1000 * 1000;
+static std::string s_filter;
+static std::vector<BenchResult> s_results;
+
+static uint64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool Selected(const std::string& name) {
+    return s_filter.empty() || name.find(s_filter) != std::string::npos;
+}
+
+/// 逐步加大次数，直到一轮耗时不少于 s_min_ns
+static void Run(const std::string& name, BenchFunc func, uint64_t max_ops = 100000000) {
+    if(!Selected(name)) {
+        return;
+    }
+    uint64_t n = 16;
+    BenchResult r;
+    while(true) {
+        r = BenchResult();
+        r.name = name;
+        r.ops = n;
+        func(n, r);
+        if(r.ns >= s_min_ns || n >= max_ops) {
+            break;
+        }
+        uint64_t next = r.ns ? (uint64_t)(n * 1.2 * s_min_ns / r.ns) : n * 100;
+        n = std::min(std::max(next, n * 2), max_ops);
+    }
+    s_results.push_back(r);
+}
+
+/// 次数固定 (准备工作较重，例如需要启动线程)
+static void RunOnce(const std::string& name, BenchFunc func, uint64_t n) {
+    if(!Selected(name)) {
+        return;
+    }
+    BenchResult r;
+    r.name = name;
+    r.ops = n;
+    func(n, r);
+    s_results.push_back(r);
+}
+
+static void AddPercentiles(BenchResult& r, const sylar::Histogram& h) {
+    sylar::Histogram::Snapshot s;
+    h.snapshot(s);
+    // 对数分桶，分位数为所在桶的上界
+    r.extra.push_back(std::make_pair("p50_ns", (double)s.percentile(0.5)));
+    r.extra.push_back(std::make_pair("p99_ns", (double)s.percentile(0.99)));
+    r.extra.push_back(std::make_pair("max_ns", (double)s.max));
+}
+
+/************************************ fiber ************************************/
+
+static void Nop() {
+}
+
+static void BenchFiberCreate(uint64_t n, BenchResult& r) {
+    sylar::Fiber::GetThis();
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        sylar::Fiber::ptr fiber(new sylar::Fiber(&Nop, 0, true));
+    }
+    r.ns = NowNs() - begin;
+}
+
+static void BenchFiberLifecycle(uint64_t n, BenchResult& r) {
+    sylar::Fiber::GetThis();
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        sylar::Fiber::ptr fiber(new sylar::Fiber(&Nop, 0, true));
+        fiber->call();
+    }
+    r.ns = NowNs() - begin;
+}
+
+static uint64_t s_switch_rounds = 0;
+
+static void SwitchPing() {
+    for(uint64_t i = 0; i < s_switch_rounds; ++i) {
+        sylar::Fiber::GetThis()->back();
+    }
+}
+
+/// 每次操作为一次上下文切换 (call 与 back 各算一次)
+static void BenchFiberSwitch(uint64_t n, BenchResult& r) {
+    sylar::Fiber::GetThis();
+    s_switch_rounds = n / 2;
+    sylar::Fiber::ptr fiber(new sylar::Fiber(&SwitchPing, 0, true));
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i <= s_switch_rounds; ++i) {
+        fiber->call();
+    }
+    r.ns = NowNs() - begin;
+    r.ops = s_switch_rounds * 2;
+}
+
+/******************************** scheduler ************************************/
+
+/// 单线程调度器中协程反复 YiledToReady，即 swapOut + 重新入队 + swapIn
+static void BenchSchedulerYield(uint64_t n, BenchResult& r) {
+    sylar::Scheduler sc(1, false, "bench_yield");
+    sc.start();
+    std::atomic<uint64_t> ns = {0};
+    sc.schedule([n, &ns](){
+        uint64_t begin = NowNs();
+        for(uint64_t i = 0; i < n; ++i) {
+            sylar::Fiber::YiledToReady();
+        }
+        ns = NowNs() - begin;
+    });
+    sc.stop();
+    r.ns = ns;
+}
+
+/// 外部线程投递一个任务，记录到工作线程开始执行的延迟，执行完再投递下一个
+static void BenchScheduleLatency(uint64_t n, BenchResult& r) {
+    sylar::Scheduler sc(2, false, "bench_lat");
+    sc.start();
+    sylar::Histogram hist;
+    std::atomic<uint64_t> latency = {0};
+    uint64_t total = 0;
+    for(uint64_t i = 0; i < n; ++i) {
+        uint64_t posted = NowNs();
+        latency.store(0);
+        sc.schedule([posted, &latency](){
+            latency.store(NowNs() - posted + 1);
+        });
+        uint64_t v = 0;
+        while(!(v = latency.load())) {
+            sched_yield();
+        }
+        hist.record(v - 1);
+        total += v - 1;
+    }
+    sc.stop();
+    r.ns = total;
+    AddPercentiles(r, hist);
+}
+
+/// 外部线程连续投递 n 个任务，到全部执行完的吞吐
+static void BenchScheduleThroughput(uint64_t n, BenchResult& r) {
+    sylar::Scheduler sc(4, false, "bench_tp");
+    sc.start();
+    std::atomic<uint64_t> done = {0};
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        sc.schedule([&done](){
+            ++done;
+        });
+    }
+    while(done < n) {
+        sched_yield();
+    }
+    r.ns = NowNs() - begin;
+    sc.stop();
+    r.extra.push_back(std::make_pair("threads", 4.0));
+}
+
+/********************************** timer **************************************/
+
+class BenchTimerManager : public sylar::TimerManager {
+public:
+    using sylar::TimerManager::listLocalExpiredCb;
+protected:
+    void onTimerInsertedAtFront() override {}
+};
+
+/// local 为 true 时本线程使用自己的定时器分片 (IOManager 工作线程的情况)，否则使用加锁的共享队列
+static void TimerAdd(uint64_t n, BenchResult& r, bool local) {
+    BenchTimerManager tm;
+    if(local) {
+        tm.attachTimerThread();
+    }
+    std::vector<sylar::Timer::ptr> timers;
+    timers.reserve(n);
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        timers.push_back(tm.addTimer(1000 + (i * 7919) % 100000, &Nop));
+    }
+    r.ns = NowNs() - begin;
+    tm.detachTimerThread();
+}
+
+static void TimerCancel(uint64_t n, BenchResult& r, bool local) {
+    BenchTimerManager tm;
+    if(local) {
+        tm.attachTimerThread();
+    }
+    std::vector<sylar::Timer::ptr> timers;
+    timers.reserve(n);
+    for(uint64_t i = 0; i < n; ++i) {
+        timers.push_back(tm.addTimer(1000 + (i * 7919) % 100000, &Nop));
+    }
+    uint64_t begin = NowNs();
+    for(auto& i : timers) {
+        i->cancle();
+    }
+    r.ns = NowNs() - begin;
+    tm.detachTimerThread();
+}
+
+static void BenchTimerAdd(uint64_t n, BenchResult& r) {
+    TimerAdd(n, r, false);
+}
+
+static void BenchTimerCancel(uint64_t n, BenchResult& r) {
+    TimerCancel(n, r, false);
+}
+
+static void BenchTimerAddLocal(uint64_t n, BenchResult& r) {
+    TimerAdd(n, r, true);
+}
+
+static void BenchTimerCancelLocal(uint64_t n, BenchResult& r) {
+    TimerCancel(n, r, true);
+}
+
+/// 一次 IO 等待的超时：设置后在到期前取消，每次新建定时器
+static void BenchTimerAddCancelLocal(uint64_t n, BenchResult& r) {
+    BenchTimerManager tm;
+    tm.attachTimerThread();
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        tm.addTimer(1000, &Nop)->cancle();
+    }
+    r.ns = NowNs() - begin;
+    tm.detachTimerThread();
+}
+
+/// 同上，复用同一个定时器 (hook 中每个 fd 的读/写超时)
+static void BenchTimerRearmLocal(uint64_t n, BenchResult& r) {
+    BenchTimerManager tm;
+    tm.attachTimerThread();
+    sylar::Timer::ptr timer = tm.addReusableTimer(&Nop);
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        timer->arm(1000);
+        timer->cancle();
+    }
+    r.ns = NowNs() - begin;
+    tm.detachTimerThread();
+}
+
+/// 调度线程每取一个任务检查一次本线程的定时器，定时器都没有到期
+static void BenchTimerPollLocal(uint64_t n, BenchResult& r) {
+    BenchTimerManager tm;
+    tm.attachTimerThread();
+    tm.addTimer(1000000, &Nop);
+    std::vector<std::function<void()> > cbs;
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        tm.listLocalExpiredCb(cbs);
+    }
+    r.ns = NowNs() - begin;
+    SYLAR_ASSERT(cbs.empty());
+    tm.detachTimerThread();
+}
+
+/// 加入 n 个已到期的定时器，一次取出全部回调
+static void BenchTimerExpire(uint64_t n, BenchResult& r) {
+    BenchTimerManager tm;
+    for(uint64_t i = 0; i < n; ++i) {
+        tm.addTimer(0, &Nop);
+    }
+    std::vector<std::function<void()> > cbs;
+    uint64_t begin = NowNs();
+    tm.listExpiredCb(cbs);
+    r.ns = NowNs() - begin;
+    SYLAR_ASSERT(cbs.size() == n);
+}
+
+/************************************* io **************************************/
+
+/// 16 对 socketpair 上的协程 ping-pong，一端 send + recv，另一端回显，n 为总往返次数
+static void SocketPingPong(uint64_t n, BenchResult& r, const std::string& backend
+                           , bool persistent_events, bool multi_reactor = false) {
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue(backend);
+    sylar::Config::Lookup<bool>("iomanager.persistent_events")->setValue(persistent_events);
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(multi_reactor);
+    const uint64_t pairs = 16;
+    const uint64_t rounds = n / pairs;
+    std::atomic<uint64_t> done = {0};
+    sylar::IOManager iom(4, false, "bench_io");
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < pairs; ++i) {
+        int fds[2];
+        SYLAR_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        int server = fds[0];
+        int client = fds[1];
+        iom.schedule([server](){
+            char buf[64];
+            ssize_t rt;
+            while((rt = recv(server, buf, sizeof(buf), 0)) > 0) {
+                send(server, buf, rt, 0);
+            }
+            close(server);
+        });
+        iom.schedule([client, rounds, &done](){
+            char buf[64] = {0};
+            for(uint64_t j = 0; j < rounds; ++j) {
+                send(client, buf, sizeof(buf), 0);
+                recv(client, buf, sizeof(buf), 0);
+            }
+            close(client);
+            ++done;
+        });
+    }
+    while(done < pairs) {
+        usleep(1000);
+    }
+    r.ns = NowNs() - begin;
+    r.ops = rounds * pairs;
+    r.extra.push_back(std::make_pair("threads", 4.0));
+    r.extra.push_back(std::make_pair("io_uring", iom.hasUring() ? 1.0 : 0.0));
+    r.extra.push_back(std::make_pair("multi_reactor", iom.isMultiReactor() ? 1.0 : 0.0));
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("epoll");
+    sylar::Config::Lookup<bool>("iomanager.persistent_events")->setValue(false);
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(false);
+}
+
+static void BenchSocketPingPongEpoll(uint64_t n, BenchResult& r) {
+    SocketPingPong(n, r, "epoll", false);
+}
+
+static void BenchSocketPingPongEpollPersistent(uint64_t n, BenchResult& r) {
+    SocketPingPong(n, r, "epoll", true);
+}
+
+static void BenchSocketPingPongEpollMultiReactor(uint64_t n, BenchResult& r) {
+    SocketPingPong(n, r, "epoll", true, true);
+}
+
+static void BenchSocketPingPongUring(uint64_t n, BenchResult& r) {
+    SocketPingPong(n, r, "io_uring", false);
+}
+
+/************************************ clock ************************************/
+
+static void Clock(uint64_t n, BenchResult& r, uint64_t (*func)()) {
+    uint64_t sum = 0;
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        sum += func();
+    }
+    r.ns = NowNs() - begin;
+    SYLAR_ASSERT(sum);
+}
+
+static void BenchClockRealtime(uint64_t n, BenchResult& r) {
+    Clock(n, r, &sylar::GetCurrentMS);
+}
+
+static void BenchClockMonotonic(uint64_t n, BenchResult& r) {
+    Clock(n, r, &sylar::GetMonotonicMS);
+}
+
+static void BenchClockCoarse(uint64_t n, BenchResult& r) {
+    sylar::SetCoarseClock(true);
+    Clock(n, r, &sylar::GetMonotonicMS);
+    sylar::SetCoarseClock(false);
+}
+
+static void BenchClockCached(uint64_t n, BenchResult& r) {
+    Clock(n, r, &sylar::GetCachedMS);
+}
+
+/************************************* log *************************************/
+
+/// 按 pattern 格式化一条日志 (不含输出)
+static void LogFormat(uint64_t n, BenchResult& r, const std::string& pattern) {
+    sylar::Logger::ptr logger = SYLAR_LOG_NAME("bench");
+    sylar::LogFormatter::ptr fmt(new sylar::LogFormatter(pattern));
+    sylar::LogEvent::ptr event(new sylar::LogEvent(logger, sylar::LogLevel::INFO, __FILE__, __LINE__
+                , 0, sylar::GetThreadId(), sylar::GetFiberId(), time(0), "bench"));
+    event->getSS() << "hello world";
+    std::stringstream ss;
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        ss.seekp(0);
+        fmt->format(ss, logger, sylar::LogLevel::INFO, event);
+    }
+    r.ns = NowNs() - begin;
+}
+
+/// 默认格式
+static void BenchLogFormat(uint64_t n, BenchResult& r) {
+    LogFormat(n, r, "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n");
+}
+
+/// 只有时间
+static void BenchLogFormatTime(uint64_t n, BenchResult& r) {
+    LogFormat(n, r, "%d{%Y-%m-%d %H:%M:%S}%n");
+}
+
+/******************************** bytearray ************************************/
+
+/// 覆盖 1~10 字节各种编码长度
+static uint64_t VarintValue(uint64_t i) {
+    return (i * 0x9e3779b97f4a7c15ull) >> (i % 64);
+}
+
+static void BenchVarintEncode(uint64_t n, BenchResult& r) {
+    sylar::ByteArray ba(4096);
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        ba.writeUint64(VarintValue(i));
+    }
+    r.ns = NowNs() - begin;
+    r.extra.push_back(std::make_pair("bytes_per_value", (double)ba.getSize() / n));
+}
+
+static void BenchVarintDecode(uint64_t n, BenchResult& r) {
+    sylar::ByteArray ba(4096);
+    for(uint64_t i = 0; i < n; ++i) {
+        ba.writeUint64(VarintValue(i));
+    }
+    ba.setPosition(0);
+    uint64_t sum = 0;
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        sum += ba.readUint64();
+    }
+    r.ns = NowNs() - begin;
+    SYLAR_ASSERT(ba.getReadSize() == 0);
+    (void)sum;
+}
+
+/*********************************** http **************************************/
+
+static const char s_http_request[] = "GET /api/v1/users/12345?fields=name,email HTTP/1.1\r\n"
+                                     "Host: www.sylar.top\r\n"
+                                     "User-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\n"
+                                     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+                                     "Accept-Encoding: gzip, deflate\r\n"
+                                     "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+                                     "Cookie: session=0123456789abcdef; theme=dark\r\n"
+                                     "Connection: keep-alive\r\n\r\n";
+
+static void BenchHttpParse(uint64_t n, BenchResult& r) {
+    size_t len = sizeof(s_http_request) - 1;
+    std::string buf(s_http_request, len);
+    uint64_t begin = NowNs();
+    for(uint64_t i = 0; i < n; ++i) {
+        // execute 会移动未解析的数据，每次从原文拷贝
+        memcpy(&buf[0], s_http_request, len);
+        sylar::http::HttpRequestParser parser;
+        parser.execute(&buf[0], len);
+        SYLAR_ASSERT(parser.isFinished() && !parser.hasError());
+    }
+    r.ns = NowNs() - begin;
+    r.extra.push_back(std::make_pair("mb_per_sec", r.ns ? (double)len * n * 1000 / r.ns : 0));
+}
+
+/*********************************** main **************************************/
+
+static void PrintJson(std::ostream& os) {
+    os << "{" << std::endl
+       << "  \"version\": \"sylar/1.0.0\"," << std::endl
+#ifdef SYLAR_FIBER_ASM
+       << "  \"fiber_backend\": \"asm\"," << std::endl
+#else
+       << "  \"fiber_backend\": \"ucontext\"," << std::endl
+#endif
+       << "  \"min_ms\": " << s_min_ns / 1000000 << "," << std::endl
+       << "  \"benchmarks\": [" << std::endl;
+    for(size_t i = 0; i < s_results.size(); ++i) {
+        const BenchResult& r = s_results[i];
+        double ns_per_op = r.ops ? (double)r.ns / r.ops : 0;
+        os << "    {\"name\": \"" << r.name << "\""
+           << ", \"ops\": " << r.ops
+           << ", \"total_ns\": " << r.ns
+           << ", \"ns_per_op\": " << ns_per_op
+           << ", \"ops_per_sec\": " << (r.ns ? r.ops * 1e9 / r.ns : 0);
+        for(auto& e : r.extra) {
+            os << ", \"" << e.first << "\": " << e.second;
+        }
+        os << "}" << (i + 1 < s_results.size() ? "," : "") << std::endl;
+    }
+    os << "  ]" << std::endl
+       << "}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    for(int i = 1; i < argc; ++i) {
+        if(!strncmp(argv[i], "--filter=", 9)) {
+            s_filter = argv[i] + 9;
+        } else if(!strncmp(argv[i], "--min-ms=", 9)) {
+            s_min_ns = atoll(argv[i] + 9) * 1000000ull;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--filter=substr] [--min-ms=ms]" << std::endl;
+            return 1;
+        }
+    }
+    // 协程创建和调度器会输出 DEBUG/INFO 日志，避免混进 JSON
+    SYLAR_LOG_ROOT()->setLevel(sylar::LogLevel::ERROR);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+
+    Run("fiber_create_destroy", &BenchFiberCreate, 10000000);
+    Run("fiber_create_run_destroy", &BenchFiberLifecycle, 10000000);
+    Run("fiber_switch", &BenchFiberSwitch);
+    RunOnce("scheduler_yield", &BenchSchedulerYield, 1000000);
+    RunOnce("schedule_to_run_latency", &BenchScheduleLatency, 20000);
+    RunOnce("schedule_throughput", &BenchScheduleThroughput, 1000000);
+    Run("timer_add", &BenchTimerAdd, 2000000);
+    Run("timer_cancel", &BenchTimerCancel, 2000000);
+    Run("timer_add_local", &BenchTimerAddLocal, 2000000);
+    Run("timer_cancel_local", &BenchTimerCancelLocal, 2000000);
+    Run("timer_add_cancel_local", &BenchTimerAddCancelLocal, 2000000);
+    Run("timer_rearm_local", &BenchTimerRearmLocal, 2000000);
+    Run("timer_poll_local", &BenchTimerPollLocal);
+    Run("timer_expire", &BenchTimerExpire, 2000000);
+    RunOnce("socket_pingpong_epoll", &BenchSocketPingPongEpoll, 400000);
+    RunOnce("socket_pingpong_epoll_persistent", &BenchSocketPingPongEpollPersistent, 400000);
+    RunOnce("socket_pingpong_epoll_multi_reactor", &BenchSocketPingPongEpollMultiReactor, 400000);
+    RunOnce("socket_pingpong_io_uring", &BenchSocketPingPongUring, 400000);
+    Run("clock_realtime_ms", &BenchClockRealtime);
+    Run("clock_monotonic_ms", &BenchClockMonotonic);
+    Run("clock_coarse_ms", &BenchClockCoarse);
+    Run("clock_cached_ms", &BenchClockCached);
+    Run("log_format", &BenchLogFormat, 20000000);
+    Run("log_format_time", &BenchLogFormatTime, 20000000);
+    Run("bytearray_varint_encode", &BenchVarintEncode, 20000000);
+    Run("bytearray_varint_decode", &BenchVarintDecode, 20000000);
+    Run("http_request_parse", &BenchHttpParse);
+
+    PrintJson(std::cout);
+    return 0;
+}
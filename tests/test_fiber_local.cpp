@@ -0,0 +1,60 @@
+/**
+  ******************************************************************************
+  * @file           : test_fiber_local.cpp
+  * @author         : 18483
+  * @brief          : 协程局部存储
+  * @attention      : None
+  * @date           : 2025/4/18
+  ******************************************************************************
+  */
+
+
+#include "../sylar/sylar.h"
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static sylar::FiberLocal<uint64_t> s_request_id;
+static sylar::FiberLocal<std::string> s_trace;
+
+static std::atomic<int> s_done = {0};
+static std::atomic<int> s_migrated = {0};
+
+/// 多次让出，期间可能被其他线程恢复，局部值应跟着协程
+void handle(uint64_t id) {
+    // 调度器复用回调协程，上一个任务的值已经清空
+    SYLAR_ASSERT(!s_request_id.get());
+    SYLAR_ASSERT(!s_trace.get());
+    s_request_id.set(id);
+    s_trace.set("trace-" + std::to_string(id));
+    int thread = sylar::GetThreadId();
+    for(int i = 0; i < 10; ++i) {
+        usleep(1000);
+        SYLAR_ASSERT(*s_request_id.get() == id);
+        SYLAR_ASSERT(*s_trace == "trace-" + std::to_string(id));
+        if(sylar::GetThreadId() != thread) {
+            ++s_migrated;
+            thread = sylar::GetThreadId();
+        }
+    }
+    ++s_done;
+}
+
+int main(int argc, char** argv) {
+    const int count = 1000;
+    s_request_id.set(1);
+    {
+        sylar::IOManager iom(4, false, "local");
+        for(int i = 0; i < count; ++i) {
+            iom.schedule(std::bind(&handle, 1000 + i));
+        }
+    }
+    SYLAR_ASSERT(s_done == count);
+    // 线程主协程的值不受调度器中协程影响
+    SYLAR_ASSERT(*s_request_id.get() == 1);
+    SYLAR_ASSERT(!s_trace.get());
+    s_request_id.reset();
+    SYLAR_ASSERT(!s_request_id.get());
+    SYLAR_LOG_INFO(g_logger) << "fiber local ok, fibers=" << count
+                             << " migrated=" << s_migrated;
+    return 0;
+}
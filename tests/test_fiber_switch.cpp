@@ -0,0 +1,50 @@
+/**
+  ******************************************************************************
+  * @file           : test_fiber_switch.cpp
+  * @author         : 18483
+  * @brief          : 协程切换速度
+  * @attention      : 分别用 -DFIBER_ASM=ON/OFF 构建对比汇编和 ucontext 两种实现
+  * @date           : 2025/4/16
+  ******************************************************************************
+  */
+
+
+#include "../sylar/sylar.h"
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static uint64_t s_rounds = 0;
+
+/// 协程中不断切回主协程
+void ping() {
+    for(uint64_t i = 0; i < s_rounds; ++i) {
+        sylar::Fiber::GetThis()->back();
+    }
+}
+
+int main(int argc, char** argv) {
+    s_rounds = argc > 1 ? atoll(argv[1]) : 1000000;
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber(&ping, 0, true));
+
+    uint64_t begin = sylar::GetCurrentUS();
+    for(uint64_t i = 0; i <= s_rounds; ++i) {
+        fiber->call();
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    SYLAR_ASSERT(fiber->getState() == sylar::Fiber::TERM);
+
+    // 每轮 call + back 两次切换
+    uint64_t switches = s_rounds * 2;
+#ifdef SYLAR_FIBER_ASM
+    const char* backend = "asm";
+#else
+    const char* backend = "ucontext";
+#endif
+    SYLAR_LOG_INFO(g_logger) << "backend=" << backend
+                             << " switches=" << switches
+                             << " used=" << used << "us"
+                             << " ns_per_switch=" << used * 1000.0 / switches
+                             << " switches_per_sec=" << (uint64_t)(switches * 1000000.0 / used);
+    return 0;
+}
@@ -11,7 +11,11 @@
 
 #include "../sylar/hook.h"
 #include "../sylar/log.h"
+#include "../sylar/macro.h"
 #include "../sylar/iomanager.h"
+#include "../sylar/fd_manager.h"
+#include "../sylar/util.h"
+#include "../sylar/config.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -73,9 +77,210 @@ void test_sock(){
 
 }
 
+/// 反复超时和超时前收到数据，检查 SO_RCVTIMEO 的语义 (每次等待都复用 fd 的超时定时器)
+void test_recv_timeout() {
+    sylar::IOManager iom(2, false, "recv_timeout");
+    iom.schedule([&iom](){
+        int fds[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+            SYLAR_LOG_ERROR(g_logger) << "socketpair errno=" << errno;
+            return;
+        }
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        timeval tv = {0, 20 * 1000};
+        setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char c;
+        int timeouts = 0;
+        int early = 0;
+        for(int i = 0; i < 50; ++i) {
+            uint64_t start = sylar::GetMonotonicMS();
+            // 协程可能在其他线程恢复，这里不检查 errno (见 hook.cpp get_errno)
+            if(recv(fds[0], &c, 1, 0) == -1) {
+                ++timeouts;
+            }
+            if(sylar::GetMonotonicMS() - start < 20) {
+                ++early;
+            }
+        }
+
+        int received = 0;
+        int fd = fds[1];
+        for(int i = 0; i < 200; ++i) {
+            iom.addTimer(1, [fd](){
+                send(fd, "x", 1, 0);
+            });
+            if(recv(fds[0], &c, 1, 0) == 1) {
+                ++received;
+            }
+        }
+        SYLAR_LOG_INFO(g_logger) << "timeouts=" << timeouts << " expect=50 early=" << early
+                                 << " received=" << received << " expect=200";
+        SYLAR_ASSERT(timeouts == 50 && early == 0 && received == 200);
+        close(fds[0]);
+        close(fds[1]);
+    });
+}
+
+/// 本机 accept/connect/send/recv 回显，最后关闭等待中的 recv 所在的 fd，等待的协程应返回 EBADF
+void test_echo() {
+    sylar::IOManager iom(2, false, "echo");
+    iom.schedule([&iom](){
+        int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if(bind(listen_sock, (sockaddr*)&addr, sizeof(addr)) || listen(listen_sock, 16)
+                || getsockname(listen_sock, (sockaddr*)&addr, &len)) {
+            SYLAR_LOG_ERROR(g_logger) << "listen errno=" << errno;
+            return;
+        }
+
+        static std::atomic<int> closed_rt{0};
+        iom.schedule([listen_sock](){
+            sockaddr_in peer;
+            socklen_t peer_len = sizeof(peer);
+            int conn = accept(listen_sock, (sockaddr*)&peer, &peer_len);
+            SYLAR_LOG_INFO(g_logger) << "accept conn=" << conn << " peer_len=" << peer_len;
+            char buf[64];
+            ssize_t n;
+            while((n = recv(conn, buf, sizeof(buf), 0)) > 0) {
+                send(conn, buf, n, 0);
+            }
+            close(conn);
+            // 没有连接到来，accept 在 close 后返回
+            closed_rt = accept(listen_sock, nullptr, nullptr);
+        });
+
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        int rt = connect(sock, (const sockaddr*)&addr, sizeof(addr));
+        SYLAR_LOG_INFO(g_logger) << "connect rt=" << rt;
+        int echoed = 0;
+        for(int i = 0; i < 1000; ++i) {
+            char buf[64];
+            if(send(sock, "ping", 4, 0) == 4 && recv(sock, buf, sizeof(buf), 0) == 4) {
+                ++echoed;
+            }
+        }
+        close(sock);
+        sleep(1);
+        close(listen_sock);
+        sleep(1);
+        SYLAR_LOG_INFO(g_logger) << "echoed=" << echoed << " expect=1000"
+                                 << " accept after close=" << closed_rt << " expect=-1";
+        SYLAR_ASSERT(echoed == 1000 && closed_rt == -1);
+    });
+}
+
+/// 共享栈协程在 io_uring 后端下 recv 到栈上的缓冲区，挂起期间栈被同线程的其他协程覆盖，数据不能错乱
+void test_shared_stack_recv() {
+    sylar::Config::Lookup<bool>("scheduler.shared_stack")->setValue(true);
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("io_uring");
+    static std::atomic<int> ok{0};
+    ok = 0;
+    {
+        sylar::IOManager iom(2, false, "shared_recv");
+        for(int i = 0; i < 16; ++i) {
+            int fds[2];
+            if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+                SYLAR_LOG_ERROR(g_logger) << "socketpair errno=" << errno;
+                return;
+            }
+            sylar::FdMgr::GetInstance()->get(fds[0], true);
+            sylar::FdMgr::GetInstance()->get(fds[1], true);
+            iom.schedule([fds, i](){
+                char buf[64];
+                memset(buf, 0, sizeof(buf));
+                if(recv(fds[0], buf, sizeof(buf), 0) == 8 && buf[0] == 'a' + i && buf[7] == 'a' + i) {
+                    ++ok;
+                }
+                close(fds[0]);
+            });
+            iom.schedule([fds, i](){
+                usleep(10 * 1000 * (i % 4 + 1));
+                char buf[8];
+                memset(buf, 'a' + i, sizeof(buf));
+                send(fds[1], buf, sizeof(buf), 0);
+                close(fds[1]);
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "shared stack recv ok=" << ok << " expect=16";
+    SYLAR_ASSERT(ok == 16);
+    sylar::Config::Lookup<bool>("scheduler.shared_stack")->setValue(false);
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("epoll");
+}
+
+/// 未 hook 的 close 关闭已等待过的 fd，句柄号被新 socket 复用后仍然能等到事件 (持久注册模式)
+void test_unhooked_close_reuse() {
+    static std::atomic<int> ok{0};
+    ok = 0;
+    {
+        sylar::IOManager iom(2, false, "close_reuse");
+        iom.schedule([&iom](){
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            int sender = socket(AF_INET, SOCK_DGRAM, 0);
+            int old_fd = -1;
+            for(int i = 0; i < 2; ++i) {
+                int fd = socket(AF_INET, SOCK_DGRAM, 0);
+                socklen_t len = sizeof(addr);
+                addr.sin_port = 0;
+                bind(fd, (sockaddr*)&addr, len);
+                getsockname(fd, (sockaddr*)&addr, &len);
+                timeval tv = {0, 500 * 1000};
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                iom.addTimer(10, [sender, addr](){
+                    sendto(sender, "x", 1, 0, (const sockaddr*)&addr, sizeof(addr));
+                });
+                char c;
+                if(recv(fd, &c, 1, 0) == 1) {
+                    ++ok;
+                }
+                if(i == 0) {
+                    old_fd = fd;
+                    sylar::set_hook_enable(false);
+                    close(fd);
+                    sylar::set_hook_enable(true);
+                } else {
+                    SYLAR_LOG_INFO(g_logger) << "old_fd=" << old_fd << " new_fd=" << fd;
+                    close(fd);
+                }
+            }
+            close(sender);
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "unhooked close reuse ok=" << ok << " expect=2";
+    SYLAR_ASSERT(ok == 2);
+}
 
 int main(int argc, char** argv) {
     //test_sleep();
+    // epoll、epoll 持久注册、多 reactor、io_uring 各跑一遍，配置只影响之后创建的 IOManager
+    struct Mode {
+        const char* backend;
+        bool persistent_events;
+        bool multi_reactor;
+    };
+    for(auto& mode : {Mode{"epoll", false, false}, Mode{"epoll", true, false}
+                    , Mode{"epoll", false, true}, Mode{"epoll", true, true}
+                    , Mode{"io_uring", false, false}}) {
+        sylar::Config::Lookup<std::string>("iomanager.backend")->setValue(mode.backend);
+        sylar::Config::Lookup<bool>("iomanager.persistent_events")->setValue(mode.persistent_events);
+        sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(mode.multi_reactor);
+        SYLAR_LOG_INFO(g_logger) << "backend=" << mode.backend
+                                 << " persistent_events=" << mode.persistent_events
+                                 << " multi_reactor=" << mode.multi_reactor;
+        test_recv_timeout();
+        test_echo();
+        test_unhooked_close_reuse();
+    }
+    test_shared_stack_recv();
 
     sylar::IOManager iom;
     iom.schedule(test_sock);
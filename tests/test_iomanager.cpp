@@ -68,8 +68,9 @@ void test1(){
 sylar::Timer::ptr s_timer;
 void test_timer() {
     sylar::IOManager iom(2, false, "timer");
+    static int i = 0;
+    i = 0;
     s_timer = iom.addTimer(1000, []()->void{
-        static int i = 0;
         SYLAR_LOG_INFO(g_logger) << "hello timer i=" << i;
         if(++i == 3) {
             //s_timer->reset(2000, true);
@@ -78,10 +79,111 @@ void test_timer() {
     }, true);
 }
 
+/// 大量不同间隔的定时器，检查不会提前触发，取消的不会触发
+void test_timer_many() {
+    static std::atomic<int> fired{0};
+    static std::atomic<int> early{0};
+    fired = 0;
+    early = 0;
+    int expect = 0;
+    {
+        sylar::IOManager iom(2, false, "timers");
+        std::vector<sylar::Timer::ptr> cancelled;
+        for(int i = 0; i < 2000; ++i) {
+            uint64_t ms = (i * 7919) % 1500;
+            uint64_t deadline = sylar::GetMonotonicMS() + ms;
+            auto timer = iom.addTimer(ms, [deadline](){
+                if(sylar::GetMonotonicMS() < deadline) {
+                    ++early;
+                }
+                ++fired;
+            });
+            // 只取消较晚到期的定时器，取消之前不会已经触发
+            if(i % 4 == 0 && ms >= 200) {
+                cancelled.push_back(timer);
+            } else {
+                ++expect;
+            }
+        }
+        for(auto& i : cancelled) {
+            i->cancle();
+        }
+        iom.addTimer(1600, [&iom, expect](){
+            std::stringstream ss;
+            iom.dumpTimers(ss);
+            SYLAR_LOG_INFO(g_logger) << "fired=" << fired << " expect=" << expect
+                                     << " early=" << early << " " << ss.str();
+        });
+    }
+    SYLAR_ASSERT(fired == expect && early == 0);
+}
+
+/// 共享定时器队列取空之后，非工作线程再添加的定时器仍要唤醒阻塞在 epoll 中的空闲线程
+void test_timer_after_empty() {
+    sylar::IOManager iom(2, false, "timer_empty");
+    static std::atomic<int> fired{0};
+    fired = 0;
+    iom.addTimer(50, [](){ ++fired; });
+    usleep(300 * 1000);
+    uint64_t begin = sylar::GetMonotonicMS();
+    iom.addTimer(50, [](){ ++fired; });
+    while(fired < 2 && sylar::GetMonotonicMS() - begin < 2000) {
+        usleep(1000);
+    }
+    SYLAR_LOG_INFO(g_logger) << "timer after empty fired=" << fired << " expect=2"
+                             << " ms=" << sylar::GetMonotonicMS() - begin << " expect~50";
+    SYLAR_ASSERT(fired == 2);
+}
+
+/// 有线程在 idle 中自旋时析构 IOManager，停止的唤醒不能因为自旋而被省略
+/// (自旋只在多核上开启，单核时退化为普通的停止)
+void test_stop_while_spinning() {
+    auto spin_us = sylar::Config::Lookup<uint32_t>("iomanager.spin_us");
+    uint32_t old_spin = spin_us->getValue();
+    spin_us->setValue(200 * 1000);
+    for(int round = 0; round < 3; ++round) {
+        uint64_t begin = 0;
+        {
+            sylar::IOManager iom(3, false, "stop_spin");
+            // 等所有线程进入 epoll_pwait
+            usleep(20 * 1000);
+            std::atomic<bool> done{false};
+            iom.schedule([&done](){ done = true; });
+            while(!done) {
+            }
+            // 执行任务的线程回到 idle 后开始自旋
+            begin = sylar::GetMonotonicMS();
+        }
+        uint64_t used = sylar::GetMonotonicMS() - begin;
+        SYLAR_LOG_INFO(g_logger) << "stop while spinning round=" << round << " used=" << used << "ms";
+        // 自旋 200ms，停止不能等自旋结束
+        SYLAR_ASSERT(used < 100);
+    }
+    spin_us->setValue(old_spin);
+}
+
 int main(int argc, char** argv) {
     //test1();
 
-    test_timer();
+    // 两种后端各跑一遍，iomanager.backend 只影响之后创建的 IOManager
+    for(auto& backend : {"epoll", "io_uring"}) {
+        sylar::Config::Lookup<std::string>("iomanager.backend")->setValue(backend);
+        SYLAR_LOG_INFO(g_logger) << "backend=" << backend;
+        test_timer();
+        test_timer_many();
+        test_timer_after_empty();
+    }
+
+    // timerfd 关闭时阻塞的线程最多等待 3 秒，开启时没有超时，停止的唤醒丢失就会一直阻塞
+    for(bool timerfd : {false, true}) {
+        sylar::Config::Lookup<bool>("iomanager.timerfd")->setValue(timerfd);
+        for(bool multi_reactor : {false, true}) {
+            sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(multi_reactor);
+            SYLAR_LOG_INFO(g_logger) << "timerfd=" << timerfd << " multi_reactor=" << multi_reactor;
+            test_stop_while_spinning();
+        }
+    }
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(false);
 
     return 0;
 }
@@ -10,6 +10,7 @@
 
 
 # include "../sylar/sylar.h"
+# include "../sylar/stack_profiler.h"
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -23,7 +24,369 @@ void test_scheduler(){
     }
 }
 
+/// 每个线程投递的指定线程任务数
+static const int s_pinned_count = 5000;
+static std::atomic<int> s_pinned_done = {0};
+
+void pinned_task(int thread) {
+    SYLAR_ASSERT(sylar::GetThreadId() == thread);
+    ++s_pinned_done;
+}
+
+/// 每个工作线程给自己投递大量指定线程任务，统计取任务的平均耗时
+void test_pinned_pickup() {
+    const int threads = 4;
+    sylar::Scheduler sc(threads, false, "pinned");
+    sc.start();
+
+    s_pinned_done = 0;
+    uint64_t begin = sylar::GetCurrentUS();
+    for(int i = 0; i < threads; ++i) {
+        sc.schedule([](){
+            int thread = sylar::GetThreadId();
+            for(int j = 0; j < s_pinned_count; ++j) {
+                sylar::Scheduler::GetThis()->schedule(std::bind(&pinned_task, thread), thread);
+            }
+        });
+    }
+    while(s_pinned_done < threads * s_pinned_count) {
+        usleep(1000);
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    SYLAR_LOG_INFO(g_logger) << "pinned tasks=" << threads * s_pinned_count
+                             << " used=" << used << "us"
+                             << " per_task=" << used * 1000.0 / (threads * s_pinned_count) << "ns";
+    sc.stop();
+}
+
+/// 超过内部缓冲区或对齐要求更高的可调用对象存放在堆上
+struct alignas(64) AlignedTask {
+    std::atomic<int>* done;
+    void operator()() {
+        SYLAR_ASSERT((uintptr_t)this % 64 == 0);
+        ++*done;
+    }
+};
+
+void test_large_task() {
+    sylar::Scheduler sc(2, false, "large");
+    sc.start();
+    std::atomic<int> done = {0};
+    char big[200];
+    memset(big, 'x', sizeof(big));
+    for(int i = 0; i < 100; ++i) {
+        sc.schedule([big, &done](){
+            SYLAR_ASSERT(big[0] == 'x' && big[sizeof(big) - 1] == 'x');
+            ++done;
+        });
+        sc.schedule(AlignedTask{&done});
+    }
+    sc.stop();
+    SYLAR_ASSERT(done == 200);
+    SYLAR_LOG_INFO(g_logger) << "large tasks done=" << done;
+}
+
+/// 执行顺序记录 (单线程调度器，无需加锁)
+static std::vector<sylar::Scheduler::Priority> s_prio_order;
+
+void prio_task(sylar::Scheduler::Priority prio) {
+    s_prio_order.push_back(prio);
+}
+
+/// 先投递一批后台任务再投递高优先级任务，高优先级任务应插到前面执行，后台任务也不会饿死
+void test_priority() {
+    const int background = 64;
+    const int high = 16;
+    sylar::Scheduler sc(1, false, "prio");
+    sc.start();
+    sc.schedule([](){
+        sylar::Scheduler* self = sylar::Scheduler::GetThis();
+        for(int i = 0; i < background; ++i) {
+            self->schedule(std::bind(&prio_task, sylar::Scheduler::BACKGROUND)
+                           , -1, sylar::Scheduler::BACKGROUND);
+        }
+        for(int i = 0; i < high; ++i) {
+            self->schedule(std::bind(&prio_task, sylar::Scheduler::HIGH)
+                           , -1, sylar::Scheduler::HIGH);
+        }
+        std::stringstream ss;
+        self->dump(ss);
+        SYLAR_LOG_INFO(g_logger) << ss.str();
+    });
+    sc.stop();
+
+    SYLAR_ASSERT(s_prio_order.size() == (size_t)(background + high));
+    size_t last_high = 0;
+    for(size_t i = 0; i < s_prio_order.size(); ++i) {
+        if(s_prio_order[i] == sylar::Scheduler::HIGH) {
+            last_high = i;
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "priority last_high=" << last_high
+                             << " first=" << sylar::Scheduler::PriorityToString(s_prio_order[0]);
+    SYLAR_ASSERT(s_prio_order[0] == sylar::Scheduler::HIGH);
+    SYLAR_ASSERT(last_high < (size_t)(high * 2));
+}
+
+/// 执行一批任务后检查统计快照
+void test_stats() {
+    const int tasks = 1000;
+    sylar::Scheduler sc(2, false, "stats");
+    sc.start();
+    for(int i = 0; i < tasks; ++i) {
+        sc.schedule([](){
+            uint64_t begin = sylar::GetCurrentUS();
+            while(sylar::GetCurrentUS() - begin < 10);
+        });
+    }
+    sc.stop();
+
+    std::vector<sylar::Scheduler::WorkerStats> stats;
+    sc.getStats(stats);
+    sylar::Histogram::Snapshot wait, run;
+    for(auto& i : stats) {
+        std::stringstream ss;
+        ss << "worker[" << i.worker << "] switches=" << i.switches << " run: ";
+        i.runTime.dump(ss);
+        SYLAR_LOG_INFO(g_logger) << ss.str();
+        wait.merge(i.queueWait);
+        run.merge(i.runTime);
+    }
+    SYLAR_ASSERT(wait.count == (uint64_t)tasks);
+    SYLAR_ASSERT(run.count == (uint64_t)tasks);
+    SYLAR_ASSERT(run.percentile(0.5) >= 10);
+}
+
+/// 不让出的任务应被看门狗发现并计数
+void test_watchdog() {
+    auto watchdog_ms = sylar::Config::Lookup<uint32_t>("scheduler.watchdog_ms");
+    watchdog_ms->setValue(50);
+    sylar::Scheduler sc(1, false, "watchdog");
+    sc.start();
+    sc.schedule([](){
+        uint64_t begin = sylar::GetCurrentUS();
+        while(sylar::GetCurrentUS() - begin < 200 * 1000);
+    });
+    sc.stop();
+    watchdog_ms->setValue(0);
+
+    std::map<std::string, uint64_t> hits;
+    sc.getWatchdogHits(hits);
+    for(auto& i : hits) {
+        SYLAR_LOG_INFO(g_logger) << "watchdog hits=" << i.second << " callsite=" << i.first;
+    }
+    SYLAR_ASSERT(hits.size() == 1 && hits.begin()->second == 1);
+}
+
+/// 在栈上用掉约 32KB
+void stack_deep() {
+    volatile char buf[32 * 1024];
+    for(size_t i = 0; i < sizeof(buf); i += 512) {
+        buf[i] = (char)i;
+    }
+}
+
+static std::atomic<uint32_t> s_shallow_stack = {0};
+
+void stack_shallow() {
+    s_shallow_stack = sylar::Fiber::GetThis()->getStackSize();
+}
+
+/// 记录各入口的栈用量，样本足够后浅栈入口换用小栈
+void test_stack_profile() {
+    auto adaptive = sylar::Config::Lookup<bool>("fiber.stack_adaptive");
+    auto samples = sylar::Config::Lookup<uint32_t>("fiber.stack_adaptive_samples");
+    adaptive->setValue(true);
+    samples->setValue(4);
+    sylar::Scheduler sc(1, false, "stack");
+    sc.start();
+    for(int i = 0; i < 8; ++i) {
+        sc.schedule(&stack_deep);
+        sc.schedule(&stack_shallow);
+    }
+    sc.stop();
+    adaptive->setValue(false);
+
+    std::vector<sylar::StackProfiler::Usage> usages;
+    sylar::StackProfiler::ListAll(usages);
+    std::stringstream ss;
+    sylar::StackProfiler::Dump(ss);
+    SYLAR_LOG_INFO(g_logger) << ss.str();
+    // 可执行文件里的函数不一定能解析出符号名，按用量区分两个入口
+    bool deep = false;
+    bool shallow = false;
+    for(auto& u : usages) {
+        if(u.used.count != 8) {
+            continue;
+        }
+        if(u.used.max >= 32 * 1024) {
+            deep = true;
+        } else if(u.used.max < 16 * 1024) {
+            shallow = true;
+        }
+    }
+    SYLAR_ASSERT(deep && shallow);
+    SYLAR_ASSERT(s_shallow_stack == 16 * 1024);
+}
+
+static std::atomic<int> s_elastic_busy = {0};
+static std::atomic<int> s_elastic_timers = {0};
+static std::atomic<int> s_elastic_pinned = {0};
+static sylar::Mutex s_elastic_mutex;
+static std::set<int> s_elastic_workers;
+
+/// 投递一批不让出的任务，直到排队延迟让线程数增长，返回期间的最大线程数
+size_t elastic_grow(sylar::IOManager& iom) {
+    const int tasks = 200;
+    s_elastic_busy = 0;
+    for(int i = 0; i < tasks; ++i) {
+        iom.schedule([](){
+            {
+                sylar::Mutex::Lock lock(s_elastic_mutex);
+                s_elastic_workers.insert(sylar::GetThreadId());
+            }
+            uint64_t begin = sylar::GetCurrentUS();
+            while(sylar::GetCurrentUS() - begin < 2000);
+            ++s_elastic_busy;
+        });
+    }
+    size_t max_seen = 0;
+    while(s_elastic_busy < tasks) {
+        max_seen = std::max(max_seen, iom.getThreadCount());
+        usleep(1000);
+    }
+    SYLAR_LOG_INFO(g_logger) << "elastic grow max_threads=" << max_seen;
+    return max_seen;
+}
+
+/// 给所有出现过的工作线程 (包括已经退出的) 各投递一个指定线程任务，返回投递数
+int elastic_pin_all(sylar::IOManager& iom) {
+    sylar::Mutex::Lock lock(s_elastic_mutex);
+    for(int thread : s_elastic_workers) {
+        iom.schedule([](){ ++s_elastic_pinned; }, thread);
+    }
+    return s_elastic_workers.size();
+}
+
+/// 弹性线程池: 排队延迟升高时增加线程，空闲后收缩回下限
+/// 退出线程上未到期的定时器和投递给它的指定线程任务都要在其他线程上执行
+void test_elastic() {
+    auto max_threads = sylar::Config::Lookup<std::map<std::string, uint32_t> >("scheduler.max_threads");
+    auto grow_latency = sylar::Config::Lookup<uint32_t>("scheduler.grow_latency_us");
+    auto grow_interval = sylar::Config::Lookup<uint32_t>("scheduler.grow_interval_ms");
+    auto retire_idle = sylar::Config::Lookup<uint32_t>("scheduler.retire_idle_ms");
+    auto old_max = max_threads->getValue();
+    uint32_t old_latency = grow_latency->getValue();
+    uint32_t old_interval = grow_interval->getValue();
+    uint32_t old_idle = retire_idle->getValue();
+    auto conf = old_max;
+    conf["elastic"] = 4;
+    max_threads->setValue(conf);
+    grow_latency->setValue(1000);
+    grow_interval->setValue(10);
+    retire_idle->setValue(100);
+
+    int timers = 0;
+    int pinned = 0;
+    {
+        sylar::IOManager iom(1, false, "elastic");
+        SYLAR_ASSERT(iom.getThreadCount() == 1);
+        SYLAR_ASSERT(elastic_grow(iom) > 1);
+
+        // 线程第一次进入 idle 时才有自己的定时器分片，等所有线程空闲后
+        // 在每个线程上加一个比空闲退出晚到期的定时器，线程退出时它还留在分片中
+        usleep(50 * 1000);
+        {
+            sylar::Mutex::Lock lock(s_elastic_mutex);
+            for(int thread : s_elastic_workers) {
+                iom.schedule([&iom](){
+                    iom.addTimer(6000, [](){ ++s_elastic_timers; });
+                }, thread);
+                ++timers;
+            }
+        }
+        usleep(50 * 1000);
+        std::stringstream ss;
+        iom.dumpTimers(ss);
+        SYLAR_LOG_INFO(g_logger) << "elastic timers " << ss.str();
+
+        // 空闲线程最长 3 秒醒来一次，检查是否空闲过久
+        uint64_t begin = sylar::GetMonotonicMS();
+        while(iom.getThreadCount() > 1 && sylar::GetMonotonicMS() - begin < 15000) {
+            usleep(1000);
+        }
+        SYLAR_LOG_INFO(g_logger) << "elastic shrink threads=" << iom.getThreadCount()
+                                 << " used=" << sylar::GetMonotonicMS() - begin << "ms";
+        SYLAR_ASSERT(iom.getThreadCount() == 1);
+
+        // 已退出的线程也可以作为目标，任务改由其他线程执行
+        pinned += elastic_pin_all(iom);
+
+        // 再次增长后让每个线程阻塞在一个任务中，给它们投递指定线程任务，再调低上限
+        // 多出的线程带着 mailbox 中的任务进入退出流程，这些任务仍要执行
+        {
+            sylar::Mutex::Lock lock(s_elastic_mutex);
+            s_elastic_workers.clear();
+        }
+        SYLAR_ASSERT(elastic_grow(iom) > 1);
+        usleep(50 * 1000);
+        static std::atomic<bool> s_release = {false};
+        static std::atomic<int> s_blocked = {0};
+        int blockers = 0;
+        {
+            sylar::Mutex::Lock lock(s_elastic_mutex);
+            for(int thread : s_elastic_workers) {
+                iom.schedule([](){
+                    ++s_blocked;
+                    while(!s_release);
+                }, thread);
+                ++blockers;
+            }
+        }
+        while(s_blocked < blockers) {
+            usleep(1000);
+        }
+        for(int i = 0; i < 10; ++i) {
+            pinned += elastic_pin_all(iom);
+        }
+        iom.setThreadRange(1, 1);
+        s_release = true;
+        begin = sylar::GetMonotonicMS();
+        while(iom.getThreadCount() > 1 && sylar::GetMonotonicMS() - begin < 5000) {
+            usleep(1000);
+        }
+        SYLAR_ASSERT(iom.getThreadCount() == 1);
+        pinned += elastic_pin_all(iom);
+
+        begin = sylar::GetMonotonicMS();
+        while((s_elastic_timers < timers || s_elastic_pinned < pinned)
+                && sylar::GetMonotonicMS() - begin < 10000) {
+            usleep(1000);
+        }
+        ss.str("");
+        iom.dump(ss);
+        SYLAR_LOG_INFO(g_logger) << "elastic timers=" << s_elastic_timers << "/" << timers
+                                 << " pinned=" << s_elastic_pinned << "/" << pinned
+                                 << " workers=" << s_elastic_workers.size() << " " << ss.str();
+        SYLAR_ASSERT(s_elastic_timers == timers);
+        SYLAR_ASSERT(s_elastic_pinned == pinned);
+    }
+
+    max_threads->setValue(old_max);
+    grow_latency->setValue(old_latency);
+    grow_interval->setValue(old_interval);
+    retire_idle->setValue(old_idle);
+}
+
 int main(int argc, char** argv) {
+    test_pinned_pickup();
+    test_large_task();
+    test_priority();
+    test_stats();
+    test_watchdog();
+    test_stack_profile();
+    test_elastic();
+
     SYLAR_LOG_INFO(g_logger) << "main";
     // 创建调度器
     sylar::Scheduler sc(2, false, "test");